@@ -21,6 +21,8 @@
 #include <linux/mm.h>
 #include <linux/list.h>
 #include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/moduleparam.h>
 #include <linux/android_pmem.h>
 #include <linux/mempolicy.h>
 #include <linux/sched.h>
@@ -29,7 +31,6 @@
 #include <asm/cacheflush.h>
 
 #define PMEM_MAX_DEVICES 10
-#define PMEM_MAX_ORDER 128
 #define PMEM_MIN_ALLOC PAGE_SIZE
 
 #define PMEM_DEBUG 1
@@ -79,11 +80,19 @@ struct pmem_data {
 #if PMEM_DEBUG
 	int ref;
 #endif
+	/* set once the physical address of the allocation has been handed
+	 * out (mmap, connect, get_pmem_file, PMEM_GET_PHYS...), after which
+	 * pmem_compact may no longer move it */
+	unsigned fixed;
 };
 
+/* The region is a sequence of extents, free or allocated. Each extent
+ * carries the same tag in its first and in its last entry, so that on free
+ * it can be merged with both neighbours without walking the region. The
+ * entries in between are stale. */
 struct pmem_bits {
 	unsigned allocated:1;		/* 1 if allocated, 0 if free */
-	unsigned order:7;		/* size of the region in pmem space */
+	unsigned pages:31;		/* length of the extent, in entries */
 };
 
 struct pmem_region_node {
@@ -113,11 +122,13 @@ struct pmem_info {
 	unsigned long num_entries;
 	/* pfn of the garbage page in memory */
 	unsigned long garbage_pfn;
-	/* index of the garbage page in the pmem space */
-	int garbage_index;
-	/* the bitmap for the region indicating which entries are allocated
-	 * and which are free */
+	/* the extent tags for the region indicating which entries are
+	 * allocated and which are free */
 	struct pmem_bits *bitmap;
+	/* allocator statistics, protected by bitmap_sem */
+	unsigned long alloc_failures;
+	unsigned long compactions;
+	unsigned long relocations;
 	/* indicates the region should not be managed with an allocator */
 	unsigned no_allocator;
 	/* indicates maps of this region should be cached, if a mix of
@@ -144,6 +155,9 @@ struct pmem_info {
 	 *
 	 * IF YOU TAKE BOTH LOCKS TAKE THEM IN THIS ORDER:
 	 * down(pmem_data->sem) => down(bitmap_sem)
+	 *
+	 * pmem_compact runs under bitmap_sem and so only ever trylocks the
+	 * data_list_sem and the pmem_data->sem of the allocations it moves.
 	 */
 	struct rw_semaphore bitmap_sem;
 
@@ -155,12 +169,11 @@ static struct pmem_info pmem[PMEM_MAX_DEVICES];
 static int id_count;
 
 #define PMEM_IS_FREE(id, index) !(pmem[id].bitmap[index].allocated)
-#define PMEM_ORDER(id, index) pmem[id].bitmap[index].order
-#define PMEM_BUDDY_INDEX(id, index) (index ^ (1 << PMEM_ORDER(id, index)))
-#define PMEM_NEXT_INDEX(id, index) (index + (1 << PMEM_ORDER(id, index)))
+#define PMEM_PAGES(id, index) pmem[id].bitmap[index].pages
+#define PMEM_NEXT_INDEX(id, index) (index + PMEM_PAGES(id, index))
 #define PMEM_OFFSET(index) (index * PMEM_MIN_ALLOC)
 #define PMEM_START_ADDR(id, index) (PMEM_OFFSET(index) + pmem[id].base)
-#define PMEM_LEN(id, index) ((1 << PMEM_ORDER(id, index)) * PMEM_MIN_ALLOC)
+#define PMEM_LEN(id, index) (PMEM_PAGES(id, index) * PMEM_MIN_ALLOC)
 #define PMEM_END_ADDR(id, index) (PMEM_START_ADDR(id, index) + \
 	PMEM_LEN(id, index))
 #define PMEM_START_VADDR(id, index) (PMEM_OFFSET(id, index) + pmem[id].vbase)
@@ -234,43 +247,51 @@ static int is_master_owner(struct file *file)
 	return ret;
 }
 
+/* relocate unmapped allocations to make room for ones that do not fit */
+static int pmem_relocate = 1;
+module_param_named(relocate, pmem_relocate, bool, S_IRUGO | S_IWUSR);
+
+static void pmem_set_extent(int id, int index, unsigned long pages,
+			    int allocated)
+{
+	/* caller should hold the write lock on pmem_sem! */
+	struct pmem_bits *first = &pmem[id].bitmap[index];
+	struct pmem_bits *last = &pmem[id].bitmap[index + pages - 1];
+
+	first->pages = last->pages = pages;
+	first->allocated = last->allocated = allocated;
+}
+
 static int pmem_free(int id, int index)
 {
 	/* caller should hold the write lock on pmem_sem! */
-	int buddy, curr = index;
+	unsigned long pages;
+	int next;
 	DLOG("index %d\n", index);
 
 	if (pmem[id].no_allocator) {
 		pmem[id].allocated = 0;
 		return 0;
 	}
-	/* clean up the bitmap, merging any buddies */
-	pmem[id].bitmap[curr].allocated = 0;
-	/* find a slots buddy Buddy# = Slot# ^ (1 << order)
-	 * if the buddy is also free merge them
-	 * repeat until the buddy is not free or end of the bitmap is reached
-	 */
-	do {
-		buddy = PMEM_BUDDY_INDEX(id, curr);
-		if (buddy < pmem[id].num_entries &&
-			PMEM_IS_FREE(id, buddy) &&
-				PMEM_ORDER(id, buddy) == PMEM_ORDER(id, curr)) {
-			PMEM_ORDER(id, buddy)++;
-			PMEM_ORDER(id, curr)++;
-			curr = min(buddy, curr);
-		} else {
-			break;
-		}
-	} while (curr < pmem[id].num_entries);
+
+	/* merge with the following extent if it is free, and with the
+	 * preceding one, found through the tag in its last entry */
+	pages = PMEM_PAGES(id, index);
+	next = index + pages;
+	if (next < pmem[id].num_entries && PMEM_IS_FREE(id, next))
+		pages += PMEM_PAGES(id, next);
+	if (index > 0 && PMEM_IS_FREE(id, index - 1)) {
+		index -= PMEM_PAGES(id, index - 1);
+		pages += PMEM_PAGES(id, index);
+	}
+	pmem_set_extent(id, index, pages, 0);
 
 #ifdef PMEM_LOG
 	int i;
-	for(i=0;i<pmem[id].num_entries;i++)
-	if(pmem[id].bitmap[i].order>0 || i>=pmem[id].num_entries ) {
-		printk("free==>index=%d , order=%d , allocated=%d\n",
-			i,pmem[id].bitmap[i].order,
+	for (i = 0; i < pmem[id].num_entries; i = PMEM_NEXT_INDEX(id, i))
+		printk("free==>index=%d , pages=%d , allocated=%d\n",
+			i, pmem[id].bitmap[i].pages,
 			pmem[id].bitmap[i].allocated);
-	}
 #endif
 	return 0;
 }
@@ -361,6 +382,7 @@ static int pmem_open(struct inode *inode, struct file *file)
 	data->vma = NULL;
 	data->pid = 0;
 	data->master_file = NULL;
+	data->fixed = 0;
 #if PMEM_DEBUG
 	data->ref = 0;
 #endif
@@ -376,26 +398,140 @@ static int pmem_open(struct inode *inode, struct file *file)
 	return ret;
 }
 
-static unsigned long pmem_order(unsigned long len)
+static unsigned long pmem_pages(unsigned long len)
 {
-	int i;
+	return (len + PMEM_MIN_ALLOC - 1) / PMEM_MIN_ALLOC;
+}
 
-	len = (len + PMEM_MIN_ALLOC - 1)/PMEM_MIN_ALLOC;
-	len--;
-	for (i = 0; i < sizeof(len)*8; i++)
-		if (len >> i == 0)
+static int pmem_best_fit(int id, unsigned long pages)
+{
+	/* caller should hold the write lock on pmem_sem! */
+	int curr, best_fit = -1;
+
+	/* use the smallest free extent that is large enough, stopping early
+	 * on an exact fit */
+	for (curr = 0; curr < pmem[id].num_entries;
+	     curr = PMEM_NEXT_INDEX(id, curr)) {
+		if (!PMEM_IS_FREE(id, curr) || PMEM_PAGES(id, curr) < pages)
+			continue;
+		if (best_fit < 0 ||
+		    PMEM_PAGES(id, curr) < PMEM_PAGES(id, best_fit))
+			best_fit = curr;
+		if (PMEM_PAGES(id, curr) == pages)
 			break;
-	return i;
+	}
+	return best_fit;
+}
+
+/* returns the owner of the allocation at index with its sem held for
+ * writing, if that allocation may be moved */
+static struct pmem_data *pmem_lock_movable(int id, int index)
+{
+	/* caller should hold data_list_sem */
+	struct pmem_data *data, *owner = NULL;
+
+	list_for_each_entry(data, &pmem[id].data_list, list) {
+		if (data->index != index)
+			continue;
+		/* another file is connected to this allocation */
+		if (data->flags & PMEM_FLAGS_CONNECTED)
+			return NULL;
+		owner = data;
+	}
+
+	/* the caller may hold its own data->sem, only ever trylock others */
+	if (!owner || !down_write_trylock(&owner->sem))
+		return NULL;
+	if (owner->index != index || owner->fixed ||
+	    (owner->flags & (PMEM_FLAGS_BUSY | PMEM_FLAGS_MASTERMAP))) {
+		up_write(&owner->sem);
+		return NULL;
+	}
+	return owner;
+}
+
+static void pmem_move(int id, int from, int to, unsigned long pages)
+{
+	void *dst = pmem[id].vbase + PMEM_OFFSET(to);
+	unsigned long len = pages * PMEM_MIN_ALLOC;
+
+	memmove(dst, pmem[id].vbase + PMEM_OFFSET(from), len);
+	if (pmem[id].cached) {
+		dmac_flush_range(dst, dst + len);
+#ifdef CONFIG_OUTER_CACHE
+		outer_flush_range(PMEM_START_ADDR(id, to),
+				  PMEM_START_ADDR(id, to) + len);
+#endif
+	}
+}
+
+/*
+ * pmem_compact - slide movable allocations towards the start of the region
+ * so the free space around them coalesces.
+ *
+ * An allocation is movable as long as its address never left the driver:
+ * it has not been mapped or connected to, and nobody asked for its physical
+ * address. Owners are only trylocked, anything busy stays where it is.
+ * Returns the number of allocations moved.
+ */
+static int pmem_compact(int id)
+{
+	/* caller should hold the write lock on pmem_sem! */
+	struct pmem_data *data;
+	unsigned long pages;
+	int curr, dst = 0, moved = 0;
+
+	/* data_list_sem nests outside data->sem, which the caller may hold */
+	if (!pmem_relocate || down_trylock(&pmem[id].data_list_sem))
+		return 0;
+
+	for (curr = 0; curr < pmem[id].num_entries; curr += pages) {
+		pages = PMEM_PAGES(id, curr);
+		if (PMEM_IS_FREE(id, curr))
+			continue;
+
+		data = dst < curr ? pmem_lock_movable(id, curr) : NULL;
+		if (!data) {
+			dst = curr + pages;
+			continue;
+		}
+
+		pmem_move(id, curr, dst, pages);
+		pmem_set_extent(id, dst, pages, 1);
+		pmem_set_extent(id, dst + pages, curr - dst, 0);
+		data->index = dst;
+		up_write(&data->sem);
+
+		dst += pages;
+		moved++;
+	}
+	up(&pmem[id].data_list_sem);
+
+	/* now merge the runs of free extents left behind */
+	for (curr = 0; curr < pmem[id].num_entries;
+	     curr = PMEM_NEXT_INDEX(id, curr)) {
+		int next = PMEM_NEXT_INDEX(id, curr);
+
+		while (PMEM_IS_FREE(id, curr) && next < pmem[id].num_entries &&
+		       PMEM_IS_FREE(id, next)) {
+			pmem_set_extent(id, curr, PMEM_PAGES(id, curr) +
+					PMEM_PAGES(id, next), 0);
+			next = PMEM_NEXT_INDEX(id, curr);
+		}
+	}
+
+	pmem[id].compactions++;
+	pmem[id].relocations += moved;
+	return moved;
 }
 
 static int pmem_allocate(int id, unsigned long len)
 {
 	/* caller should hold the write lock on pmem_sem! */
 	/* return the corresponding pdata[] entry */
-	int curr = 0;
-	int end = pmem[id].num_entries;
-	int best_fit = -1;
-	unsigned long order = pmem_order(len);
+	unsigned long pages = pmem_pages(len);
+	unsigned long free_pages;
+	int best_fit;
 
 	if (pmem[id].no_allocator) {
 		DLOG("no allocator");
@@ -405,51 +541,44 @@ static int pmem_allocate(int id, unsigned long len)
 		return len;
 	}
 
-	if (order > PMEM_MAX_ORDER)
+	if (!pages || pages > pmem[id].num_entries)
 		return -1;
-	DLOG("order %lx\n", order);
+	DLOG("pages %lx\n", pages);
 
-	/* look through the bitmap:
-	 * 	if you find a free slot of the correct order use it
-	 * 	otherwise, use the best fit (smallest with size > order) slot
-	 */
-	while (curr < end) {
-		if (PMEM_IS_FREE(id, curr)) {
-			if (PMEM_ORDER(id, curr) == (unsigned char)order) {
-				/* set the not free bit and clear others */
-				best_fit = curr;
-				break;
-			}
-			if (PMEM_ORDER(id, curr) > (unsigned char)order &&
-			    (best_fit < 0 ||
-			     PMEM_ORDER(id, curr) < PMEM_ORDER(id, best_fit)))
-				best_fit = curr;
-		}
-		curr = PMEM_NEXT_INDEX(id, curr);
-	}
+	/* if no free extent is large enough, try to make one by moving
+	 * unmapped allocations out of the way */
+	best_fit = pmem_best_fit(id, pages);
+	if (best_fit < 0 && pmem_compact(id))
+		best_fit = pmem_best_fit(id, pages);
 
-	/* if best_fit < 0, there are no suitable slots,
-	 * return an error
-	 */
 	if (best_fit < 0) {
+		pmem[id].alloc_failures++;
 		printk("pmem: no space left to allocate!\n");
 		return -1;
 	}
 
-	/* now partition the best fit:
-	 * 	split the slot into 2 buddies of order - 1
-	 * 	repeat until the slot is of the correct order
-	 */
-	while (PMEM_ORDER(id, best_fit) > (unsigned char)order) {
-		int buddy;
-		PMEM_ORDER(id, best_fit) -= 1;
-		buddy = PMEM_BUDDY_INDEX(id, best_fit);
-		PMEM_ORDER(id, buddy) = PMEM_ORDER(id, best_fit);
-	}
-	pmem[id].bitmap[best_fit].allocated = 1;
+	/* carve the allocation out of the start of the extent */
+	free_pages = PMEM_PAGES(id, best_fit);
+	pmem_set_extent(id, best_fit, pages, 1);
+	if (free_pages > pages)
+		pmem_set_extent(id, best_fit + pages, free_pages - pages, 0);
 	return best_fit;
 }
 
+/* the mode the mappings of this file get, see phys_mem_access_prot */
+static unsigned pmem_cache_mode(struct file *file)
+{
+	int id = get_id(file);
+
+	if (!pmem[id].cached || file->f_flags & O_SYNC)
+		return PMEM_CACHE_UNCACHED;
+#ifdef pgprot_ext_buffered
+	if (pmem[id].buffered)
+		return PMEM_CACHE_WRITECOMBINE;
+#endif
+	return PMEM_CACHE_CACHED;
+}
+
 static pgprot_t phys_mem_access_prot(struct file *file, pgprot_t vma_prot)
 {
 	int id = get_id(file);
@@ -628,13 +757,12 @@ static int pmem_mmap(struct file *file, struct vm_area_struct *vma)
 	int i;
 	int allc_cnt = 0;
 	int order_cnt = 0;
-	for(i=0;i<pmem[id].num_entries;i++)
-		if(pmem[id].bitmap[i].order>0 ||  i>=pmem[id].num_entries) {
+	for (i = 0; i < pmem[id].num_entries; i = PMEM_NEXT_INDEX(id, i)) {
 			order_cnt++;
 			if (pmem[id].bitmap[i].allocated > 0) {
-			printk("mmap==>index=%d , order=%d,"
+			printk("mmap==>index=%d , pages=%d,"
 				"allocated=%d, vbase=0x%8X \n",
-				i,pmem[id].bitmap[i].order,
+				i,pmem[id].bitmap[i].pages,
 				pmem[id].bitmap[i].allocated,
 				vma->vm_start);
 		allc_cnt++;
@@ -659,6 +787,8 @@ static int pmem_mmap(struct file *file, struct vm_area_struct *vma)
 		goto error;
 	}
 
+	/* the allocation is about to be visible at this address */
+	data->fixed = 1;
 	vma->vm_pgoff = pmem_start_addr(id, data) >> PAGE_SHIFT;
 	vma->vm_page_prot = phys_mem_access_prot(file, vma->vm_page_prot);
 
@@ -753,16 +883,15 @@ int get_pmem_addr(struct file *file, unsigned long *start,
 	}
 	id = get_id(file);
 
-	down_read(&data->sem);
+	down_write(&data->sem);
 	*start = pmem_start_addr(id, data);
 	*len = pmem_len(id, data);
 	*vstart = (unsigned long)pmem_start_vaddr(id, data);
-	up_read(&data->sem);
+	data->fixed = 1;
 #if PMEM_DEBUG
-	down_write(&data->sem);
 	data->ref++;
-	up_write(&data->sem);
 #endif
+	up_write(&data->sem);
 	return 0;
 }
 
@@ -829,7 +958,7 @@ void flush_pmem_file(struct file *file, unsigned long offset, unsigned long len)
 
 	id = get_id(file);
 	data = (struct pmem_data *)file->private_data;
-	if (!pmem[id].cached || file->f_flags & O_SYNC)
+	if (pmem_cache_mode(file) != PMEM_CACHE_CACHED)
 		return;
 
 	down_read(&data->sem);
@@ -879,38 +1008,58 @@ static int pmem_connect(unsigned long connect, struct file *file)
 	struct file *src_file;
 	int ret = 0, put_needed;
 
-	down_write(&data->sem);
 	/* retrieve the src file and check it is a pmem file with an alloc */
 	src_file = fget_light(connect, &put_needed);
 	DLOG("connect %p to %p\n", file, src_file);
 	if (!src_file) {
 		printk("pmem: src file not found!\n");
-		ret = -EINVAL;
-		goto err_no_file;
+		return -EINVAL;
 	}
-	if (unlikely(!is_pmem_file(src_file) || !has_allocation(src_file))) {
+	if (unlikely(!is_pmem_file(src_file))) {
 		printk(KERN_INFO "pmem: src file is not a pmem file or has no "
 		       "alloc!\n");
 		ret = -EINVAL;
 		goto err_bad_file;
 	}
 	src_data = (struct pmem_data *)src_file->private_data;
+	if (src_data == data) {
+		ret = -EINVAL;
+		goto err_bad_file;
+	}
 
+	/* two files may be connected to each other at the same time, so take
+	 * both data->sems in address order */
+	if (data < src_data) {
+		down_write(&data->sem);
+		down_write_nested(&src_data->sem, SINGLE_DEPTH_NESTING);
+	} else {
+		down_write(&src_data->sem);
+		down_write_nested(&data->sem, SINGLE_DEPTH_NESTING);
+	}
+	if (unlikely(!has_allocation(src_file))) {
+		printk(KERN_INFO "pmem: src file is not a pmem file or has no "
+		       "alloc!\n");
+		ret = -EINVAL;
+		goto err_unlock;
+	}
 	if (has_allocation(file) && (data->index != src_data->index)) {
 		printk("pmem: file is already mapped but doesn't match this"
 		       " src_file!\n");
 		ret = -EINVAL;
-		goto err_bad_file;
+		goto err_unlock;
 	}
+	/* the src allocation can't move once files are connected to it */
+	src_data->fixed = 1;
 	data->index = src_data->index;
 	data->flags |= PMEM_FLAGS_CONNECTED;
 	data->master_fd = connect;
 	data->master_file = src_file;
 
+err_unlock:
+	up_write(&src_data->sem);
+	up_write(&data->sem);
 err_bad_file:
 	fput_light(src_file, put_needed);
-err_no_file:
-	up_write(&data->sem);
 	return ret;
 }
 
@@ -1112,13 +1261,86 @@ static void pmem_get_size(struct pmem_region *region, struct file *file)
 		region->len = 0;
 		return;
 	} else {
+		down_write(&data->sem);
+		data->fixed = 1;
 		region->offset = pmem_start_addr(id, data);
 		region->len = pmem_len(id, data);
+		up_write(&data->sem);
 	}
 	DLOG("offset %lx len %lx\n", region->offset, region->len);
 }
 
 
+/*
+ * pmem_cache_maint - clean, invalidate or flush the CPU caches over a range
+ * of the caller's own mapping of this file, before or after a device works
+ * on it. Only cached mappings need it; write-combined ones just get their
+ * write buffer drained.
+ */
+static int pmem_cache_maint(struct file *file, unsigned int cmd,
+			    struct pmem_addr *pmem_addr)
+{
+	struct pmem_data *data = (struct pmem_data *)file->private_data;
+	struct vm_area_struct *vma;
+	unsigned long vaddr = pmem_addr->vaddr;
+	unsigned long offset = pmem_addr->offset;
+	unsigned long length = pmem_addr->length;
+	unsigned long paddr;
+	int id = get_id(file), ret = 0;
+
+	if (!has_allocation(file))
+		return -EINVAL;
+	if (offset + length < offset || offset + length > pmem_len(id, data))
+		return -EINVAL;
+
+	switch (pmem_cache_mode(file)) {
+	case PMEM_CACHE_UNCACHED:
+		return 0;
+	case PMEM_CACHE_WRITECOMBINE:
+		dsb();
+		return 0;
+	}
+	if (!length)
+		return 0;
+
+	/* the cache ops work on virtual addresses, make sure the range really
+	 * is this file's mapping at that offset and stays mapped meanwhile */
+	down_read(&current->mm->mmap_sem);
+	vma = find_vma(current->mm, vaddr);
+	if (!vma || vma->vm_file != file || vaddr < vma->vm_start ||
+	    vaddr - vma->vm_start != offset || length > vma->vm_end - vaddr) {
+		ret = -EINVAL;
+		goto out;
+	}
+	paddr = pmem_start_addr(id, data) + offset;
+
+	switch (cmd) {
+	case PMEM_CLEAN_CACHES:
+		dmac_clean_range((void *)vaddr, (void *)(vaddr + length));
+#ifdef CONFIG_OUTER_CACHE
+		outer_clean_range(paddr, paddr + length);
+#endif
+		break;
+	case PMEM_INV_CACHES:
+		dmac_inv_range((void *)vaddr, (void *)(vaddr + length));
+#ifdef CONFIG_OUTER_CACHE
+		outer_inv_range(paddr, paddr + length);
+#endif
+		break;
+	case PMEM_CLEAN_INV_CACHES:
+		dmac_flush_range((void *)vaddr, (void *)(vaddr + length));
+#ifdef CONFIG_OUTER_CACHE
+		outer_flush_range(paddr, paddr + length);
+#endif
+		break;
+	}
+	/* drains the write buffer, and the bus buffers where needed */
+	dsb();
+out:
+	up_read(&current->mm->mmap_sem);
+	return ret;
+}
+
 static long pmem_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
 	struct pmem_data *data;
@@ -1134,8 +1356,11 @@ static long pmem_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 				region.len = 0;
 			} else {
 				data = (struct pmem_data *)file->private_data;
+				down_write(&data->sem);
+				data->fixed = 1;
 				region.offset = pmem_start_addr(id, data);
 				region.len = pmem_len(id, data);
+				up_write(&data->sem);
 			}
 			printk(KERN_INFO "pmem: request for physical address of pmem region "
 					"from process %d.\n", current->pid);
@@ -1188,10 +1413,16 @@ static long pmem_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		}
 	case PMEM_ALLOCATE:
 		{
-			if (has_allocation(file))
-				return -EINVAL;
 			data = (struct pmem_data *)file->private_data;
+			down_write(&data->sem);
+			if (has_allocation(file)) {
+				up_write(&data->sem);
+				return -EINVAL;
+			}
+			down_write(&pmem[id].bitmap_sem);
 			data->index = pmem_allocate(id, arg);
+			up_write(&pmem[id].bitmap_sem);
+			up_write(&data->sem);
 			break;
 		}
 	case PMEM_CONNECT:
@@ -1204,38 +1435,17 @@ static long pmem_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	case PMEM_INV_CACHES:
 		{
 			struct pmem_addr pmem_addr;
-			unsigned long vaddr;
-			unsigned long paddr;
-			unsigned long length;
-			unsigned long offset;
-
-			id = get_id(file);
-			if (!pmem[id].cached)
-				return 0;
-			if (!has_allocation(file))
-				return -EINVAL;
+
 			if (copy_from_user(&pmem_addr, (void __user *)arg,
 						sizeof(struct pmem_addr)))
 				return -EFAULT;
-
-			data = (struct pmem_data *)file->private_data;
-			offset = pmem_addr.offset;
-			length = pmem_addr.length;
-			if (offset + length > pmem_len(id, data))
-				return -EINVAL;
-			vaddr = pmem_addr.vaddr;
-			paddr = pmem_start_addr(id, data) + offset;
-
-			if (cmd == PMEM_CLEAN_INV_CACHES)
-				clean_and_invalidate_caches(vaddr,
-				length, paddr);
-			else if (cmd == PMEM_CLEAN_CACHES)
-				clean_caches(vaddr, length, paddr);
-			else if (cmd == PMEM_INV_CACHES)
-				invalidate_caches(vaddr, length, paddr);
-
-			break;
+			return pmem_cache_maint(file, cmd, &pmem_addr);
 		}
+	case PMEM_GET_CACHE_MODE:
+		if (put_user(pmem_cache_mode(file),
+			     (unsigned int __user *)arg))
+			return -EFAULT;
+		break;
 
 	default:
 		if (pmem[id].ioctl)
@@ -1295,6 +1505,67 @@ static struct file_operations debug_fops = {
 	.read = debug_read,
 	.open = debug_open,
 };
+
+#define PMEM_HIST_BUCKETS 16
+
+/* free extents bucketed by size, 1, 2-3, 4-7... entries */
+static int extents_show(struct seq_file *m, void *unused)
+{
+	int id = (int)m->private;
+	unsigned long hist[PMEM_HIST_BUCKETS] = { 0 };
+	unsigned long free = 0, largest = 0, nr_free = 0;
+	unsigned long used = 0, nr_used = 0;
+	int curr, i;
+
+	down_read(&pmem[id].bitmap_sem);
+	for (curr = 0; curr < pmem[id].num_entries;
+	     curr = PMEM_NEXT_INDEX(id, curr)) {
+		unsigned long pages = PMEM_PAGES(id, curr);
+
+		if (!PMEM_IS_FREE(id, curr)) {
+			used += pages;
+			nr_used++;
+			continue;
+		}
+		free += pages;
+		nr_free++;
+		largest = max(largest, pages);
+		hist[min(fls(pages) - 1, PMEM_HIST_BUCKETS - 1)]++;
+	}
+
+	seq_printf(m, "allocated: %lu KB in %lu extents\n",
+		   used * PMEM_MIN_ALLOC / 1024, nr_used);
+	seq_printf(m, "free: %lu KB in %lu extents, largest %lu KB\n",
+		   free * PMEM_MIN_ALLOC / 1024, nr_free,
+		   largest * PMEM_MIN_ALLOC / 1024);
+	seq_printf(m, "fragmentation: %lu%%\n",
+		   free ? 100 - largest * 100 / free : 0);
+	seq_printf(m, "failures: %lu compactions: %lu relocations: %lu\n",
+		   pmem[id].alloc_failures, pmem[id].compactions,
+		   pmem[id].relocations);
+	seq_printf(m, "free extents by size, from (KB): count\n");
+	for (i = 0; i < PMEM_HIST_BUCKETS; i++)
+		if (hist[i])
+			seq_printf(m, "%8lu%s: %lu\n",
+				   (1UL << i) * PMEM_MIN_ALLOC / 1024,
+				   i == PMEM_HIST_BUCKETS - 1 ? "+" : "",
+				   hist[i]);
+	up_read(&pmem[id].bitmap_sem);
+
+	return 0;
+}
+
+static int extents_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, extents_show, inode->i_private);
+}
+
+static struct file_operations extents_fops = {
+	.open = extents_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
 #endif
 
 #if 0
@@ -1309,7 +1580,6 @@ int pmem_setup(struct android_pmem_platform_data *pdata,
 	       int (*release)(struct inode *, struct file *))
 {
 	int err = 0;
-	int i, index = 0;
 	int id = id_count;
 	id_count++;
 
@@ -1343,12 +1613,9 @@ int pmem_setup(struct android_pmem_platform_data *pdata,
 	memset(pmem[id].bitmap, 0, sizeof(struct pmem_bits) *
 					  pmem[id].num_entries);
 
-	for (i = sizeof(pmem[id].num_entries) * 8 - 1; i >= 0; i--) {
-		if ((pmem[id].num_entries) &  1<<i) {
-			PMEM_ORDER(id, index) = i;
-			index = PMEM_NEXT_INDEX(id, index);
-		}
-	}
+	/* the whole region starts out as a single free extent */
+	if (pmem[id].num_entries)
+		pmem_set_extent(id, 0, pmem[id].num_entries, 0);
 
 	if (pmem[id].cached)
 		pmem[id].vbase = ioremap_cached(pmem[id].base,
@@ -1371,6 +1638,13 @@ int pmem_setup(struct android_pmem_platform_data *pdata,
 #if PMEM_DEBUG
 	debugfs_create_file(pdata->name, S_IFREG | S_IRUGO, NULL, (void *)id,
 			    &debug_fops);
+	if (!pmem[id].no_allocator) {
+		char name[64];
+
+		snprintf(name, sizeof(name), "%s_extents", pdata->name);
+		debugfs_create_file(name, S_IFREG | S_IRUGO, NULL, (void *)id,
+				    &extents_fops);
+	}
 #endif
 	return 0;
 error_cant_remap:
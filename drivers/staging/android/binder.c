@@ -16,12 +16,17 @@
  */
 
 #include <asm/cacheflush.h>
+#include <linux/android_pmem.h>
+#include <linux/ashmem.h>
+#include <linux/debugfs.h>
 #include <linux/fdtable.h>
 #include <linux/file.h>
 #include <linux/fs.h>
+#include <linux/hrtimer.h>
 #include <linux/list.h>
 #include <linux/miscdevice.h>
 #include <linux/mm.h>
+#include <linux/mman.h>
 #include <linux/module.h>
 #include <linux/mutex.h>
 #include <linux/nsproxy.h>
@@ -29,20 +34,41 @@
 #include <linux/proc_fs.h>
 #include <linux/rbtree.h>
 #include <linux/sched.h>
+#include <linux/seq_file.h>
 #include <linux/uaccess.h>
 #include <linux/vmalloc.h>
+#include <trace/binder.h>
 
 #include "binder.h"
 
-static DEFINE_MUTEX(binder_lock);
+DEFINE_TRACE(binder_transaction);
+DEFINE_TRACE(binder_transaction_received);
+DEFINE_TRACE(binder_transaction_replied);
+
+/*
+ * binder_main_lock protects the nodes, refs, threads, work lists and
+ * transaction stacks of all procs. Each proc's buffer allocator is
+ * protected by proc->alloc_lock, which nests inside binder_main_lock and
+ * may also be taken on its own while a transaction copies its payload.
+ */
+static DEFINE_MUTEX(binder_main_lock);
 static DEFINE_MUTEX(binder_deferred_lock);
 
 static HLIST_HEAD(binder_procs);
 static HLIST_HEAD(binder_deferred_list);
 static HLIST_HEAD(binder_dead_nodes);
 
+/*
+ * Pages of freed buffers stay mapped and are parked on binder_lru_list,
+ * oldest first, until they are reused or reclaimed by binder_shrink.
+ */
+static LIST_HEAD(binder_lru_list);
+static DEFINE_SPINLOCK(binder_lru_lock);
+static int binder_lru_count;
+
 static struct proc_dir_entry *binder_proc_dir_entry_root;
 static struct proc_dir_entry *binder_proc_dir_entry_proc;
+static struct dentry *binder_debugfs_dir_entry_root;
 static struct binder_node *binder_context_mgr_node;
 static uid_t binder_context_mgr_uid = -1;
 static int binder_last_id;
@@ -138,6 +164,14 @@ struct binder_stats {
 
 static struct binder_stats binder_stats;
 
+struct binder_page_stats {
+	atomic_t map;
+	atomic_t unmap;
+	atomic_t reuse;
+};
+
+static struct binder_page_stats binder_page_stats;
+
 static inline void binder_stats_deleted(enum binder_stat_types type)
 {
 	binder_stats.obj_deleted[type]++;
@@ -182,6 +216,43 @@ static struct binder_transaction_log_entry *binder_transaction_log_add(
 	return e;
 }
 
+/*
+ * Per-node latency histograms. Bucket i counts transactions that took
+ * less than 2^(i+1) microseconds; the last bucket collects the rest.
+ */
+#define BINDER_LATENCY_BUCKETS 20
+
+struct binder_latency {
+	int refs;
+	int node_debug_id;
+	unsigned int queue[BINDER_LATENCY_BUCKETS]; /* send to BR_TRANSACTION */
+	unsigned int service[BINDER_LATENCY_BUCKETS]; /* BR_TRANSACTION to */
+						      /* BC_REPLY */
+	s64 queue_max_us;
+	s64 service_max_us;
+};
+
+static void binder_latency_add(unsigned int *hist, s64 *max_us, s64 us)
+{
+	int bucket;
+
+	if (us < 0)
+		us = 0;
+	if (us > *max_us)
+		*max_us = us;
+	if (us >= (1LL << BINDER_LATENCY_BUCKETS))
+		bucket = BINDER_LATENCY_BUCKETS - 1;
+	else
+		bucket = fls(us >> 1);
+	hist[bucket]++;
+}
+
+static void binder_put_latency(struct binder_latency *latency)
+{
+	if (latency && --latency->refs == 0)
+		kfree(latency);
+}
+
 struct binder_work {
 	struct list_head entry;
 	enum {
@@ -216,6 +287,7 @@ struct binder_node {
 	unsigned accept_fds:1;
 	unsigned min_priority:8;
 	struct list_head async_todo;
+	struct binder_latency *latency;
 };
 
 struct binder_ref_death {
@@ -242,12 +314,18 @@ struct binder_ref {
 
 struct binder_buffer {
 	struct list_head entry; /* free and allocated entries by addesss */
-	struct rb_node rb_node; /* free entry by size or allocated entry */
-				/* by address */
+	union {
+		struct rb_node rb_node; /* large free entry by size or */
+					/* allocated entry by address */
+		struct list_head free_entry; /* small free entry in */
+					     /* proc->free_lists */
+	};
 	unsigned free:1;
+	unsigned free_in_list:1;
 	unsigned allow_user_free:1;
 	unsigned async_transaction:1;
-	unsigned debug_id:29;
+	unsigned has_mapped_objects:1;
+	unsigned debug_id:27;
 
 	struct binder_transaction *transaction;
 
@@ -257,12 +335,36 @@ struct binder_buffer {
 	uint8_t data[0];
 };
 
+/*
+ * Free buffers smaller than BINDER_FREE_LISTS << BINDER_FREE_LIST_SHIFT
+ * bytes are kept in per-size-class lists instead of the free_buffers tree.
+ */
+#define BINDER_FREE_LIST_SHIFT	5
+#define BINDER_FREE_LISTS	32
+
+struct binder_lru_page {
+	struct list_head lru;
+	struct page *page;
+	struct binder_proc *proc;
+};
+
 enum binder_deferred_state {
 	BINDER_DEFERRED_PUT_FILES    = 0x01,
 	BINDER_DEFERRED_FLUSH        = 0x02,
 	BINDER_DEFERRED_RELEASE      = 0x04,
 };
 
+/*
+ * Scheduling parameters carried from a caller to the thread serving its
+ * transaction. prio is the rt_priority for SCHED_FIFO/SCHED_RR and the
+ * nice value for every other policy, so the same representation works
+ * for both the CFS and the BFS scheduler.
+ */
+struct binder_priority {
+	unsigned int sched_policy;
+	int prio;
+};
+
 struct binder_proc {
 	struct hlist_node proc_node;
 	struct rb_root threads;
@@ -278,12 +380,14 @@ struct binder_proc {
 	void *buffer;
 	ptrdiff_t user_buffer_offset;
 
+	struct mutex alloc_lock;
 	struct list_head buffers;
 	struct rb_root free_buffers;
+	struct list_head free_lists[BINDER_FREE_LISTS];
 	struct rb_root allocated_buffers;
 	size_t free_async_space;
 
-	struct page **pages;
+	struct binder_lru_page *pages;
 	size_t buffer_size;
 	uint32_t buffer_free;
 	struct list_head todo;
@@ -294,7 +398,10 @@ struct binder_proc {
 	int requested_threads;
 	int requested_threads_started;
 	int ready_threads;
-	long default_priority;
+	struct binder_priority default_priority;
+	int protocol_version;
+	int tmp_ref;
+	int is_dead;
 };
 
 enum {
@@ -310,6 +417,7 @@ struct binder_thread {
 	struct binder_proc *proc;
 	struct rb_node rb_node;
 	int pid;
+	struct task_struct *task;
 	int looper;
 	struct binder_transaction *transaction_stack;
 	struct list_head todo;
@@ -330,18 +438,31 @@ struct binder_transaction {
 	struct binder_thread *to_thread;
 	struct binder_transaction *to_parent;
 	unsigned need_reply:1;
+	unsigned set_priority_called:1;
 	/* unsigned is_dead:1; */	/* not used at the moment */
 
 	struct binder_buffer *buffer;
 	unsigned int	code;
 	unsigned int	flags;
-	long	priority;
-	long	saved_priority;
+	struct binder_priority	priority;
+	struct binder_priority	saved_priority;
 	uid_t	sender_euid;
+	ktime_t	send_time;
+	ktime_t	recv_time;
+	struct binder_latency *latency;
 };
 
 static void
 binder_defer_work(struct binder_proc *proc, enum binder_deferred_state defer);
+static void binder_free_proc(struct binder_proc *proc);
+
+static void binder_proc_dec_tmpref(struct binder_proc *proc)
+{
+	BUG_ON(proc->tmp_ref <= 0);
+	proc->tmp_ref--;
+	if (proc->is_dead && proc->tmp_ref == 0)
+		binder_free_proc(proc);
+}
 
 /*
  * copied from get_unused_fd_flags
@@ -481,21 +602,202 @@ out_unlock:
 	return -EBADF;
 }
 
-static void binder_set_nice(long nice)
+static inline int binder_rt_policy(unsigned int policy)
+{
+	return policy == SCHED_FIFO || policy == SCHED_RR;
+}
+
+static struct binder_priority binder_get_priority(struct task_struct *task)
+{
+	struct binder_priority p;
+
+	p.sched_policy = task->policy;
+	if (binder_rt_policy(p.sched_policy))
+		p.prio = task->rt_priority;
+	else
+		p.prio = task_nice(task);
+	return p;
+}
+
+/*
+ * Order of the policies against each other. SCHED_ISO only exists with
+ * BFS, where it is the soft realtime class unprivileged audio runs in.
+ */
+static int binder_policy_rank(unsigned int policy)
+{
+	switch (policy) {
+	case SCHED_FIFO:
+	case SCHED_RR:
+		return 3;
+#ifdef CONFIG_SCHED_BFS
+	case SCHED_ISO:
+		return 2;
+#endif
+	case SCHED_IDLE:
+		return 0;
+	default:
+		return 1;
+	}
+}
+
+/* returns nonzero if a should run before b */
+static int binder_priority_higher(struct binder_priority a,
+				  struct binder_priority b)
+{
+	int rank_a = binder_policy_rank(a.sched_policy);
+	int rank_b = binder_policy_rank(b.sched_policy);
+
+	if (rank_a != rank_b)
+		return rank_a > rank_b;
+	if (binder_rt_policy(a.sched_policy))
+		return a.prio > b.prio;
+	return a.prio < b.prio;
+}
+
+static void binder_set_nice(struct task_struct *task, long nice)
 {
 	long min_nice;
-	if (can_nice(current, nice)) {
-		set_user_nice(current, nice);
+	if (can_nice(task, nice)) {
+		set_user_nice(task, nice);
 		return;
 	}
-	min_nice = 20 - current->signal->rlim[RLIMIT_NICE].rlim_cur;
+	min_nice = 20 - task->signal->rlim[RLIMIT_NICE].rlim_cur;
 	binder_debug(BINDER_DEBUG_PRIORITY_CAP,
 		     "binder: %d: nice value %ld not allowed use "
-		     "%ld instead\n", current->pid, nice, min_nice);
-	set_user_nice(current, min_nice);
+		     "%ld instead\n", task->pid, nice, min_nice);
+	set_user_nice(task, min_nice);
 	if (min_nice < 20)
 		return;
-	binder_user_error("binder: %d RLIMIT_NICE not set\n", current->pid);
+	binder_user_error("binder: %d RLIMIT_NICE not set\n", task->pid);
+}
+
+/*
+ * Move task to the policy and priority in p. RT priorities are capped
+ * to the task's RLIMIT_RTPRIO unless it has CAP_SYS_NICE; a task that
+ * may not run RT at all gets the best nice value it is allowed instead.
+ */
+static void binder_set_priority(struct task_struct *task,
+				struct binder_priority p)
+{
+	struct sched_param param;
+	unsigned int policy = p.sched_policy;
+	int ret;
+
+	if (binder_rt_policy(policy) &&
+	    !has_capability_noaudit(task, CAP_SYS_NICE)) {
+		int max_rtprio = task->signal->rlim[RLIMIT_RTPRIO].rlim_cur;
+		if (max_rtprio == 0) {
+			binder_debug(BINDER_DEBUG_PRIORITY_CAP,
+				     "binder: %d: rt priority %d not allowed "
+				     "use nice instead\n", task->pid, p.prio);
+			policy = SCHED_NORMAL;
+			p.prio = -20;
+		} else if (p.prio > max_rtprio) {
+			binder_debug(BINDER_DEBUG_PRIORITY_CAP,
+				     "binder: %d: rt priority %d not allowed "
+				     "use %d instead\n", task->pid, p.prio,
+				     max_rtprio);
+			p.prio = max_rtprio;
+		}
+	}
+
+	if (binder_rt_policy(policy)) {
+		param.sched_priority = p.prio;
+		ret = sched_setscheduler_nocheck(task, policy, &param);
+		if (ret)
+			binder_user_error("binder: %d: failed to set rt "
+					  "priority %d, %d\n", task->pid,
+					  p.prio, ret);
+		return;
+	}
+	if (task->policy != policy) {
+		param.sched_priority = 0;
+		ret = sched_setscheduler_nocheck(task, policy, &param);
+		if (ret)
+			binder_user_error("binder: %d: failed to set policy "
+					  "%u, %d\n", task->pid, policy, ret);
+	}
+	binder_set_nice(task, p.prio);
+}
+
+/*
+ * Put task back to a priority it had before. The saved policy and
+ * priority were the task's own, so they are restored exactly and not
+ * capped like an inherited priority would be.
+ */
+static void binder_restore_priority(struct task_struct *task,
+				    struct binder_priority p)
+{
+	struct binder_priority cur = binder_get_priority(task);
+	struct sched_param param;
+	int ret;
+
+	if (cur.sched_policy == p.sched_policy && cur.prio == p.prio)
+		return;
+
+	if (cur.sched_policy != p.sched_policy ||
+	    binder_rt_policy(p.sched_policy)) {
+		param.sched_priority = binder_rt_policy(p.sched_policy) ?
+				       p.prio : 0;
+		ret = sched_setscheduler_nocheck(task, p.sched_policy, &param);
+		if (ret)
+			binder_user_error("binder: %d: failed to restore "
+					  "policy %u priority %d, %d\n",
+					  task->pid, p.sched_policy, p.prio,
+					  ret);
+	}
+	if (!binder_rt_policy(p.sched_policy))
+		set_user_nice(task, p.prio);
+}
+
+/*
+ * An idle looper goes back to the process default nice value. Threads
+ * the process moved to another policy itself keep it.
+ */
+static void binder_set_default_priority(struct task_struct *task,
+					struct binder_proc *proc)
+{
+	if (task->policy != SCHED_NORMAL ||
+	    task_nice(task) == proc->default_priority.prio)
+		return;
+	binder_set_nice(task, proc->default_priority.prio);
+}
+
+/*
+ * Called before the thread that serves t starts running it. The caller's
+ * priority is inherited by synchronous transactions, and the node's
+ * min_priority applies to all of them. A synchronous call never takes a
+ * higher RT priority away from the thread, so an RT thread that is handed
+ * a nested transaction keeps its policy. The previous priority is saved
+ * in t and restored when the reply is sent.
+ */
+static void binder_transaction_priority(struct task_struct *task,
+					struct binder_transaction *t,
+					struct binder_node *node)
+{
+	struct binder_priority desired;
+	struct binder_priority node_prio;
+
+	if (t->set_priority_called)
+		return;
+	t->set_priority_called = 1;
+	t->saved_priority = binder_get_priority(task);
+
+	node_prio.sched_policy = SCHED_NORMAL;
+	node_prio.prio = (s8)node->min_priority;
+	if (t->flags & TF_ONE_WAY) {
+		if (!binder_priority_higher(node_prio, t->saved_priority))
+			return;
+		desired = node_prio;
+	} else {
+		desired = t->priority;
+		if (binder_priority_higher(node_prio, desired))
+			desired = node_prio;
+		if (binder_rt_policy(t->saved_priority.sched_policy) &&
+		    binder_priority_higher(t->saved_priority, desired))
+			return;
+	}
+	binder_set_priority(task, desired);
 }
 
 static size_t binder_buffer_size(struct binder_proc *proc,
@@ -525,6 +827,14 @@ static void binder_insert_free_buffer(struct binder_proc *proc,
 		     "binder: %d: add free buffer, size %zd, "
 		     "at %p\n", proc->pid, new_buffer_size, new_buffer);
 
+	if ((new_buffer_size >> BINDER_FREE_LIST_SHIFT) < BINDER_FREE_LISTS) {
+		new_buffer->free_in_list = 1;
+		list_add(&new_buffer->free_entry, &proc->free_lists[
+			 new_buffer_size >> BINDER_FREE_LIST_SHIFT]);
+		return;
+	}
+	new_buffer->free_in_list = 0;
+
 	while (*p) {
 		parent = *p;
 		buffer = rb_entry(parent, struct binder_buffer, rb_node);
@@ -541,6 +851,57 @@ static void binder_insert_free_buffer(struct binder_proc *proc,
 	rb_insert_color(&new_buffer->rb_node, &proc->free_buffers);
 }
 
+static void binder_erase_free_buffer(struct binder_proc *proc,
+				     struct binder_buffer *buffer)
+{
+	BUG_ON(!buffer->free);
+
+	if (buffer->free_in_list)
+		list_del(&buffer->free_entry);
+	else
+		rb_erase(&buffer->rb_node, &proc->free_buffers);
+}
+
+static struct binder_buffer *binder_find_free_buffer(struct binder_proc *proc,
+						     size_t size)
+{
+	struct rb_node *n = proc->free_buffers.rb_node;
+	struct binder_buffer *buffer;
+	struct rb_node *best_fit = NULL;
+	size_t buffer_size;
+	int i;
+
+	i = size >> BINDER_FREE_LIST_SHIFT;
+	if (i < BINDER_FREE_LISTS) {
+		list_for_each_entry(buffer, &proc->free_lists[i], free_entry) {
+			if (binder_buffer_size(proc, buffer) >= size)
+				return buffer;
+		}
+		for (i++; i < BINDER_FREE_LISTS; i++) {
+			if (!list_empty(&proc->free_lists[i]))
+				return list_first_entry(&proc->free_lists[i],
+					struct binder_buffer, free_entry);
+		}
+	}
+
+	while (n) {
+		buffer = rb_entry(n, struct binder_buffer, rb_node);
+		BUG_ON(!buffer->free);
+		buffer_size = binder_buffer_size(proc, buffer);
+
+		if (size < buffer_size) {
+			best_fit = n;
+			n = n->rb_left;
+		} else if (size > buffer_size)
+			n = n->rb_right;
+		else
+			return buffer;
+	}
+	if (best_fit == NULL)
+		return NULL;
+	return rb_entry(best_fit, struct binder_buffer, rb_node);
+}
+
 static void binder_insert_allocated_buffer(struct binder_proc *proc,
 					   struct binder_buffer *new_buffer)
 {
@@ -569,13 +930,15 @@ static void binder_insert_allocated_buffer(struct binder_proc *proc,
 static struct binder_buffer *binder_buffer_lookup(struct binder_proc *proc,
 						  void __user *user_ptr)
 {
-	struct rb_node *n = proc->allocated_buffers.rb_node;
+	struct rb_node *n;
 	struct binder_buffer *buffer;
 	struct binder_buffer *kern_ptr;
 
 	kern_ptr = user_ptr - proc->user_buffer_offset
 		- offsetof(struct binder_buffer, data);
 
+	mutex_lock(&proc->alloc_lock);
+	n = proc->allocated_buffers.rb_node;
 	while (n) {
 		buffer = rb_entry(n, struct binder_buffer, rb_node);
 		BUG_ON(buffer->free);
@@ -585,9 +948,29 @@ static struct binder_buffer *binder_buffer_lookup(struct binder_proc *proc,
 		else if (kern_ptr > buffer)
 			n = n->rb_right;
 		else
-			return buffer;
+			break;
 	}
-	return NULL;
+	mutex_unlock(&proc->alloc_lock);
+	return n ? buffer : NULL;
+}
+
+static void binder_lru_add(struct binder_lru_page *lru_page)
+{
+	spin_lock(&binder_lru_lock);
+	BUG_ON(!list_empty(&lru_page->lru));
+	list_add_tail(&lru_page->lru, &binder_lru_list);
+	binder_lru_count++;
+	spin_unlock(&binder_lru_lock);
+}
+
+static void binder_lru_del(struct binder_lru_page *lru_page)
+{
+	spin_lock(&binder_lru_lock);
+	if (!list_empty(&lru_page->lru)) {
+		list_del_init(&lru_page->lru);
+		binder_lru_count--;
+	}
+	spin_unlock(&binder_lru_lock);
 }
 
 static int binder_update_page_range(struct binder_proc *proc, int allocate,
@@ -597,8 +980,8 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 	void *page_addr;
 	unsigned long user_page_addr;
 	struct vm_struct tmp_area;
-	struct page **page;
-	struct mm_struct *mm;
+	struct binder_lru_page *lru_page;
+	struct mm_struct *mm = NULL;
 
 	binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
 		     "binder: %d: %s pages %p-%p\n", proc->pid,
@@ -607,9 +990,10 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 	if (end <= start)
 		return 0;
 
-	if (vma)
-		mm = NULL;
-	else
+	if (allocate == 0)
+		goto free_range;
+
+	if (!vma)
 		mm = get_task_mm(proc->tsk);
 
 	if (mm) {
@@ -617,9 +1001,6 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 		vma = proc->vma;
 	}
 
-	if (allocate == 0)
-		goto free_range;
-
 	if (vma == NULL) {
 		printk(KERN_ERR "binder: %d: binder_alloc_buf failed to "
 		       "map pages in userspace, no vma\n", proc->pid);
@@ -629,18 +1010,23 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 	for (page_addr = start; page_addr < end; page_addr += PAGE_SIZE) {
 		int ret;
 		struct page **page_array_ptr;
-		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
+		lru_page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
 
-		BUG_ON(*page);
-		*page = alloc_page(GFP_KERNEL | __GFP_ZERO);
-		if (*page == NULL) {
+		if (lru_page->page) {
+			/* still mapped since it was last freed */
+			binder_lru_del(lru_page);
+			atomic_inc(&binder_page_stats.reuse);
+			continue;
+		}
+		lru_page->page = alloc_page(GFP_KERNEL | __GFP_ZERO);
+		if (lru_page->page == NULL) {
 			printk(KERN_ERR "binder: %d: binder_alloc_buf failed "
 			       "for page at %p\n", proc->pid, page_addr);
 			goto err_alloc_page_failed;
 		}
 		tmp_area.addr = page_addr;
 		tmp_area.size = PAGE_SIZE + PAGE_SIZE /* guard page? */;
-		page_array_ptr = page;
+		page_array_ptr = &lru_page->page;
 		ret = map_vm_area(&tmp_area, PAGE_KERNEL, &page_array_ptr);
 		if (ret) {
 			printk(KERN_ERR "binder: %d: binder_alloc_buf failed "
@@ -650,13 +1036,14 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 		}
 		user_page_addr =
 			(uintptr_t)page_addr + proc->user_buffer_offset;
-		ret = vm_insert_page(vma, user_page_addr, page[0]);
+		ret = vm_insert_page(vma, user_page_addr, lru_page->page);
 		if (ret) {
 			printk(KERN_ERR "binder: %d: binder_alloc_buf failed "
 			       "to map page at %lx in userspace\n",
 			       proc->pid, user_page_addr);
 			goto err_vm_insert_page_failed;
 		}
+		atomic_inc(&binder_page_stats.map);
 		/* vm_insert_page does not seem to increment the refcount */
 	}
 	if (mm) {
@@ -666,17 +1053,21 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 	return 0;
 
 free_range:
+	/*
+	 * Freed pages are left mapped in the kernel and in userspace so
+	 * the next buffer to use them does not have to map them again;
+	 * binder_shrink unmaps them when memory gets tight.
+	 */
 	for (page_addr = end - PAGE_SIZE; page_addr >= start;
 	     page_addr -= PAGE_SIZE) {
-		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
-		if (vma)
-			zap_page_range(vma, (uintptr_t)page_addr +
-				proc->user_buffer_offset, PAGE_SIZE, NULL);
+		lru_page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
+		binder_lru_add(lru_page);
+		continue;
 err_vm_insert_page_failed:
 		unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
 err_map_kernel_failed:
-		__free_page(*page);
-		*page = NULL;
+		__free_page(lru_page->page);
+		lru_page->page = NULL;
 err_alloc_page_failed:
 		;
 	}
@@ -685,17 +1076,90 @@ err_no_vma:
 		up_write(&mm->mmap_sem);
 		mmput(mm);
 	}
-	return -ENOMEM;
+	return allocate ? -ENOMEM : 0;
 }
 
-static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
-					      size_t data_size,
-					      size_t offsets_size, int is_async)
+/*
+ * Unmaps and frees a page parked on the lru. Called with proc->alloc_lock
+ * held. Returns 0 if the owner's mm is busy and the page must be kept.
+ */
+static int binder_reclaim_page(struct binder_lru_page *lru_page)
+{
+	struct binder_proc *proc = lru_page->proc;
+	void *page_addr = proc->buffer +
+			  (lru_page - proc->pages) * PAGE_SIZE;
+	struct mm_struct *mm;
+
+	mm = get_task_mm(proc->tsk);
+	if (mm) {
+		if (!down_write_trylock(&mm->mmap_sem)) {
+			mmput(mm);
+			return 0;
+		}
+		if (proc->vma)
+			zap_page_range(proc->vma, (uintptr_t)page_addr +
+				proc->user_buffer_offset, PAGE_SIZE, NULL);
+		up_write(&mm->mmap_sem);
+		mmput(mm);
+	}
+	unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
+	__free_page(lru_page->page);
+	lru_page->page = NULL;
+	atomic_inc(&binder_page_stats.unmap);
+	return 1;
+}
+
+/*
+ * binder_shrink - hands pages of freed buffers back to the system,
+ * least recently freed first. See ashmem_shrink for the calling convention.
+ */
+static int binder_shrink(int nr_to_scan, gfp_t gfp_mask)
+{
+	struct binder_lru_page *lru_page;
+	struct binder_proc *proc;
+	int scanned = 0;
+
+	if (nr_to_scan && !(gfp_mask & __GFP_FS))
+		return -1;
+	if (!nr_to_scan)
+		return binder_lru_count;
+
+	spin_lock(&binder_lru_lock);
+	while (scanned++ < nr_to_scan && !list_empty(&binder_lru_list)) {
+		lru_page = list_first_entry(&binder_lru_list,
+					    struct binder_lru_page, lru);
+		proc = lru_page->proc;
+		if (!mutex_trylock(&proc->alloc_lock)) {
+			list_move_tail(&lru_page->lru, &binder_lru_list);
+			continue;
+		}
+		list_del_init(&lru_page->lru);
+		binder_lru_count--;
+		spin_unlock(&binder_lru_lock);
+
+		if (!binder_reclaim_page(lru_page))
+			binder_lru_add(lru_page);
+		mutex_unlock(&proc->alloc_lock);
+
+		spin_lock(&binder_lru_lock);
+	}
+	spin_unlock(&binder_lru_lock);
+
+	return binder_lru_count;
+}
+
+static struct shrinker binder_shrinker = {
+	.shrink = binder_shrink,
+	.seeks = DEFAULT_SEEKS,
+};
+
+static struct binder_buffer *__binder_alloc_buf(struct binder_proc *proc,
+						size_t data_size,
+						size_t offsets_size,
+						int is_async)
 {
-	struct rb_node *n = proc->free_buffers.rb_node;
 	struct binder_buffer *buffer;
 	size_t buffer_size;
-	struct rb_node *best_fit = NULL;
 	void *has_page_addr;
 	void *end_page_addr;
 	size_t size;
@@ -723,30 +1187,13 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 		return NULL;
 	}
 
-	while (n) {
-		buffer = rb_entry(n, struct binder_buffer, rb_node);
-		BUG_ON(!buffer->free);
-		buffer_size = binder_buffer_size(proc, buffer);
-
-		if (size < buffer_size) {
-			best_fit = n;
-			n = n->rb_left;
-		} else if (size > buffer_size)
-			n = n->rb_right;
-		else {
-			best_fit = n;
-			break;
-		}
-	}
-	if (best_fit == NULL) {
+	buffer = binder_find_free_buffer(proc, size);
+	if (buffer == NULL) {
 		printk(KERN_ERR "binder: %d: binder_alloc_buf size %zd failed, "
 		       "no address space\n", proc->pid, size);
 		return NULL;
 	}
-	if (n == NULL) {
-		buffer = rb_entry(best_fit, struct binder_buffer, rb_node);
-		buffer_size = binder_buffer_size(proc, buffer);
-	}
+	buffer_size = binder_buffer_size(proc, buffer);
 
 	binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
 		     "binder: %d: binder_alloc_buf size %zd got buff"
@@ -754,7 +1201,7 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 
 	has_page_addr =
 		(void *)(((uintptr_t)buffer->data + buffer_size) & PAGE_MASK);
-	if (n == NULL) {
+	if (buffer_size != size) {
 		if (size + sizeof(struct binder_buffer) + 4 >= buffer_size)
 			buffer_size = size; /* no room for other buffers */
 		else
@@ -768,7 +1215,7 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 	    (void *)PAGE_ALIGN((uintptr_t)buffer->data), end_page_addr, NULL))
 		return NULL;
 
-	rb_erase(best_fit, &proc->free_buffers);
+	binder_erase_free_buffer(proc, buffer);
 	buffer->free = 0;
 	binder_insert_allocated_buffer(proc, buffer);
 	if (buffer_size != size) {
@@ -783,6 +1230,10 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 	buffer->data_size = data_size;
 	buffer->offsets_size = offsets_size;
 	buffer->async_transaction = is_async;
+	buffer->allow_user_free = 0;
+	buffer->has_mapped_objects = 0;
+	buffer->transaction = NULL;
+	buffer->target_node = NULL;
 	if (is_async) {
 		proc->free_async_space -= size + sizeof(struct binder_buffer);
 		binder_debug(BINDER_DEBUG_BUFFER_ALLOC_ASYNC,
@@ -794,6 +1245,18 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 	return buffer;
 }
 
+static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
+					      size_t data_size,
+					      size_t offsets_size, int is_async)
+{
+	struct binder_buffer *buffer;
+
+	mutex_lock(&proc->alloc_lock);
+	buffer = __binder_alloc_buf(proc, data_size, offsets_size, is_async);
+	mutex_unlock(&proc->alloc_lock);
+	return buffer;
+}
+
 static void *buffer_start_page(struct binder_buffer *buffer)
 {
 	return (void *)((uintptr_t)buffer & PAGE_MASK);
@@ -851,8 +1314,8 @@ static void binder_delete_free_buffer(struct binder_proc *proc,
 	}
 }
 
-static void binder_free_buf(struct binder_proc *proc,
-			    struct binder_buffer *buffer)
+static void __binder_free_buf(struct binder_proc *proc,
+			      struct binder_buffer *buffer)
 {
 	size_t size, buffer_size;
 
@@ -890,7 +1353,7 @@ static void binder_free_buf(struct binder_proc *proc,
 		struct binder_buffer *next = list_entry(buffer->entry.next,
 						struct binder_buffer, entry);
 		if (next->free) {
-			rb_erase(&next->rb_node, &proc->free_buffers);
+			binder_erase_free_buffer(proc, next);
 			binder_delete_free_buffer(proc, next);
 		}
 	}
@@ -899,13 +1362,21 @@ static void binder_free_buf(struct binder_proc *proc,
 						struct binder_buffer, entry);
 		if (prev->free) {
 			binder_delete_free_buffer(proc, buffer);
-			rb_erase(&prev->rb_node, &proc->free_buffers);
+			binder_erase_free_buffer(proc, prev);
 			buffer = prev;
 		}
 	}
 	binder_insert_free_buffer(proc, buffer);
 }
 
+static void binder_free_buf(struct binder_proc *proc,
+			    struct binder_buffer *buffer)
+{
+	mutex_lock(&proc->alloc_lock);
+	__binder_free_buf(proc, buffer);
+	mutex_unlock(&proc->alloc_lock);
+}
+
 static struct binder_node *binder_get_node(struct binder_proc *proc,
 					   void __user *ptr)
 {
@@ -1035,6 +1506,7 @@ static int binder_dec_node(struct binder_node *node, int strong, int internal)
 					     "binder: dead node %d deleted\n",
 					     node->debug_id);
 			}
+			binder_put_latency(node->latency);
 			kfree(node);
 			binder_stats_deleted(BINDER_STAT_NODE);
 		}
@@ -1224,10 +1696,28 @@ static void binder_pop_transaction(struct binder_thread *target_thread,
 	t->need_reply = 0;
 	if (t->buffer)
 		t->buffer->transaction = NULL;
+	binder_put_latency(t->latency);
 	kfree(t);
 	binder_stats_deleted(BINDER_STAT_TRANSACTION);
 }
 
+/*
+ * A thread that still waits for the reply to a transaction it sent can be
+ * handed a failed reply by another thread at any time binder_main_lock is
+ * not held.
+ */
+static int binder_thread_awaits_reply(struct binder_thread *thread)
+{
+	struct binder_transaction *t = thread->transaction_stack;
+
+	while (t) {
+		if (t->from == thread)
+			return 1;
+		t = (t->to_thread == thread) ? t->to_parent : t->from_parent;
+	}
+	return 0;
+}
+
 static void binder_send_failed_reply(struct binder_transaction *t,
 				     uint32_t error_code)
 {
@@ -1350,6 +1840,18 @@ static void binder_transaction_buffer_release(struct binder_proc *proc,
 				task_close_fd(proc, fp->handle);
 			break;
 
+		case BINDER_TYPE_MAPPED: {
+			struct binder_mapped_object *mp = (void *)fp;
+			if (*offp > buffer->data_size - sizeof(*mp) ||
+			    buffer->data_size < sizeof(*mp))
+				break;
+			binder_debug(BINDER_DEBUG_TRANSACTION,
+				     "        mapped fd %ld at %p\n",
+				     mp->handle, mp->address);
+			if (failed_at)
+				task_close_fd(proc, mp->handle);
+		} break;
+
 		default:
 			printk(KERN_ERR "binder: transaction release %d bad "
 			       "object type %lx\n", debug_id, fp->type);
@@ -1358,6 +1860,64 @@ static void binder_transaction_buffer_release(struct binder_proc *proc,
 	}
 }
 
+/*
+ * Runs in the context of the thread that has just returned buffer to
+ * user space, without binder_main_lock since it takes mmap_sem. The fds of
+ * BINDER_TYPE_MAPPED objects were installed when the transaction was sent;
+ * map the ranges they describe into our own address space so the payload
+ * is never copied. Either all ranges are mapped or, if one fails, none
+ * are, every address is left NULL and the error is returned.
+ */
+static int binder_map_objects(struct binder_proc *proc,
+			       struct binder_buffer *buffer)
+{
+	size_t *offp, *off_start, *off_end;
+	struct binder_mapped_object *mp;
+	struct mm_struct *mm = current->mm;
+	unsigned long addr;
+
+	off_start = (size_t *)(buffer->data + ALIGN(buffer->data_size, sizeof(void *)));
+	off_end = (void *)off_start + buffer->offsets_size;
+	down_write(&mm->mmap_sem);
+	for (offp = off_start; offp < off_end; offp++) {
+		struct file *file;
+		unsigned long prot = PROT_READ;
+
+		mp = (struct binder_mapped_object *)(buffer->data + *offp);
+		if (mp->type != BINDER_TYPE_MAPPED)
+			continue;
+		file = fget(mp->handle);
+		if (file == NULL) {
+			addr = -EBADF;
+			goto err_map_failed;
+		}
+		if (mp->flags & FLAT_BINDER_FLAG_MAP_WRITE)
+			prot |= PROT_WRITE;
+		addr = do_mmap(file, 0, mp->length, prot, MAP_SHARED,
+			       mp->offset);
+		fput(file);
+		if (IS_ERR_VALUE(addr))
+			goto err_map_failed;
+		mp->address = (void *)addr;
+	}
+	up_write(&mm->mmap_sem);
+	return 0;
+
+err_map_failed:
+	binder_debug(BINDER_DEBUG_TRANSACTION,
+		     "binder: %d: failed to map fd %ld, %ld\n",
+		     proc->pid, mp->handle, (long)addr);
+	for (off_end = offp, offp = off_start; offp < off_end; offp++) {
+		mp = (struct binder_mapped_object *)(buffer->data + *offp);
+		if (mp->type != BINDER_TYPE_MAPPED || mp->address == NULL)
+			continue;
+		do_munmap(mm, (unsigned long)mp->address, mp->length);
+		mp->address = NULL;
+	}
+	up_write(&mm->mmap_sem);
+	return (long)addr;
+}
+
 static void binder_transaction(struct binder_proc *proc,
 			       struct binder_thread *thread,
 			       struct binder_transaction_data *tr, int reply)
@@ -1373,6 +1933,8 @@ static void binder_transaction(struct binder_proc *proc,
 	struct binder_transaction *in_reply_to = NULL;
 	struct binder_transaction_log_entry *e;
 	uint32_t return_error;
+	const char *copy_failed = NULL;
+	int unlocked;
 
 	e = binder_transaction_log_add(&binder_transaction_log);
 	e->call_type = reply ? 2 : !!(tr->flags & TF_ONE_WAY);
@@ -1391,7 +1953,7 @@ static void binder_transaction(struct binder_proc *proc,
 			return_error = BR_FAILED_REPLY;
 			goto err_empty_call_stack;
 		}
-		binder_set_nice(in_reply_to->saved_priority);
+		binder_restore_priority(current, in_reply_to->saved_priority);
 		if (in_reply_to->to_thread != thread) {
 			binder_user_error("binder: %d:%d got reply transaction "
 				"with bad transaction stack,"
@@ -1464,21 +2026,8 @@ static void binder_transaction(struct binder_proc *proc,
 				return_error = BR_FAILED_REPLY;
 				goto err_bad_call_stack;
 			}
-			while (tmp) {
-				if (tmp->from && tmp->from->proc == target_proc)
-					target_thread = tmp->from;
-				tmp = tmp->from_parent;
-			}
 		}
 	}
-	if (target_thread) {
-		e->to_thread = target_thread->pid;
-		target_list = &target_thread->todo;
-		target_wait = &target_thread->wait;
-	} else {
-		target_list = &target_proc->todo;
-		target_wait = &target_proc->wait;
-	}
 	e->to_proc = target_proc->pid;
 
 	/* TODO: reuse incoming transaction for reply */
@@ -1499,60 +2048,103 @@ static void binder_transaction(struct binder_proc *proc,
 	t->debug_id = ++binder_last_id;
 	e->debug_id = t->debug_id;
 
-	if (reply)
-		binder_debug(BINDER_DEBUG_TRANSACTION,
-			     "binder: %d:%d BC_REPLY %d -> %d:%d, "
-			     "data %p-%p size %zd-%zd\n",
-			     proc->pid, thread->pid, t->debug_id,
-			     target_proc->pid, target_thread->pid,
-			     tr->data.ptr.buffer, tr->data.ptr.offsets,
-			     tr->data_size, tr->offsets_size);
-	else
-		binder_debug(BINDER_DEBUG_TRANSACTION,
-			     "binder: %d:%d BC_TRANSACTION %d -> "
-			     "%d - node %d, data %p-%p size %zd-%zd\n",
-			     proc->pid, thread->pid, t->debug_id,
-			     target_proc->pid, target_node->debug_id,
-			     tr->data.ptr.buffer, tr->data.ptr.offsets,
-			     tr->data_size, tr->offsets_size);
-
 	if (!reply && !(tr->flags & TF_ONE_WAY))
 		t->from = thread;
 	else
 		t->from = NULL;
 	t->sender_euid = proc->tsk->cred->euid;
 	t->to_proc = target_proc;
-	t->to_thread = target_thread;
 	t->code = tr->code;
 	t->flags = tr->flags;
-	t->priority = task_nice(current);
+	t->priority = binder_get_priority(current);
+	t->send_time = ktime_get();
+
+	/*
+	 * Pin the target while the payload is copied without
+	 * binder_main_lock; it is revalidated once the lock is retaken.
+	 * A thread that may receive a failed reply meanwhile keeps the
+	 * lock, so that its return_error cannot change under it.
+	 */
+	target_proc->tmp_ref++;
+	if (target_node)
+		binder_inc_node(target_node, 1, 0, NULL);
+	unlocked = !binder_thread_awaits_reply(thread);
+	if (unlocked)
+		mutex_unlock(&binder_main_lock);
+
 	t->buffer = binder_alloc_buf(target_proc, tr->data_size,
 		tr->offsets_size, !reply && (t->flags & TF_ONE_WAY));
+	if (t->buffer != NULL) {
+		t->buffer->debug_id = t->debug_id;
+		t->buffer->transaction = t;
+		t->buffer->target_node = target_node;
+		if (copy_from_user(t->buffer->data, tr->data.ptr.buffer,
+				   tr->data_size))
+			copy_failed = "data";
+		else if (copy_from_user(t->buffer->data +
+					ALIGN(tr->data_size, sizeof(void *)),
+					tr->data.ptr.offsets, tr->offsets_size))
+			copy_failed = "offsets";
+	}
+
+	if (unlocked)
+		mutex_lock(&binder_main_lock);
 	if (t->buffer == NULL) {
 		return_error = BR_FAILED_REPLY;
 		goto err_binder_alloc_buf_failed;
 	}
-	t->buffer->allow_user_free = 0;
-	t->buffer->debug_id = t->debug_id;
-	t->buffer->transaction = t;
-	t->buffer->target_node = target_node;
-	if (target_node)
-		binder_inc_node(target_node, 1, 0, NULL);
-
 	offp = (size_t *)(t->buffer->data + ALIGN(tr->data_size, sizeof(void *)));
-
-	if (copy_from_user(t->buffer->data, tr->data.ptr.buffer, tr->data_size)) {
+	if (copy_failed) {
 		binder_user_error("binder: %d:%d got transaction with invalid "
-			"data ptr\n", proc->pid, thread->pid);
+			"%s ptr\n", proc->pid, thread->pid, copy_failed);
 		return_error = BR_FAILED_REPLY;
 		goto err_copy_data_failed;
 	}
-	if (copy_from_user(offp, tr->data.ptr.offsets, tr->offsets_size)) {
-		binder_user_error("binder: %d:%d got transaction with invalid "
-			"offsets ptr\n", proc->pid, thread->pid);
-		return_error = BR_FAILED_REPLY;
-		goto err_copy_data_failed;
+	if (target_proc->is_dead) {
+		return_error = BR_DEAD_REPLY;
+		goto err_dead_target;
+	}
+	if (reply) {
+		target_thread = in_reply_to->from;
+		if (target_thread == NULL) {
+			return_error = BR_DEAD_REPLY;
+			goto err_dead_target;
+		}
+	} else if (!(tr->flags & TF_ONE_WAY)) {
+		struct binder_transaction *tmp;
+		for (tmp = thread->transaction_stack; tmp;
+		     tmp = tmp->from_parent) {
+			if (tmp->from && tmp->from->proc == target_proc)
+				target_thread = tmp->from;
+		}
+	}
+	t->to_thread = target_thread;
+	if (target_thread) {
+		e->to_thread = target_thread->pid;
+		target_list = &target_thread->todo;
+		target_wait = &target_thread->wait;
+	} else {
+		target_list = &target_proc->todo;
+		target_wait = &target_proc->wait;
 	}
+
+	if (reply)
+		binder_debug(BINDER_DEBUG_TRANSACTION,
+			     "binder: %d:%d BC_REPLY %d -> %d:%d, "
+			     "data %p-%p size %zd-%zd\n",
+			     proc->pid, thread->pid, t->debug_id,
+			     target_proc->pid, target_thread->pid,
+			     tr->data.ptr.buffer, tr->data.ptr.offsets,
+			     tr->data_size, tr->offsets_size);
+	else
+		binder_debug(BINDER_DEBUG_TRANSACTION,
+			     "binder: %d:%d BC_TRANSACTION %d -> "
+			     "%d - node %d, data %p-%p size %zd-%zd\n",
+			     proc->pid, thread->pid, t->debug_id,
+			     target_proc->pid, target_node->debug_id,
+			     tr->data.ptr.buffer, tr->data.ptr.offsets,
+			     tr->data_size, tr->offsets_size);
+
 	if (!IS_ALIGNED(tr->offsets_size, sizeof(size_t))) {
 		binder_user_error("binder: %d:%d got transaction with "
 			"invalid offsets size, %zd\n",
@@ -1593,6 +2185,7 @@ static void binder_transaction(struct binder_proc *proc,
 					proc->pid, thread->pid,
 					fp->binder, node->debug_id,
 					fp->cookie, node->cookie);
+				return_error = BR_FAILED_REPLY;
 				goto err_binder_get_ref_for_node_failed;
 			}
 			ref = binder_get_ref_for_node(target_proc, node);
@@ -1690,6 +2283,79 @@ static void binder_transaction(struct binder_proc *proc,
 			fp->handle = target_fd;
 		} break;
 
+		case BINDER_TYPE_MAPPED: {
+			struct binder_mapped_object *mp = (void *)fp;
+			int target_fd;
+			struct file *file;
+
+			if (*offp > t->buffer->data_size - sizeof(*mp) ||
+			    t->buffer->data_size < sizeof(*mp)) {
+				binder_user_error("binder: %d:%d got transaction with "
+					"invalid mapped object offset, %zd\n",
+					proc->pid, thread->pid, *offp);
+				return_error = BR_FAILED_REPLY;
+				goto err_bad_offset;
+			}
+			if (reply) {
+				if (!(in_reply_to->flags & TF_ACCEPT_FDS)) {
+					binder_user_error("binder: %d:%d got reply with mapped fd, %ld, but target does not allow fds\n",
+						proc->pid, thread->pid, mp->handle);
+					return_error = BR_FAILED_REPLY;
+					goto err_fd_not_allowed;
+				}
+			} else if (!target_node->accept_fds) {
+				binder_user_error("binder: %d:%d got transaction with mapped fd, %ld, but target does not allow fds\n",
+					proc->pid, thread->pid, mp->handle);
+				return_error = BR_FAILED_REPLY;
+				goto err_fd_not_allowed;
+			}
+			if (proc->protocol_version < BINDER_MAPPED_PROTOCOL_VERSION ||
+			    target_proc->protocol_version < BINDER_MAPPED_PROTOCOL_VERSION) {
+				binder_user_error("binder: %d:%d got transaction with mapped fd, %ld, but protocol version %d -> %d does not allow it\n",
+					proc->pid, thread->pid, mp->handle,
+					proc->protocol_version,
+					target_proc->protocol_version);
+				return_error = BR_FAILED_REPLY;
+				goto err_bad_object_type;
+			}
+			if (mp->length == 0 ||
+			    (mp->offset & ~PAGE_MASK)) {
+				binder_user_error("binder: %d:%d got transaction with bad mapped range, %lx %zd\n",
+					proc->pid, thread->pid, mp->offset,
+					mp->length);
+				return_error = BR_FAILED_REPLY;
+				goto err_bad_object_type;
+			}
+
+			file = fget(mp->handle);
+			if (file == NULL) {
+				binder_user_error("binder: %d:%d got transaction with invalid mapped fd, %ld\n",
+					proc->pid, thread->pid, mp->handle);
+				return_error = BR_FAILED_REPLY;
+				goto err_fget_failed;
+			}
+			if (!is_ashmem_file(file) && !is_pmem_file(file)) {
+				binder_user_error("binder: %d:%d got transaction with mapped fd, %ld, that is not ashmem or pmem\n",
+					proc->pid, thread->pid, mp->handle);
+				fput(file);
+				return_error = BR_FAILED_REPLY;
+				goto err_bad_object_type;
+			}
+			target_fd = task_get_unused_fd_flags(target_proc, O_CLOEXEC);
+			if (target_fd < 0) {
+				fput(file);
+				return_error = BR_FAILED_REPLY;
+				goto err_get_unused_fd_failed;
+			}
+			task_fd_install(target_proc, target_fd, file);
+			binder_debug(BINDER_DEBUG_TRANSACTION,
+				     "        mapped fd %ld -> %d, %zd bytes\n",
+				     mp->handle, target_fd, mp->length);
+			mp->handle = target_fd;
+			mp->address = NULL;
+			t->buffer->has_mapped_objects = 1;
+		} break;
+
 		default:
 			binder_user_error("binder: %d:%d got transactio"
 				"n with invalid object type, %lx\n",
@@ -1700,12 +2366,31 @@ static void binder_transaction(struct binder_proc *proc,
 	}
 	if (reply) {
 		BUG_ON(t->buffer->async_transaction != 0);
+		if (in_reply_to->latency) {
+			ktime_t now = ktime_get();
+			s64 service_us = ktime_us_delta(now,
+							in_reply_to->recv_time);
+			binder_latency_add(in_reply_to->latency->service,
+					   &in_reply_to->latency->service_max_us,
+					   service_us);
+			trace_binder_transaction_replied(in_reply_to->debug_id,
+				in_reply_to->latency->node_debug_id, service_us,
+				ktime_us_delta(now, in_reply_to->send_time));
+		}
 		binder_pop_transaction(target_thread, in_reply_to);
 	} else if (!(t->flags & TF_ONE_WAY)) {
 		BUG_ON(t->buffer->async_transaction != 0);
 		t->need_reply = 1;
 		t->from_parent = thread->transaction_stack;
 		thread->transaction_stack = t;
+		/*
+		 * A thread that is already committed to this work (it is
+		 * blocked in a call we are nested in) is boosted now rather
+		 * than when it gets around to reading the transaction.
+		 */
+		if (target_thread)
+			binder_transaction_priority(target_thread->task, t,
+						    target_node);
 	} else {
 		BUG_ON(target_node == NULL);
 		BUG_ON(t->buffer->async_transaction != 1);
@@ -1715,12 +2400,24 @@ static void binder_transaction(struct binder_proc *proc,
 		} else
 			target_node->has_async_transaction = 1;
 	}
+	if (target_node && target_node->latency == NULL) {
+		target_node->latency = kzalloc(sizeof(*target_node->latency),
+					       GFP_KERNEL);
+		if (target_node->latency) {
+			target_node->latency->refs = 1;
+			target_node->latency->node_debug_id =
+				target_node->debug_id;
+		}
+	}
+	trace_binder_transaction(t->debug_id, reply, t->flags, proc->pid,
+				 target_proc->pid, e->to_node);
 	t->work.type = BINDER_WORK_TRANSACTION;
 	list_add_tail(&t->work.entry, target_list);
 	tcomplete->type = BINDER_WORK_TRANSACTION_COMPLETE;
 	list_add_tail(&tcomplete->entry, &thread->todo);
 	if (target_wait)
 		wake_up_interruptible(target_wait);
+	binder_proc_dec_tmpref(target_proc);
 	return;
 
 err_get_unused_fd_failed:
@@ -1731,11 +2428,17 @@ err_binder_get_ref_failed:
 err_binder_new_node_failed:
 err_bad_object_type:
 err_bad_offset:
+err_dead_target:
 err_copy_data_failed:
 	binder_transaction_buffer_release(target_proc, t->buffer, offp);
 	t->buffer->transaction = NULL;
 	binder_free_buf(target_proc, t->buffer);
+	goto err_put_target;
 err_binder_alloc_buf_failed:
+	if (target_node)
+		binder_dec_node(target_node, 1, 0);
+err_put_target:
+	binder_proc_dec_tmpref(target_proc);
 	kfree(tcomplete);
 	binder_stats_deleted(BINDER_STAT_TRANSACTION_COMPLETE);
 err_alloc_tcomplete_failed:
@@ -2181,6 +2884,7 @@ static int binder_thread_read(struct binder_proc *proc,
 {
 	void __user *ptr = buffer + *consumed;
 	void __user *end = buffer + size;
+	struct binder_buffer *map_buffer = NULL;
 
 	int ret = 0;
 	int wait_for_proc_work;
@@ -2215,7 +2919,7 @@ retry:
 	thread->looper |= BINDER_LOOPER_STATE_WAITING;
 	if (wait_for_proc_work)
 		proc->ready_threads++;
-	mutex_unlock(&binder_lock);
+	mutex_unlock(&binder_main_lock);
 	if (wait_for_proc_work) {
 		if (!(thread->looper & (BINDER_LOOPER_STATE_REGISTERED |
 					BINDER_LOOPER_STATE_ENTERED))) {
@@ -2226,7 +2930,7 @@ retry:
 			wait_event_interruptible(binder_user_error_wait,
 						 binder_stop_on_user_error < 2);
 		}
-		binder_set_nice(proc->default_priority);
+		binder_set_default_priority(current, proc);
 		if (non_block) {
 			if (!binder_has_proc_work(proc, thread))
 				ret = -EAGAIN;
@@ -2239,7 +2943,7 @@ retry:
 		} else
 			ret = wait_event_interruptible(thread->wait, binder_has_thread_work(thread));
 	}
-	mutex_lock(&binder_lock);
+	mutex_lock(&binder_main_lock);
 	if (wait_for_proc_work)
 		proc->ready_threads--;
 	thread->looper &= ~BINDER_LOOPER_STATE_WAITING;
@@ -2335,6 +3039,7 @@ retry:
 						     proc->pid, thread->pid, node->debug_id,
 						     node->ptr, node->cookie);
 					rb_erase(&node->rb_node, &proc->nodes);
+					binder_put_latency(node->latency);
 					kfree(node);
 					binder_stats_deleted(BINDER_STAT_NODE);
 				} else {
@@ -2385,17 +3090,25 @@ retry:
 			continue;
 
 		BUG_ON(t->buffer == NULL);
+		t->recv_time = ktime_get();
+		trace_binder_transaction_received(t->debug_id, thread->pid,
+			ktime_us_delta(t->recv_time, t->send_time));
 		if (t->buffer->target_node) {
 			struct binder_node *target_node = t->buffer->target_node;
+			struct binder_latency *latency = target_node->latency;
+			if (latency) {
+				binder_latency_add(latency->queue,
+					&latency->queue_max_us,
+					ktime_us_delta(t->recv_time,
+						       t->send_time));
+				if (!(t->flags & TF_ONE_WAY)) {
+					latency->refs++;
+					t->latency = latency;
+				}
+			}
 			tr.target.ptr = target_node->ptr;
 			tr.cookie =  target_node->cookie;
-			t->saved_priority = task_nice(current);
-			if (t->priority < target_node->min_priority &&
-			    !(t->flags & TF_ONE_WAY))
-				binder_set_nice(t->priority);
-			else if (!(t->flags & TF_ONE_WAY) ||
-				 t->saved_priority > target_node->min_priority)
-				binder_set_nice(target_node->min_priority);
+			binder_transaction_priority(current, t, target_node);
 			cmd = BR_TRANSACTION;
 		} else {
 			tr.target.ptr = NULL;
@@ -2442,7 +3155,13 @@ retry:
 			     tr.data.ptr.buffer, tr.data.ptr.offsets);
 
 		list_del(&t->work.entry);
-		t->buffer->allow_user_free = 1;
+		/* Mapped objects are filled in after main_lock is dropped;
+		 * until then user space may not free the buffer.
+		 */
+		if (t->buffer->has_mapped_objects)
+			map_buffer = t->buffer;
+		else
+			t->buffer->allow_user_free = 1;
 		if (cmd == BR_TRANSACTION && !(t->flags & TF_ONE_WAY)) {
 			t->to_parent = thread->transaction_stack;
 			t->to_thread = thread;
@@ -2457,6 +3176,26 @@ retry:
 
 done:
 
+	if (map_buffer) {
+		int map_error;
+
+		mutex_unlock(&binder_main_lock);
+		map_error = binder_map_objects(proc, map_buffer);
+		mutex_lock(&binder_main_lock);
+		map_buffer->allow_user_free = 1;
+		/* Report the failure right after the transaction, or with
+		 * the next read if there is no room left for it.
+		 */
+		if (map_error && end - ptr >= 2 * sizeof(uint32_t)) {
+			if (put_user(BR_ERROR, (uint32_t __user *)ptr))
+				return -EFAULT;
+			ptr += sizeof(uint32_t);
+			if (put_user(map_error, (int __user *)ptr))
+				return -EFAULT;
+			ptr += sizeof(int);
+		} else if (map_error && thread->return_error == BR_OK)
+			thread->return_error = BR_ERROR;
+	}
 	*consumed = ptr - buffer;
 	if (proc->requested_threads + proc->ready_threads == 0 &&
 	    proc->requested_threads_started < proc->max_threads &&
@@ -2522,6 +3261,8 @@ static struct binder_thread *binder_get_thread(struct binder_proc *proc)
 		binder_stats_created(BINDER_STAT_THREAD);
 		thread->proc = proc;
 		thread->pid = current->pid;
+		get_task_struct(current);
+		thread->task = current;
 		init_waitqueue_head(&thread->wait);
 		INIT_LIST_HEAD(&thread->todo);
 		rb_link_node(&thread->rb_node, parent, p);
@@ -2569,6 +3310,7 @@ static int binder_free_thread(struct binder_proc *proc,
 	if (send_reply)
 		binder_send_failed_reply(send_reply, BR_DEAD_REPLY);
 	binder_release_work(&thread->todo);
+	put_task_struct(thread->task);
 	kfree(thread);
 	binder_stats_deleted(BINDER_STAT_THREAD);
 	return active_transactions;
@@ -2581,12 +3323,12 @@ static unsigned int binder_poll(struct file *filp,
 	struct binder_thread *thread = NULL;
 	int wait_for_proc_work;
 
-	mutex_lock(&binder_lock);
+	mutex_lock(&binder_main_lock);
 	thread = binder_get_thread(proc);
 
 	wait_for_proc_work = thread->transaction_stack == NULL &&
 		list_empty(&thread->todo) && thread->return_error == BR_OK;
-	mutex_unlock(&binder_lock);
+	mutex_unlock(&binder_main_lock);
 
 	if (wait_for_proc_work) {
 		if (binder_has_proc_work(proc, thread))
@@ -2618,7 +3360,7 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	if (ret)
 		return ret;
 
-	mutex_lock(&binder_lock);
+	mutex_lock(&binder_main_lock);
 	thread = binder_get_thread(proc);
 	if (thread == NULL) {
 		ret = -ENOMEM;
@@ -2709,6 +3451,20 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 		binder_free_thread(proc, thread);
 		thread = NULL;
 		break;
+	case BINDER_SET_VERSION: {
+		int version;
+		if (copy_from_user(&version, ubuf, sizeof(version))) {
+			ret = -EINVAL;
+			goto err;
+		}
+		if (version != BINDER_CURRENT_PROTOCOL_VERSION &&
+		    version != BINDER_MAPPED_PROTOCOL_VERSION) {
+			ret = -EINVAL;
+			goto err;
+		}
+		proc->protocol_version = version;
+		break;
+	}
 	case BINDER_VERSION:
 		if (size != sizeof(struct binder_version)) {
 			ret = -EINVAL;
@@ -2727,7 +3483,7 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 err:
 	if (thread)
 		thread->looper &= ~BINDER_LOOPER_STATE_NEED_RETURN;
-	mutex_unlock(&binder_lock);
+	mutex_unlock(&binder_main_lock);
 	wait_event_interruptible(binder_user_error_wait, binder_stop_on_user_error < 2);
 	if (ret && ret != -ERESTARTSYS)
 		printk(KERN_INFO "binder: %d:%d ioctl %x %lx returned %d\n", proc->pid, current->pid, cmd, arg, ret);
@@ -2764,7 +3520,7 @@ static struct vm_operations_struct binder_vm_ops = {
 
 static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 {
-	int ret;
+	int ret, i;
 	struct vm_struct *area;
 	struct binder_proc *proc = filp->private_data;
 	const char *failure_string;
@@ -2816,6 +3572,10 @@ static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 		goto err_alloc_pages_failed;
 	}
 	proc->buffer_size = vma->vm_end - vma->vm_start;
+	for (i = 0; i < proc->buffer_size / PAGE_SIZE; i++) {
+		INIT_LIST_HEAD(&proc->pages[i].lru);
+		proc->pages[i].proc = proc;
+	}
 
 	vma->vm_ops = &binder_vm_ops;
 	vma->vm_private_data = proc;
@@ -2827,6 +3587,8 @@ static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 	}
 	buffer = proc->buffer;
 	INIT_LIST_HEAD(&proc->buffers);
+	for (i = 0; i < BINDER_FREE_LISTS; i++)
+		INIT_LIST_HEAD(&proc->free_lists[i]);
 	list_add(&buffer->entry, &proc->buffers);
 	buffer->free = 1;
 	binder_insert_free_buffer(proc, buffer);
@@ -2867,14 +3629,20 @@ static int binder_open(struct inode *nodp, struct file *filp)
 	proc->tsk = current;
 	INIT_LIST_HEAD(&proc->todo);
 	init_waitqueue_head(&proc->wait);
-	proc->default_priority = task_nice(current);
-	mutex_lock(&binder_lock);
+	mutex_init(&proc->alloc_lock);
+	proc->protocol_version = BINDER_CURRENT_PROTOCOL_VERSION;
+	if (binder_rt_policy(current->policy)) {
+		proc->default_priority.sched_policy = SCHED_NORMAL;
+		proc->default_priority.prio = 0;
+	} else
+		proc->default_priority = binder_get_priority(current);
+	mutex_lock(&binder_main_lock);
 	binder_stats_created(BINDER_STAT_PROC);
 	hlist_add_head(&proc->proc_node, &binder_procs);
 	proc->pid = current->group_leader->pid;
 	INIT_LIST_HEAD(&proc->delivered_death);
 	filp->private_data = proc;
-	mutex_unlock(&binder_lock);
+	mutex_unlock(&binder_main_lock);
 
 	if (binder_proc_dir_entry_proc) {
 		char strbuf[11];
@@ -2933,9 +3701,8 @@ static int binder_release(struct inode *nodp, struct file *filp)
 static void binder_deferred_release(struct binder_proc *proc)
 {
 	struct hlist_node *pos;
-	struct binder_transaction *t;
 	struct rb_node *n;
-	int threads, nodes, incoming_refs, outgoing_refs, buffers, active_transactions, page_count;
+	int threads, nodes, incoming_refs, outgoing_refs, active_transactions;
 
 	BUG_ON(proc->vma);
 	BUG_ON(proc->files);
@@ -2964,6 +3731,7 @@ static void binder_deferred_release(struct binder_proc *proc)
 		rb_erase(&node->rb_node, &proc->nodes);
 		list_del_init(&node->work.entry);
 		if (hlist_empty(&node->refs)) {
+			binder_put_latency(node->latency);
 			kfree(node);
 			binder_stats_deleted(BINDER_STAT_NODE);
 		} else {
@@ -3001,8 +3769,27 @@ static void binder_deferred_release(struct binder_proc *proc)
 		binder_delete_ref(ref);
 	}
 	binder_release_work(&proc->todo);
-	buffers = 0;
 
+	binder_debug(BINDER_DEBUG_OPEN_CLOSE,
+		     "binder_release: %d threads %d, nodes %d (ref %d), "
+		     "refs %d, active transactions %d\n",
+		     proc->pid, threads, nodes, incoming_refs, outgoing_refs,
+		     active_transactions);
+
+	proc->is_dead = 1;
+	if (proc->tmp_ref == 0)
+		binder_free_proc(proc);
+}
+
+static void binder_free_proc(struct binder_proc *proc)
+{
+	struct binder_transaction *t;
+	struct rb_node *n;
+	int buffers, page_count;
+
+	BUG_ON(!proc->is_dead || proc->tmp_ref);
+
+	buffers = 0;
 	while ((n = rb_first(&proc->allocated_buffers))) {
 		struct binder_buffer *buffer = rb_entry(n, struct binder_buffer,
 							rb_node);
@@ -3024,20 +3811,24 @@ static void binder_deferred_release(struct binder_proc *proc)
 	page_count = 0;
 	if (proc->pages) {
 		int i;
+		mutex_lock(&proc->alloc_lock);
 		for (i = 0; i < proc->buffer_size / PAGE_SIZE; i++) {
-			if (proc->pages[i]) {
+			if (proc->pages[i].page) {
 				void *page_addr = proc->buffer + i * PAGE_SIZE;
 				binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
 					     "binder_release: %d: "
 					     "page %d at %p not freed\n",
 					     proc->pid, i,
 					     page_addr);
+				binder_lru_del(&proc->pages[i]);
 				unmap_kernel_range((unsigned long)page_addr,
 					PAGE_SIZE);
-				__free_page(proc->pages[i]);
+				__free_page(proc->pages[i].page);
+				atomic_inc(&binder_page_stats.unmap);
 				page_count++;
 			}
 		}
+		mutex_unlock(&proc->alloc_lock);
 		kfree(proc->pages);
 		vfree(proc->buffer);
 	}
@@ -3045,11 +3836,8 @@ static void binder_deferred_release(struct binder_proc *proc)
 	put_task_struct(proc->tsk);
 
 	binder_debug(BINDER_DEBUG_OPEN_CLOSE,
-		     "binder_release: %d threads %d, nodes %d (ref %d), "
-		     "refs %d, active transactions %d, buffers %d, "
-		     "pages %d\n",
-		     proc->pid, threads, nodes, incoming_refs, outgoing_refs,
-		     active_transactions, buffers, page_count);
+		     "binder_release: %d buffers %d, pages %d\n",
+		     proc->pid, buffers, page_count);
 
 	kfree(proc);
 }
@@ -3061,7 +3849,7 @@ static void binder_deferred_func(struct work_struct *work)
 
 	int defer;
 	do {
-		mutex_lock(&binder_lock);
+		mutex_lock(&binder_main_lock);
 		mutex_lock(&binder_deferred_lock);
 		if (!hlist_empty(&binder_deferred_list)) {
 			proc = hlist_entry(binder_deferred_list.first,
@@ -3086,9 +3874,9 @@ static void binder_deferred_func(struct work_struct *work)
 			binder_deferred_flush(proc);
 
 		if (defer & BINDER_DEFERRED_RELEASE)
-			binder_deferred_release(proc); /* frees proc */
+			binder_deferred_release(proc); /* may free proc */
 
-		mutex_unlock(&binder_lock);
+		mutex_unlock(&binder_main_lock);
 		if (files)
 			put_files_struct(files);
 	} while (proc);
@@ -3113,13 +3901,14 @@ static char *print_binder_transaction(char *buf, char *end, const char *prefix,
 {
 	buf += snprintf(buf, end - buf,
 			"%s %d: %p from %d:%d to %d:%d code %x "
-			"flags %x pri %ld r%d",
+			"flags %x pri %u:%d r%d",
 			prefix, t->debug_id, t,
 			t->from ? t->from->proc->pid : 0,
 			t->from ? t->from->pid : 0,
 			t->to_proc ? t->to_proc->pid : 0,
 			t->to_thread ? t->to_thread->pid : 0,
-			t->code, t->flags, t->priority, t->need_reply);
+			t->code, t->flags, t->priority.sched_policy,
+			t->priority.prio, t->need_reply);
 	if (buf >= end)
 		return buf;
 	if (t->buffer == NULL) {
@@ -3313,12 +4102,16 @@ static char *print_binder_proc(char *buf, char *end,
 					       rb_entry(n, struct binder_ref,
 							rb_node_desc));
 	}
+	if (!binder_debug_no_lock)
+		mutex_lock(&proc->alloc_lock);
 	for (n = rb_first(&proc->allocated_buffers);
 	     n != NULL && buf < end;
 	     n = rb_next(n))
 		buf = print_binder_buffer(buf, end, "  buffer",
 					  rb_entry(n, struct binder_buffer,
 						   rb_node));
+	if (!binder_debug_no_lock)
+		mutex_unlock(&proc->alloc_lock);
 	list_for_each_entry(w, &proc->todo, entry) {
 		if (buf >= end)
 			break;
@@ -3477,8 +4270,12 @@ static char *print_binder_proc_stats(char *buf, char *end,
 		return buf;
 
 	count = 0;
+	if (!binder_debug_no_lock)
+		mutex_lock(&proc->alloc_lock);
 	for (n = rb_first(&proc->allocated_buffers); n != NULL; n = rb_next(n))
 		count++;
+	if (!binder_debug_no_lock)
+		mutex_unlock(&proc->alloc_lock);
 	buf += snprintf(buf, end - buf, "  buffers: %d\n", count);
 	if (buf >= end)
 		return buf;
@@ -3518,7 +4315,7 @@ static int binder_read_proc_state(char *page, char **start, off_t off,
 		return 0;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		mutex_lock(&binder_main_lock);
 
 	buf += snprintf(buf, end - buf, "binder state:\n");
 
@@ -3536,7 +4333,7 @@ static int binder_read_proc_state(char *page, char **start, off_t off,
 		buf = print_binder_proc(buf, end, proc, 1);
 	}
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		mutex_unlock(&binder_main_lock);
 	if (buf > page + PAGE_SIZE)
 		buf = page + PAGE_SIZE;
 
@@ -3564,11 +4361,19 @@ static int binder_read_proc_stats(char *page, char **start, off_t off,
 		return 0;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		mutex_lock(&binder_main_lock);
 
 	p += snprintf(p, PAGE_SIZE, "binder stats:\n");
 
 	p = print_binder_stats(p, page + PAGE_SIZE, "", &binder_stats);
+	if (p < page + PAGE_SIZE)
+		p += snprintf(p, page + PAGE_SIZE - p,
+			      "pages: mapped %d unmapped %d reused %d "
+			      "cached %d\n",
+			      atomic_read(&binder_page_stats.map),
+			      atomic_read(&binder_page_stats.unmap),
+			      atomic_read(&binder_page_stats.reuse),
+			      binder_lru_count);
 
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node) {
 		if (p >= page + PAGE_SIZE)
@@ -3576,7 +4381,7 @@ static int binder_read_proc_stats(char *page, char **start, off_t off,
 		p = print_binder_proc_stats(p, page + PAGE_SIZE, proc);
 	}
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		mutex_unlock(&binder_main_lock);
 	if (p > page + PAGE_SIZE)
 		p = page + PAGE_SIZE;
 
@@ -3605,7 +4410,7 @@ static int binder_read_proc_transactions(char *page, char **start, off_t off,
 		return 0;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		mutex_lock(&binder_main_lock);
 
 	buf += snprintf(buf, end - buf, "binder transactions:\n");
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node) {
@@ -3614,7 +4419,7 @@ static int binder_read_proc_transactions(char *page, char **start, off_t off,
 		buf = print_binder_proc(buf, end, proc, 0);
 	}
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		mutex_unlock(&binder_main_lock);
 	if (buf > page + PAGE_SIZE)
 		buf = page + PAGE_SIZE;
 
@@ -3641,11 +4446,11 @@ static int binder_read_proc_proc(char *page, char **start, off_t off,
 		return 0;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		mutex_lock(&binder_main_lock);
 	p += snprintf(p, PAGE_SIZE, "binder proc state:\n");
 	p = print_binder_proc(p, page + PAGE_SIZE, proc, 1);
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		mutex_unlock(&binder_main_lock);
 
 	if (p > page + PAGE_SIZE)
 		p = page + PAGE_SIZE;
@@ -3711,6 +4516,68 @@ static int binder_read_proc_transaction_log(
 	return len < count ? len  : count;
 }
 
+static void print_binder_latency_hist(struct seq_file *m, const char *name,
+				      unsigned int *hist, s64 max_us)
+{
+	int i;
+
+	seq_printf(m, "  %s:", name);
+	for (i = 0; i < BINDER_LATENCY_BUCKETS; i++)
+		seq_printf(m, " %u", hist[i]);
+	seq_printf(m, " max %lld\n", max_us);
+}
+
+static int binder_latency_show(struct seq_file *m, void *unused)
+{
+	struct binder_proc *proc;
+	struct hlist_node *pos;
+	struct rb_node *n;
+	int do_lock = !binder_debug_no_lock;
+	int i;
+
+	if (do_lock)
+		mutex_lock(&binder_main_lock);
+
+	seq_printf(m, "binder latency (us):");
+	for (i = 0; i < BINDER_LATENCY_BUCKETS - 1; i++)
+		seq_printf(m, " <%u", 2U << i);
+	seq_printf(m, " >=%u\n", 1U << (BINDER_LATENCY_BUCKETS - 1));
+
+	hlist_for_each_entry(proc, pos, &binder_procs, proc_node) {
+		for (n = rb_first(&proc->nodes); n != NULL; n = rb_next(n)) {
+			struct binder_node *node = rb_entry(n,
+				struct binder_node, rb_node);
+			if (node->latency == NULL)
+				continue;
+			seq_printf(m, "proc %d node %d: u%p c%p\n", proc->pid,
+				   node->debug_id, node->ptr, node->cookie);
+			print_binder_latency_hist(m, "queue  ",
+				node->latency->queue,
+				node->latency->queue_max_us);
+			print_binder_latency_hist(m, "service",
+				node->latency->service,
+				node->latency->service_max_us);
+		}
+	}
+
+	if (do_lock)
+		mutex_unlock(&binder_main_lock);
+	return 0;
+}
+
+static int binder_latency_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, binder_latency_show, inode->i_private);
+}
+
+static const struct file_operations binder_latency_fops = {
+	.owner = THIS_MODULE,
+	.open = binder_latency_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
 static const struct file_operations binder_fops = {
 	.owner = THIS_MODULE,
 	.poll = binder_poll,
@@ -3740,6 +4607,14 @@ static int __init binder_init(void)
 		binder_proc_dir_entry_proc = proc_mkdir("proc",
 						binder_proc_dir_entry_root);
 	ret = misc_register(&binder_miscdev);
+	register_shrinker(&binder_shrinker);
+	binder_debugfs_dir_entry_root = debugfs_create_dir("binder", NULL);
+	if (binder_debugfs_dir_entry_root)
+		debugfs_create_file("latency",
+				    S_IRUGO,
+				    binder_debugfs_dir_entry_root,
+				    NULL,
+				    &binder_latency_fops);
 	if (binder_proc_dir_entry_root) {
 		create_proc_read_entry("state",
 				       S_IRUGO,
@@ -32,11 +32,13 @@ enum {
 	BINDER_TYPE_HANDLE	= B_PACK_CHARS('s', 'h', '*', B_TYPE_LARGE),
 	BINDER_TYPE_WEAK_HANDLE	= B_PACK_CHARS('w', 'h', '*', B_TYPE_LARGE),
 	BINDER_TYPE_FD		= B_PACK_CHARS('f', 'd', '*', B_TYPE_LARGE),
+	BINDER_TYPE_MAPPED	= B_PACK_CHARS('m', 'p', '*', B_TYPE_LARGE),
 };
 
 enum {
 	FLAT_BINDER_FLAG_PRIORITY_MASK = 0xff,
 	FLAT_BINDER_FLAG_ACCEPTS_FDS = 0x100,
+	FLAT_BINDER_FLAG_MAP_WRITE = 0x200,
 };
 
 /*
@@ -61,6 +63,26 @@ struct flat_binder_object {
 	void			*cookie;
 };
 
+/*
+ * A page range of an ashmem region or pmem file that is handed to the
+ * target in place instead of being copied into the parcel. The sender
+ * fills in the fd, the page aligned offset into it and the length. The
+ * target receives its own fd for the file in 'handle' and the address
+ * of a mapping of the range in 'address'. If the driver could not map
+ * every range of a transaction, all addresses are NULL and the
+ * transaction is followed by BR_ERROR with the negative errno. The
+ * target owns the fds and mappings and must munmap and close them. Targets must accept fds. Both sender and target must have
+ * set BINDER_MAPPED_PROTOCOL_VERSION with BINDER_SET_VERSION.
+ */
+struct binder_mapped_object {
+	unsigned long		type;		/* BINDER_TYPE_MAPPED */
+	unsigned long		flags;		/* FLAT_BINDER_FLAG_MAP_WRITE */
+	signed long		handle;
+	void			*address;
+	unsigned long		offset;
+	size_t			length;
+};
+
 /*
  * On 64-bit platforms where user code may run in 32-bits the driver must
  * translate the buffer (and local binder) addresses apropriately.
@@ -84,6 +106,13 @@ struct binder_version {
 /* This is the current protocol version. */
 #define BINDER_CURRENT_PROTOCOL_VERSION 7
 
+/*
+ * Processes that understand BINDER_TYPE_MAPPED objects opt in to this
+ * version with BINDER_SET_VERSION. BINDER_VERSION still reports the
+ * current version so existing userspace keeps working.
+ */
+#define BINDER_MAPPED_PROTOCOL_VERSION 8
+
 #define BINDER_WRITE_READ   		_IOWR('b', 1, struct binder_write_read)
 #define	BINDER_SET_IDLE_TIMEOUT		_IOW('b', 3, int64_t)
 #define	BINDER_SET_MAX_THREADS		_IOW('b', 5, size_t)
@@ -91,6 +120,7 @@ struct binder_version {
 #define	BINDER_SET_CONTEXT_MGR		_IOW('b', 7, int)
 #define	BINDER_THREAD_EXIT		_IOW('b', 8, int)
 #define BINDER_VERSION			_IOWR('b', 9, struct binder_version)
+#define	BINDER_SET_VERSION		_IOW('b', 10, int)
 
 /*
  * NOTE: Two special error codes you should check for when calling
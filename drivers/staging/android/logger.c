@@ -20,43 +20,79 @@
 #include <linux/module.h>
 #include <linux/fs.h>
 #include <linux/miscdevice.h>
+#include <linux/mm.h>
 #include <linux/uaccess.h>
 #include <linux/poll.h>
+#include <linux/percpu.h>
+#include <linux/seqlock.h>
+#include <linux/spinlock.h>
 #include <linux/time.h>
 #include "logger.h"
 
+#include <asm/io.h>
 #include <asm/ioctls.h>
+#include <asm/shmparam.h>
+#ifdef CONFIG_ARM
+#include <asm/cachetype.h>
+#endif
 
 /*
  * struct logger_log - represents a specific log, such as 'main' or 'radio'
  *
  * This structure lives from module insertion until module removal, so it does
- * not need additional reference counting. The structure is protected by the
- * mutex 'mutex'.
+ * not need additional reference counting. The ring and the offsets are
+ * protected by the spinlock 'lock', which is only held while an already
+ * staged entry is copied in. Writers also bump 'seq' so that readers can
+ * sample the offsets without taking the lock.
  */
 struct logger_log {
 	unsigned char *		buffer;	/* the ring buffer itself */
+	struct logger_control *	control; /* page mmap readers see, just before buffer */
 	struct miscdevice	misc;	/* misc device representing the log */
 	wait_queue_head_t	wq;	/* wait queue for readers */
 	struct list_head	readers; /* this log's readers */
-	struct mutex		mutex;	/* mutex protecting buffer */
+	spinlock_t		lock;	/* lock protecting buffer */
+	seqcount_t		seq;	/* bumped around every update */
 	size_t			w_off;	/* current write head offset */
 	size_t			head;	/* new readers start here */
 	size_t			size;	/* size of the log */
+	int			binary;	/* payload is not prio/tag/msg */
 };
 
 /*
  * struct logger_reader - a logging device open for reading
  *
  * This object lives from open to release, so we don't need additional
- * reference counting. The structure is protected by log->mutex.
+ * reference counting. The structure is protected by log->lock. 'r_gen' is
+ * bumped whenever someone other than the reader moves 'r_off', which lets a
+ * reader that copied an entry out without the lock tell whether the entry
+ * was overwritten in the meantime.
  */
 struct logger_reader {
 	struct logger_log *	log;	/* associated log */
 	struct list_head	list;	/* entry in logger_log's list */
 	size_t			r_off;	/* current read head offset */
+	unsigned int		r_gen;	/* times r_off was moved for us */
+	int			filtered; /* 'filter' is in effect */
+	struct logger_filter	filter;	/* set by LOGGER_SET_FILTER */
 };
 
+/* entries a filtered reader skips before dropping log->lock for a moment */
+#define LOGGER_FILTER_BATCH	64
+
+/*
+ * struct logger_staging - per-cpu buffer a writer assembles its entry in
+ *
+ * Copying the payload from user space can fault, so it happens here, outside
+ * log->lock. The mutex is only contended by writers that picked the same cpu.
+ */
+struct logger_staging {
+	struct mutex		mutex;
+	unsigned char		buf[LOGGER_ENTRY_MAX_LEN];
+};
+
+static struct logger_staging *logger_staging;
+
 /* logger_offset - returns index 'n' into the log via (optimized) modulus */
 #define logger_offset(n)	((n) & (log->size - 1))
 
@@ -87,7 +123,8 @@ static inline struct logger_log * file_get_log(struct file *file)
  * get_entry_len - Grabs the length of the payload of the next entry starting
  * from 'off'.
  *
- * Caller needs to hold log->mutex.
+ * Caller needs to hold log->lock, or to validate the result as logger_read
+ * does.
  */
 static __u32 get_entry_len(struct logger_log *log, size_t off)
 {
@@ -106,13 +143,122 @@ static __u32 get_entry_len(struct logger_log *log, size_t off)
 }
 
 /*
- * do_read_log_to_user - reads exactly 'count' bytes from 'log' into the
- * user-space buffer 'buf'. Returns 'count' on success.
+ * copy_from_log - copies 'count' bytes starting at 'off' out of the ring,
+ * handling the wrap.
  *
- * Caller must hold log->mutex.
+ * Caller needs to hold log->lock.
+ */
+static void copy_from_log(struct logger_log *log, size_t off, void *buf,
+			  size_t count)
+{
+	size_t len = min(count, log->size - off);
+
+	memcpy(buf, log->buffer + off, len);
+	if (count != len)
+		memcpy(buf + len, log->buffer, count - len);
+}
+
+/*
+ * filter_match - does the entry at 'off' pass the reader's filter?
+ *
+ * Caller needs to hold log->lock.
+ */
+static int filter_match(struct logger_log *log, struct logger_reader *reader,
+			size_t off)
+{
+	struct logger_filter *filter = &reader->filter;
+	struct logger_entry header;
+	unsigned char payload[1 + LOGGER_FILTER_TAG_LEN];
+	size_t len;
+
+	copy_from_log(log, off, &header, sizeof(struct logger_entry));
+	if (filter->pid && header.pid != filter->pid)
+		return 0;
+	if (log->binary || (!filter->min_prio && !filter->tag[0]))
+		return 1;
+
+	/* priority byte, then the tag including its terminating NUL */
+	len = min_t(size_t, header.len, sizeof(payload));
+	copy_from_log(log, logger_offset(off + sizeof(struct logger_entry)),
+		      payload, len);
+	if (len < 1 || payload[0] < filter->min_prio)
+		return 0;
+	if (filter->tag[0]) {
+		size_t tag_len = strnlen(filter->tag, LOGGER_FILTER_TAG_LEN);
+		if (len < tag_len + 2 ||
+		    memcmp(payload + 1, filter->tag, tag_len) ||
+		    payload[1 + tag_len] != '\0')
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * skip_filtered - moves 'reader' past up to LOGGER_FILTER_BATCH entries
+ * that its filter rejects. Returns nonzero if the batch ran out before an
+ * entry that matches, or the end of the log, was found.
+ *
+ * Caller needs to hold log->lock.
+ */
+static int skip_filtered(struct logger_log *log, struct logger_reader *reader)
+{
+	int n;
+
+	for (n = 0; n < LOGGER_FILTER_BATCH; n++) {
+		if (reader->r_off == log->w_off ||
+		    filter_match(log, reader, reader->r_off))
+			return 0;
+		reader->r_off = logger_offset(reader->r_off +
+					      get_entry_len(log, reader->r_off));
+	}
+	return 1;
+}
+
+/*
+ * reader_snapshot - samples the read offset of 'reader' and returns nonzero
+ * if there is nothing for it to read. Entries rejected by the reader's
+ * filter are consumed here, so they neither satisfy poll nor wake up read.
+ */
+static int reader_snapshot(struct logger_log *log,
+			   struct logger_reader *reader,
+			   size_t *r_off, unsigned int *r_gen)
+{
+	unsigned int seq;
+	int empty;
+
+	if (reader->filtered) {
+		spin_lock(&log->lock);
+		while (skip_filtered(log, reader)) {
+			spin_unlock(&log->lock);
+			cond_resched();
+			spin_lock(&log->lock);
+		}
+		*r_off = reader->r_off;
+		*r_gen = reader->r_gen;
+		empty = (log->w_off == *r_off);
+		spin_unlock(&log->lock);
+		return empty;
+	}
+
+	do {
+		seq = read_seqcount_begin(&log->seq);
+		*r_off = reader->r_off;
+		*r_gen = reader->r_gen;
+		empty = (log->w_off == *r_off);
+	} while (read_seqcount_retry(&log->seq, seq));
+
+	return empty;
+}
+
+/*
+ * do_read_log_to_user - reads exactly 'count' bytes starting at 'off' from
+ * 'log' into the user-space buffer 'buf'. Returns 'count' on success.
+ *
+ * Called without log->lock; the caller must check that the data was not
+ * overwritten while it was being copied.
  */
 static ssize_t do_read_log_to_user(struct logger_log *log,
-				   struct logger_reader *reader,
+				   size_t off,
 				   char __user *buf,
 				   size_t count)
 {
@@ -123,8 +269,8 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 	 * the current read head offset up to 'count' bytes or to the end of
 	 * the log, whichever comes first.
 	 */
-	len = min(count, log->size - reader->r_off);
-	if (copy_to_user(buf, log->buffer + reader->r_off, len))
+	len = min(count, log->size - off);
+	if (copy_to_user(buf, log->buffer + off, len))
 		return -EFAULT;
 
 	/*
@@ -135,8 +281,6 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 		if (copy_to_user(buf + len, log->buffer, count - len))
 			return -EFAULT;
 
-	reader->r_off = logger_offset(reader->r_off + count);
-
 	return count;
 }
 
@@ -150,13 +294,20 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
  * 	- Atomically reads exactly one log entry
  *
  * Optimal read size is LOGGER_ENTRY_MAX_LEN. Will set errno to EINVAL if read
- * buffer is insufficient to hold next entry.
+ * buffer is insufficient to hold next entry. Entries rejected by the reader's
+ * filter are skipped without waking up the caller.
+ *
+ * The entry is copied out without holding log->lock. Afterwards we check,
+ * under the lock, that no writer lapped us while we were copying; if one did,
+ * we start over from wherever fix_up_readers has moved us to.
  */
 static ssize_t logger_read(struct file *file, char __user *buf,
 			   size_t count, loff_t *pos)
 {
 	struct logger_reader *reader = file->private_data;
 	struct logger_log *log = reader->log;
+	size_t r_off;
+	unsigned int r_gen;
 	ssize_t ret;
 	DEFINE_WAIT(wait);
 
@@ -164,9 +315,7 @@ start:
 	while (1) {
 		prepare_to_wait(&log->wq, &wait, TASK_INTERRUPTIBLE);
 
-		mutex_lock(&log->mutex);
-		ret = (log->w_off == reader->r_off);
-		mutex_unlock(&log->mutex);
+		ret = reader_snapshot(log, reader, &r_off, &r_gen);
 		if (!ret)
 			break;
 
@@ -187,26 +336,31 @@ start:
 	if (ret)
 		return ret;
 
-	mutex_lock(&log->mutex);
-
-	/* is there still something to read or did we race? */
-	if (unlikely(log->w_off == reader->r_off)) {
-		mutex_unlock(&log->mutex);
-		goto start;
-	}
-
-	/* get the size of the next entry */
-	ret = get_entry_len(log, reader->r_off);
-	if (count < ret) {
-		ret = -EINVAL;
-		goto out;
-	}
+	/*
+	 * get the size of the next entry; if a writer has already lapped us
+	 * it may be garbage, so don't copy anything and let the check below
+	 * start over
+	 */
+	ret = get_entry_len(log, r_off);
 
 	/* get exactly one entry from the log */
-	ret = do_read_log_to_user(log, reader, buf, ret);
+	if (unlikely(ret > LOGGER_ENTRY_MAX_LEN ||
+		     ACCESS_ONCE(reader->r_gen) != r_gen))
+		ret = -EIO;
+	else if (count >= ret)
+		ret = do_read_log_to_user(log, r_off, buf, ret);
+	else
+		ret = -EINVAL;
 
-out:
-	mutex_unlock(&log->mutex);
+	spin_lock(&log->lock);
+	if (unlikely(reader->r_gen != r_gen || reader->r_off != r_off)) {
+		/* lapped by a writer, or another thread read this entry */
+		spin_unlock(&log->lock);
+		goto start;
+	}
+	if (ret > 0)
+		reader->r_off = logger_offset(r_off + ret);
+	spin_unlock(&log->lock);
 
 	return ret;
 }
@@ -215,7 +369,7 @@ out:
  * get_next_entry - return the offset of the first valid entry at least 'len'
  * bytes after 'off'.
  *
- * Caller must hold log->mutex.
+ * Caller must hold log->lock.
  */
 static size_t get_next_entry(struct logger_log *log, size_t off, size_t len)
 {
@@ -253,7 +407,7 @@ static inline int clock_interval(size_t a, size_t b, size_t c)
  * We do this by "pulling forward" the readers and start head to the first
  * entry after the new write head.
  *
- * The caller needs to hold log->mutex.
+ * The caller needs to hold log->lock.
  */
 static void fix_up_readers(struct logger_log *log, size_t len)
 {
@@ -265,113 +419,128 @@ static void fix_up_readers(struct logger_log *log, size_t len)
 		log->head = get_next_entry(log, log->head, len);
 
 	list_for_each_entry(reader, &log->readers, list)
-		if (clock_interval(old, new, reader->r_off))
+		if (clock_interval(old, new, reader->r_off)) {
 			reader->r_off = get_next_entry(log, reader->r_off, len);
+			reader->r_gen++;
+		}
 }
 
 /*
- * do_write_log - writes 'len' bytes from 'buf' to 'log'
+ * control_begin/control_end - bracket every change to the ring so that mmap
+ * readers can tell a consistent snapshot from a torn one, and publish the
+ * new offsets to them. 'len' is the number of bytes written in between.
  *
- * The caller needs to hold log->mutex.
+ * The caller needs to hold log->lock.
  */
-static void do_write_log(struct logger_log *log, const void *buf, size_t count)
+static inline void control_begin(struct logger_log *log)
 {
-	size_t len;
-
-	len = min(count, log->size - log->w_off);
-	memcpy(log->buffer + log->w_off, buf, len);
-
-	if (count != len)
-		memcpy(log->buffer, buf + len, count - len);
-
-	log->w_off = logger_offset(log->w_off + count);
+	log->control->seq++;
+	smp_wmb();
+}
 
+static inline void control_end(struct logger_log *log, size_t len)
+{
+	struct logger_control *control = log->control;
+
+	smp_wmb();
+	control->w_off = log->w_off;
+	control->head = log->head;
+	control->w_total += len;
+	smp_wmb();
+	control->seq++;
 }
 
 /*
- * do_write_log_user - writes 'len' bytes from the user-space buffer 'buf' to
- * the log 'log'
- *
- * The caller needs to hold log->mutex.
+ * do_write_log - writes 'len' bytes from 'buf' to 'log'
  *
- * Returns 'count' on success, negative error code on failure.
+ * The caller needs to hold log->lock.
  */
-static ssize_t do_write_log_from_user(struct logger_log *log,
-				      const void __user *buf, size_t count)
+static void do_write_log(struct logger_log *log, const void *buf, size_t count)
 {
 	size_t len;
 
 	len = min(count, log->size - log->w_off);
-	if (len && copy_from_user(log->buffer + log->w_off, buf, len))
-		return -EFAULT;
+	memcpy(log->buffer + log->w_off, buf, len);
 
 	if (count != len)
-		if (copy_from_user(log->buffer, buf + len, count - len))
-			return -EFAULT;
+		memcpy(log->buffer, buf + len, count - len);
 
 	log->w_off = logger_offset(log->w_off + count);
 
-	return count;
 }
 
 /*
  * logger_aio_write - our write method, implementing support for write(),
  * writev(), and aio_write(). Writes are our fast path, and we try to optimize
  * them above all else.
+ *
+ * The entry is assembled in a per-cpu staging buffer first, so log->lock is
+ * held only for fixing up the readers and a memcpy, never across a fault.
  */
 ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 			 unsigned long nr_segs, loff_t ppos)
 {
 	struct logger_log *log = file_get_log(iocb->ki_filp);
-	size_t orig = log->w_off;
-	struct logger_entry header;
+	struct logger_staging *staging;
+	struct logger_entry *header;
 	struct timespec now;
 	ssize_t ret = 0;
+	size_t len;
 
-	now = current_kernel_time();
-
-	header.pid = current->tgid;
-	header.tid = current->pid;
-	header.sec = now.tv_sec;
-	header.nsec = now.tv_nsec;
-	header.len = min_t(size_t, iocb->ki_left, LOGGER_ENTRY_MAX_PAYLOAD);
+	len = min_t(size_t, iocb->ki_left, LOGGER_ENTRY_MAX_PAYLOAD);
 
 	/* null writes succeed, return zero */
-	if (unlikely(!header.len))
+	if (unlikely(!len))
 		return 0;
 
-	mutex_lock(&log->mutex);
+	staging = per_cpu_ptr(logger_staging, get_cpu());
+	put_cpu();
+	mutex_lock(&staging->mutex);
 
-	/*
-	 * Fix up any readers, pulling them forward to the first readable
-	 * entry after (what will be) the new write offset. We do this now
-	 * because if we partially fail, we can end up with clobbered log
-	 * entries that encroach on readable buffer.
-	 */
-	fix_up_readers(log, sizeof(struct logger_entry) + header.len);
+	now = current_kernel_time();
 
-	do_write_log(log, &header, sizeof(struct logger_entry));
+	header = (struct logger_entry *) staging->buf;
+	header->len = len;
+	header->__pad = 0;
+	header->pid = current->tgid;
+	header->tid = current->pid;
+	header->sec = now.tv_sec;
+	header->nsec = now.tv_nsec;
 
-	while (nr_segs-- > 0) {
-		size_t len;
-		ssize_t nr;
+	while (nr_segs-- > 0 && ret < len) {
+		size_t nr;
 
 		/* figure out how much of this vector we can keep */
-		len = min_t(size_t, iov->iov_len, header.len - ret);
-
-		/* write out this segment's payload */
-		nr = do_write_log_from_user(log, iov->iov_base, len);
-		if (unlikely(nr < 0)) {
-			log->w_off = orig;
-			mutex_unlock(&log->mutex);
-			return nr;
+		nr = min_t(size_t, iov->iov_len, len - ret);
+
+		/* stage this segment's payload */
+		if (unlikely(copy_from_user(header->msg + ret, iov->iov_base,
+					    nr))) {
+			mutex_unlock(&staging->mutex);
+			return -EFAULT;
 		}
 
 		iov++;
 		ret += nr;
 	}
 
-	mutex_unlock(&log->mutex);
+	spin_lock(&log->lock);
+	write_seqcount_begin(&log->seq);
+	control_begin(log);
+
+	/*
+	 * Fix up any readers, pulling them forward to the first readable
+	 * entry after (what will be) the new write offset.
+	 */
+	fix_up_readers(log, sizeof(struct logger_entry) + len);
+
+	do_write_log(log, staging->buf, sizeof(struct logger_entry) + len);
+
+	control_end(log, sizeof(struct logger_entry) + len);
+	write_seqcount_end(&log->seq);
+	spin_unlock(&log->lock);
+
+	mutex_unlock(&staging->mutex);
 
 	/* wake up any blocked readers */
 	wake_up_interruptible(&log->wq);
@@ -407,12 +576,15 @@ static int logger_open(struct inode *inode, struct file *file)
 			return -ENOMEM;
 
 		reader->log = log;
+		reader->r_gen = 0;
+		reader->filtered = 0;
+		memset(&reader->filter, 0, sizeof(reader->filter));
 		INIT_LIST_HEAD(&reader->list);
 
-		mutex_lock(&log->mutex);
+		spin_lock(&log->lock);
 		reader->r_off = log->head;
 		list_add_tail(&reader->list, &log->readers);
-		mutex_unlock(&log->mutex);
+		spin_unlock(&log->lock);
 
 		file->private_data = reader;
 	} else
@@ -430,13 +602,81 @@ static int logger_release(struct inode *ignored, struct file *file)
 {
 	if (file->f_mode & FMODE_READ) {
 		struct logger_reader *reader = file->private_data;
+		struct logger_log *log = reader->log;
+
+		spin_lock(&log->lock);
 		list_del(&reader->list);
+		spin_unlock(&log->lock);
 		kfree(reader);
 	}
 
 	return 0;
 }
 
+/*
+ * logger_get_unmapped_area - the log's get_unmapped_area file operation
+ *
+ * The ring stays mapped cached in the kernel, so on a VIPT aliasing cache
+ * the user mapping must share its cache colour or readers can see stale
+ * lines. Passing the kernel address as the offset makes the arch code pick
+ * a user address of the same colour for shared mappings.
+ */
+static unsigned long logger_get_unmapped_area(struct file *file,
+					      unsigned long addr,
+					      unsigned long len,
+					      unsigned long pgoff,
+					      unsigned long flags)
+{
+	struct logger_log *log = file_get_log(file);
+
+	return current->mm->get_unmapped_area(file, addr, len,
+			(unsigned long) log->control >> PAGE_SHIFT, flags);
+}
+
+/*
+ * logger_cache_aliases - must user mappings share the kernel's cache colour?
+ * ARM only colour-aligns shared mappings when the data cache is VIPT
+ * aliasing, so don't demand it anywhere else.
+ */
+static inline int logger_cache_aliases(void)
+{
+#ifdef CONFIG_ARM
+	return cache_is_vipt_aliasing();
+#else
+	return 1;
+#endif
+}
+
+/*
+ * logger_mmap - the log's mmap file operation
+ *
+ * Maps the control page followed by the ring, read-only, for readers that
+ * want to snapshot or follow the log without a read() per entry. Such
+ * readers report how far they got with LOGGER_SET_READ_OFF so that
+ * logger_poll keeps working for them.
+ */
+static int logger_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct logger_log *log = file_get_log(file);
+
+	if (!(file->f_mode & FMODE_READ))
+		return -EACCES;
+	if (vma->vm_pgoff != 0 ||
+	    vma->vm_end - vma->vm_start != PAGE_SIZE + log->size)
+		return -EINVAL;
+	/* a MAP_FIXED or private mapping may still have the wrong colour */
+	if (logger_cache_aliases() &&
+	    ((vma->vm_start ^ (unsigned long) log->control) & (SHMLBA - 1)))
+		return -EINVAL;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	return remap_pfn_range(vma, vma->vm_start,
+			       virt_to_phys(log->control) >> PAGE_SHIFT,
+			       PAGE_SIZE + log->size, vma->vm_page_prot);
+}
+
 /*
  * logger_poll - the log's poll file operation, for poll/select/epoll
  *
@@ -451,6 +691,8 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 	struct logger_reader *reader;
 	struct logger_log *log;
 	unsigned int ret = POLLOUT | POLLWRNORM;
+	size_t r_off;
+	unsigned int r_gen;
 
 	if (!(file->f_mode & FMODE_READ))
 		return ret;
@@ -460,10 +702,8 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 
 	poll_wait(file, &log->wq, wait);
 
-	mutex_lock(&log->mutex);
-	if (log->w_off != reader->r_off)
+	if (!reader_snapshot(log, reader, &r_off, &r_gen))
 		ret |= POLLIN | POLLRDNORM;
-	mutex_unlock(&log->mutex);
 
 	return ret;
 }
@@ -472,9 +712,14 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
 	struct logger_log *log = file_get_log(file);
 	struct logger_reader *reader;
+	struct logger_filter filter;
 	long ret = -ENOTTY;
 
-	mutex_lock(&log->mutex);
+	if (cmd == LOGGER_SET_FILTER &&
+	    copy_from_user(&filter, (void __user *) arg, sizeof(filter)))
+		return -EFAULT;
+
+	spin_lock(&log->lock);
 
 	switch (cmd) {
 	case LOGGER_GET_LOG_BUF_SIZE:
@@ -497,6 +742,13 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
+		/* drop the lock between batches, as reader_snapshot() does */
+		if (reader->filtered)
+			while (skip_filtered(log, reader)) {
+				spin_unlock(&log->lock);
+				cond_resched();
+				spin_lock(&log->lock);
+			}
 		if (log->w_off != reader->r_off)
 			ret = get_entry_len(log, reader->r_off);
 		else
@@ -507,14 +759,52 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			ret = -EBADF;
 			break;
 		}
-		list_for_each_entry(reader, &log->readers, list)
+		list_for_each_entry(reader, &log->readers, list) {
 			reader->r_off = log->w_off;
+			reader->r_gen++;
+		}
+		control_begin(log);
 		log->head = log->w_off;
+		control_end(log, 0);
+		ret = 0;
+		break;
+	case LOGGER_SET_READ_OFF: {
+		size_t off;
+
+		if (!(file->f_mode & FMODE_READ)) {
+			ret = -EBADF;
+			break;
+		}
+		/* only accept entry boundaries between r_off and w_off */
+		reader = file->private_data;
+		ret = -EINVAL;
+		for (off = reader->r_off; ; off = logger_offset(off +
+						get_entry_len(log, off))) {
+			if (off == arg) {
+				reader->r_off = off;
+				ret = 0;
+				break;
+			}
+			if (off == log->w_off)
+				break;
+		}
+		break;
+	}
+	case LOGGER_SET_FILTER:
+		if (!(file->f_mode & FMODE_READ)) {
+			ret = -EBADF;
+			break;
+		}
+		reader = file->private_data;
+		filter.tag[LOGGER_FILTER_TAG_LEN - 1] = '\0';
+		reader->filter = filter;
+		reader->filtered = filter.pid || filter.min_prio ||
+				   filter.tag[0];
 		ret = 0;
 		break;
 	}
 
-	mutex_unlock(&log->mutex);
+	spin_unlock(&log->lock);
 
 	return ret;
 }
@@ -524,6 +814,8 @@ static struct file_operations logger_fops = {
 	.read = logger_read,
 	.aio_write = logger_aio_write,
 	.poll = logger_poll,
+	.mmap = logger_mmap,
+	.get_unmapped_area = logger_get_unmapped_area,
 	.unlocked_ioctl = logger_ioctl,
 	.compat_ioctl = logger_ioctl,
 	.open = logger_open,
@@ -533,12 +825,15 @@ static struct file_operations logger_fops = {
 /*
  * Defines a log structure with name 'NAME' and a size of 'SIZE' bytes, which
  * must be a power of two, greater than LOGGER_ENTRY_MAX_LEN, and less than
- * LONG_MAX minus LOGGER_ENTRY_MAX_LEN.
+ * LONG_MAX minus LOGGER_ENTRY_MAX_LEN. 'BINARY' marks logs whose payload is
+ * not priority/tag/message text. The control page sits directly in front
+ * of the ring so both map with a single cache colour.
  */
-#define DEFINE_LOGGER_DEVICE(VAR, NAME, SIZE) \
-static unsigned char _buf_ ## VAR[SIZE]; \
+#define DEFINE_LOGGER_DEVICE(VAR, NAME, SIZE, BINARY) \
+static unsigned char _buf_ ## VAR[PAGE_SIZE + SIZE] __aligned(PAGE_SIZE); \
 static struct logger_log VAR = { \
-	.buffer = _buf_ ## VAR, \
+	.control = (struct logger_control *) _buf_ ## VAR, \
+	.buffer = _buf_ ## VAR + PAGE_SIZE, \
 	.misc = { \
 		.minor = MISC_DYNAMIC_MINOR, \
 		.name = NAME, \
@@ -547,16 +842,18 @@ static struct logger_log VAR = { \
 	}, \
 	.wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .wq), \
 	.readers = LIST_HEAD_INIT(VAR .readers), \
-	.mutex = __MUTEX_INITIALIZER(VAR .mutex), \
+	.lock = __SPIN_LOCK_UNLOCKED(VAR .lock), \
+	.seq = SEQCNT_ZERO, \
 	.w_off = 0, \
 	.head = 0, \
 	.size = SIZE, \
+	.binary = BINARY, \
 };
 
-DEFINE_LOGGER_DEVICE(log_main, LOGGER_LOG_MAIN, 64*1024)
-DEFINE_LOGGER_DEVICE(log_events, LOGGER_LOG_EVENTS, 256*1024)
-DEFINE_LOGGER_DEVICE(log_radio, LOGGER_LOG_RADIO, 64*1024)
-DEFINE_LOGGER_DEVICE(log_system, LOGGER_LOG_SYSTEM, 64*1024)
+DEFINE_LOGGER_DEVICE(log_main, LOGGER_LOG_MAIN, 64*1024, 0)
+DEFINE_LOGGER_DEVICE(log_events, LOGGER_LOG_EVENTS, 256*1024, 1)
+DEFINE_LOGGER_DEVICE(log_radio, LOGGER_LOG_RADIO, 64*1024, 0)
+DEFINE_LOGGER_DEVICE(log_system, LOGGER_LOG_SYSTEM, 64*1024, 0)
 
 static struct logger_log * get_log_from_minor(int minor)
 {
@@ -575,6 +872,9 @@ static int __init init_log(struct logger_log *log)
 {
 	int ret;
 
+	log->control->version = LOGGER_CONTROL_VERSION;
+	log->control->size = log->size;
+
 	ret = misc_register(&log->misc);
 	if (unlikely(ret)) {
 		printk(KERN_ERR "logger: failed to register misc "
@@ -591,6 +891,15 @@ static int __init init_log(struct logger_log *log)
 static int __init logger_init(void)
 {
 	int ret;
+	int cpu;
+
+	logger_staging = alloc_percpu(struct logger_staging);
+	if (unlikely(!logger_staging)) {
+		printk(KERN_ERR "logger: failed to allocate staging buffers\n");
+		return -ENOMEM;
+	}
+	for_each_possible_cpu(cpu)
+		mutex_init(&per_cpu_ptr(logger_staging, cpu)->mutex);
 
 	ret = init_log(&log_main);
 	if (unlikely(ret))
@@ -39,11 +39,47 @@ struct logger_entry {
 #define LOGGER_ENTRY_MAX_PAYLOAD	\
 	(LOGGER_ENTRY_MAX_LEN - sizeof(struct logger_entry))
 
+#define LOGGER_FILTER_TAG_LEN		32
+
+/*
+ * Per-reader filter, set with LOGGER_SET_FILTER. Entries that do not match
+ * are skipped by the driver and never returned by read(). A zeroed filter
+ * matches everything. 'min_prio' and 'tag' only apply to the text logs,
+ * whose payload starts with a priority byte and a NUL-terminated tag.
+ */
+struct logger_filter {
+	__s32		pid;		/* only entries from this tgid, or 0 */
+	__u32		min_prio;	/* only entries at least this priority */
+	char		tag[LOGGER_FILTER_TAG_LEN]; /* only this tag, or "" */
+};
+
+/*
+ * A log opened for reading can be mmap'd read-only at offset zero with a
+ * length of one page plus LOGGER_GET_LOG_BUF_SIZE. The first page holds a
+ * struct logger_control, the ring itself follows. 'seq' is odd while a
+ * writer is updating the ring; a consistent snapshot is one taken between
+ * two reads of an equal, even 'seq'. The entries from 'head' up to 'w_off'
+ * are valid. A reader following the log has been lapped if 'w_total' moved
+ * by more than the ring size since it last looked.
+ */
+struct logger_control {
+	__u32		version;	/* LOGGER_CONTROL_VERSION */
+	__u32		size;		/* size of the ring */
+	__u32		seq;		/* odd while the ring is changing */
+	__u32		w_off;		/* next entry is written here */
+	__u32		head;		/* oldest valid entry */
+	__u32		w_total;	/* bytes written since boot, wraps */
+};
+
+#define LOGGER_CONTROL_VERSION		1
+
 #define __LOGGERIO	0xAE
 
 #define LOGGER_GET_LOG_BUF_SIZE		_IO(__LOGGERIO, 1) /* size of log */
 #define LOGGER_GET_LOG_LEN		_IO(__LOGGERIO, 2) /* used log len */
 #define LOGGER_GET_NEXT_ENTRY_LEN	_IO(__LOGGERIO, 3) /* next entry len */
 #define LOGGER_FLUSH_LOG		_IO(__LOGGERIO, 4) /* flush log */
+#define LOGGER_SET_FILTER		_IOW(__LOGGERIO, 5, struct logger_filter)
+#define LOGGER_SET_READ_OFF		_IO(__LOGGERIO, 6) /* mmap reader pos */
 
 #endif /* _LINUX_LOGGER_H */
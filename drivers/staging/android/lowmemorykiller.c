@@ -16,6 +16,20 @@
  * percentage of the cached memory is locked this can be very inaccurate
  * and processes may not get killed until the normal oom killer is triggered.
  *
+ * Processes are kept in one list per oom_adj value, updated on fork, on
+ * oom_adj writes and when the process exits, together with an RSS sample
+ * that is refreshed at most every rss_ttl_ms. Picking a victim only looks
+ * at the lists at or above the threshold instead of at every process.
+ *
+ * With /sys/module/lowmemorykiller/parameters/pressure set, the minfree
+ * table is only used for its first, most critical, entry. Otherwise the
+ * driver kills only while reclaim is failing: when, over a window of
+ * pressure_window_ms, less than pressure_efficiency percent of the scanned
+ * pages were reclaimed, direct reclaim stalled for more than
+ * pressure_stall_ms, or there were more than pressure_refaults major faults
+ * while reclaim was scanning. Every consecutive failing window moves the
+ * threshold one entry further down the adj table.
+ *
  * Copyright (C) 2007-2008 Google, Inc.
  *
  * This software is licensed under the terms of the GNU General Public
@@ -31,10 +45,19 @@
 
 #include <linux/module.h>
 #include <linux/kernel.h>
+#include <linux/hash.h>
+#include <linux/ktime.h>
 #include <linux/mm.h>
+#include <linux/mutex.h>
 #include <linux/oom.h>
+#include <linux/profile.h>
 #include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/swap.h>
+#include <linux/vmstat.h>
 #include <linux/notifier.h>
+#include <trace/lowmemorykiller.h>
 
 #define DEBUG_LEVEL_DEATHPENDING 6
 
@@ -74,6 +97,57 @@ static uint32_t lowmem_deathpending_retries = 0;
 
 static uint32_t lowmem_max_deathpending_retries = 1000;
 
+static uint32_t lowmem_rss_ttl_ms = 100;
+
+static uint32_t lowmem_pressure;
+static uint32_t lowmem_pressure_window_ms = 100;
+static uint32_t lowmem_pressure_min_scanned = 256;
+static uint32_t lowmem_pressure_efficiency = 20;
+static uint32_t lowmem_pressure_stall_ms = 30;
+static uint32_t lowmem_pressure_refaults = 200;
+static uint32_t lowmem_pressure_level;
+
+static DEFINE_MUTEX(lowmem_pressure_lock);
+
+/* selection statistics, exported read-only as module parameters */
+static uint32_t lowmem_select_count;
+static uint32_t lowmem_select_time_max_us;
+static uint32_t lowmem_select_time_total_us;
+static uint32_t lowmem_tracked;
+
+DEFINE_TRACE(lowmem_select);
+
+#define LOWMEM_BUCKETS		(OOM_ADJUST_MAX - OOM_DISABLE + 1)
+#define LOWMEM_HASH_BITS	7
+
+/*
+ * struct lowmem_task - a tracked process
+ *
+ * 'task' is the thread group leader. Entries are removed when the leader
+ * exits and, as a fallback for kernels without CONFIG_PROFILING or an
+ * oom_adj write racing with the exit, from the task free notifier. Both
+ * take lowmem_lock first, so the task_struct stays valid for as long as we
+ * hold lowmem_lock, but its usage count may already have dropped to zero.
+ */
+struct lowmem_task {
+	struct list_head	bucket;	/* entry in lowmem_buckets[adj] */
+	struct hlist_node	hash;	/* entry in lowmem_hash */
+	struct task_struct	*task;
+	int			rss;	/* cached get_mm_rss() */
+	unsigned long		rss_stamp; /* jiffies when rss was sampled */
+};
+
+static DEFINE_SPINLOCK(lowmem_lock);
+static struct list_head lowmem_buckets[LOWMEM_BUCKETS];
+static struct hlist_head lowmem_hash[1 << LOWMEM_HASH_BITS];
+static struct kmem_cache *lowmem_task_cachep;
+/* set if a process could not be tracked; selection then scans all tasks */
+static int lowmem_untracked;
+/* jiffies before which a failed rebuild is not retried from the shrinker */
+static unsigned long lowmem_rebuild_after = INITIAL_JIFFIES;
+
+#define LOWMEM_REBUILD_BACKOFF	HZ
+
 #define lowmem_print(level, x...)			\
 	do {						\
 		if (lowmem_debug_level >= (level))	\
@@ -87,16 +161,152 @@ static struct notifier_block task_nb = {
 	.notifier_call	= task_notify_func,
 };
 
+static int
+task_exit_notify_func(struct notifier_block *self, unsigned long val,
+		      void *data);
+
+static struct notifier_block task_exit_nb = {
+	.notifier_call	= task_exit_notify_func,
+};
+
+static struct lowmem_task *lowmem_find(struct task_struct *task)
+{
+	struct lowmem_task *lt;
+	struct hlist_node *pos;
+
+	hlist_for_each_entry(lt, pos,
+			     &lowmem_hash[hash_ptr(task, LOWMEM_HASH_BITS)],
+			     hash)
+		if (lt->task == task)
+			return lt;
+	return NULL;
+}
+
+/* Caller must hold lowmem_lock. */
+static void lowmem_track(struct task_struct *task, int oom_adj)
+{
+	struct lowmem_task *lt = lowmem_find(task);
+
+	if (lt) {
+		list_del(&lt->bucket);
+	} else {
+		lt = kmem_cache_alloc(lowmem_task_cachep, GFP_ATOMIC);
+		if (!lt) {
+			lowmem_untracked = 1;
+			return;
+		}
+		lt->task = task;
+		lt->rss = 0;
+		lt->rss_stamp = jiffies - msecs_to_jiffies(lowmem_rss_ttl_ms) - 1;
+		hlist_add_head(&lt->hash,
+			&lowmem_hash[hash_ptr(task, LOWMEM_HASH_BITS)]);
+		lowmem_tracked++;
+	}
+	list_add_tail(&lt->bucket, &lowmem_buckets[oom_adj - OOM_DISABLE]);
+}
+
+/* Caller must hold lowmem_lock. */
+static void lowmem_untrack(struct lowmem_task *lt)
+{
+	list_del(&lt->bucket);
+	hlist_del(&lt->hash);
+	lowmem_tracked--;
+	kmem_cache_free(lowmem_task_cachep, lt);
+}
+
+/*
+ * lowmem_rebuild - tracks the processes that exist now but have no entry.
+ * Entries are dropped as processes exit, so the existing ones stay valid and
+ * only the missing ones need an allocation. Clears lowmem_untracked unless
+ * an allocation fails again, in which case the shrinker does not retry for
+ * LOWMEM_REBUILD_BACKOFF.
+ */
+static void lowmem_rebuild(void)
+{
+	struct task_struct *p;
+
+	read_lock(&tasklist_lock);
+	spin_lock_irq(&lowmem_lock);
+	lowmem_untracked = 0;
+	for_each_process(p) {
+		if (!p->mm || !p->signal || (p->flags & PF_EXITING) ||
+		    lowmem_find(p))
+			continue;
+		lowmem_track(p, p->signal->oom_adj);
+		if (lowmem_untracked)
+			break;
+	}
+	if (lowmem_untracked)
+		lowmem_rebuild_after = jiffies + LOWMEM_REBUILD_BACKOFF;
+	spin_unlock_irq(&lowmem_lock);
+	read_unlock(&tasklist_lock);
+}
+
 static int
 task_notify_func(struct notifier_block *self, unsigned long val, void *data)
 {
 	struct task_struct *task = data;
+	struct lowmem_task *lt;
+	unsigned long flags;
 
 	if (task == lowmem_deathpending)
 		lowmem_deathpending = NULL;
+
+	/* may be called from the rcu callback that frees the task */
+	spin_lock_irqsave(&lowmem_lock, flags);
+	lt = lowmem_find(task);
+	if (lt)
+		lowmem_untrack(lt);
+	spin_unlock_irqrestore(&lowmem_lock, flags);
 	return NOTIFY_OK;
 }
 
+/*
+ * Called from do_exit() for every exiting thread. Only the leader is
+ * tracked; if it leaves the rest of its group running, selection falls
+ * back to scanning until the next rebuild picks the group up again.
+ */
+static int
+task_exit_notify_func(struct notifier_block *self, unsigned long val,
+		      void *data)
+{
+	struct task_struct *task = data;
+	struct lowmem_task *lt;
+	unsigned long flags;
+
+	if (task != task->group_leader)
+		return NOTIFY_OK;
+
+	spin_lock_irqsave(&lowmem_lock, flags);
+	lt = lowmem_find(task);
+	if (lt) {
+		lowmem_untrack(lt);
+		if (!thread_group_empty(task))
+			lowmem_untracked = 1;
+	}
+	spin_unlock_irqrestore(&lowmem_lock, flags);
+	return NOTIFY_OK;
+}
+
+static int
+oom_adj_notify_func(struct notifier_block *self, unsigned long val, void *data)
+{
+	struct task_struct *task = data;
+	unsigned long flags;
+
+	if (!task->mm || !task->signal || (task->flags & PF_EXITING))
+		return NOTIFY_OK;
+
+	spin_lock_irqsave(&lowmem_lock, flags);
+	lowmem_track(task, task->signal->oom_adj);
+	spin_unlock_irqrestore(&lowmem_lock, flags);
+	return NOTIFY_OK;
+}
+
+static struct notifier_block oom_adj_nb = {
+	.notifier_call	= oom_adj_notify_func,
+};
+
 static void dump_deathpending(struct task_struct *t_deathpending)
 {
 	struct task_struct *p;
@@ -133,16 +343,215 @@ static void dump_deathpending(struct task_struct *t_deathpending)
 	read_unlock(&tasklist_lock);
 }
 
-static int lowmem_shrink(int nr_to_scan, gfp_t gfp_mask)
+/*
+ * lowmem_select_tracked - pick the largest process in the highest non-empty
+ * oom_adj bucket at or above min_adj. Returns it with a reference held.
+ *
+ * The RSS of a candidate is only resampled when it is older than
+ * rss_ttl_ms. task_lock nests inside lowmem_lock here while the free
+ * notifier can take lowmem_lock from softirq context, so we only trylock
+ * it and fall back to the cached value. Tasks that already dropped their
+ * mm are skipped whatever the cached value says, and a task whose usage
+ * count has reached zero is on its way to the free notifier, so the
+ * reference is only taken if it is still live.
+ */
+static struct task_struct *lowmem_select_tracked(int min_adj,
+						 int *selected_oom_adj,
+						 int *selected_tasksize)
+{
+	struct task_struct *selected = NULL;
+	unsigned long ttl = msecs_to_jiffies(lowmem_rss_ttl_ms);
+	unsigned long flags;
+	int oom_adj;
+
+	spin_lock_irqsave(&lowmem_lock, flags);
+	for (oom_adj = OOM_ADJUST_MAX; oom_adj >= min_adj && !selected;
+	     oom_adj--) {
+		struct lowmem_task *lt;
+
+		list_for_each_entry(lt, &lowmem_buckets[oom_adj - OOM_DISABLE],
+				    bucket) {
+			struct task_struct *p = lt->task;
+
+			if (p == lowmem_deathpending) {
+				lowmem_print(2, "skip death pending task %d (%s)\n",
+					     p->pid, p->comm);
+				continue;
+			}
+			if (!p->mm || (p->flags & PF_EXITING) ||
+			    !atomic_read(&p->usage))
+				continue;
+			if (time_after(jiffies, lt->rss_stamp + ttl) &&
+			    spin_trylock(&p->alloc_lock)) {
+				lt->rss = p->mm ? get_mm_rss(p->mm) : 0;
+				lt->rss_stamp = jiffies;
+				task_unlock(p);
+			}
+			if (lt->rss <= 0)
+				continue;
+			if (selected && lt->rss <= *selected_tasksize)
+				continue;
+			selected = p;
+			*selected_tasksize = lt->rss;
+			*selected_oom_adj = oom_adj;
+			lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
+				     p->pid, p->comm, oom_adj, lt->rss);
+		}
+	}
+	if (selected && !atomic_inc_not_zero(&selected->usage))
+		selected = NULL;
+	spin_unlock_irqrestore(&lowmem_lock, flags);
+	return selected;
+}
+
+/*
+ * lowmem_select_scan - the same selection, by walking every process. Used
+ * when some process could not be tracked. Returns the victim with a
+ * reference held.
+ */
+static struct task_struct *lowmem_select_scan(int min_adj,
+					      int *selected_oom_adj,
+					      int *selected_tasksize)
 {
 	struct task_struct *p;
 	struct task_struct *selected = NULL;
-	int rem = 0;
 	int tasksize;
+
+	*selected_oom_adj = min_adj;
+
+	read_lock(&tasklist_lock);
+	for_each_process(p) {
+		struct mm_struct *mm;
+		struct signal_struct *sig;
+		int oom_adj;
+
+		if (p == lowmem_deathpending) {
+			lowmem_print(2, "skip death pending task %d (%s)\n",
+							p->pid, p->comm);
+			continue;
+		}
+
+		task_lock(p);
+		mm = p->mm;
+		sig = p->signal;
+		if (!mm || !sig) {
+			task_unlock(p);
+			continue;
+		}
+		oom_adj = sig->oom_adj;
+		if (oom_adj < min_adj) {
+			task_unlock(p);
+			continue;
+		}
+		tasksize = get_mm_rss(mm);
+		task_unlock(p);
+		if (tasksize <= 0)
+			continue;
+		if (selected) {
+			if (oom_adj < *selected_oom_adj)
+				continue;
+			if (oom_adj == *selected_oom_adj &&
+			    tasksize <= *selected_tasksize)
+				continue;
+		}
+		selected = p;
+		*selected_tasksize = tasksize;
+		*selected_oom_adj = oom_adj;
+		lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
+			     p->pid, p->comm, oom_adj, tasksize);
+	}
+	if (selected)
+		get_task_struct(selected);
+	read_unlock(&tasklist_lock);
+	return selected;
+}
+
+/*
+ * Without CONFIG_VM_EVENT_COUNTERS there is nothing to count, and the
+ * refault heuristic never fires.
+ */
+static unsigned long lowmem_major_faults(void)
+{
+#ifdef CONFIG_VM_EVENT_COUNTERS
+	unsigned long events[NR_VM_EVENT_ITEMS];
+
+	all_vm_events(events);
+	return events[PGMAJFAULT];
+#else
+	return 0;
+#endif
+}
+
+/*
+ * lowmem_pressure_min_adj - the oom_adj threshold implied by how well
+ * reclaim has been doing lately, or OOM_ADJUST_MAX + 1 if it is coping.
+ * The window is re-evaluated at most once per pressure_window_ms, by
+ * whichever reclaimer gets there first; the others use the last result.
+ */
+static int lowmem_pressure_min_adj(int array_size)
+{
+	static struct vm_pressure last;
+	static unsigned long last_faults;
+	static unsigned long last_time;
+	struct vm_pressure now;
+	unsigned long scanned, reclaimed, stall_ms, faults;
+	int failing = 0;
+	int level;
+
+	if (!mutex_trylock(&lowmem_pressure_lock))
+		goto out_unlocked;
+	if (time_before(jiffies, last_time +
+			msecs_to_jiffies(lowmem_pressure_window_ms)))
+		goto out;
+
+	vm_pressure_sample(&now);
+	faults = lowmem_major_faults();
+	scanned = now.scanned - last.scanned;
+	reclaimed = now.reclaimed - last.reclaimed;
+	stall_ms = (now.stall_us - last.stall_us) / 1000;
+
+	if (scanned >= lowmem_pressure_min_scanned) {
+		if (reclaimed * 100 < scanned * lowmem_pressure_efficiency)
+			failing = 1;
+		if (lowmem_pressure_refaults &&
+		    faults - last_faults > lowmem_pressure_refaults)
+			failing = 1;
+	}
+	if (lowmem_pressure_stall_ms && stall_ms > lowmem_pressure_stall_ms)
+		failing = 1;
+
+	if (!failing)
+		lowmem_pressure_level = 0;
+	else if (lowmem_pressure_level < array_size)
+		lowmem_pressure_level++;
+
+	lowmem_print(3, "lowmem pressure scanned %lu reclaimed %lu "
+		     "stall %lums majflt %lu, level %d\n", scanned, reclaimed,
+		     stall_ms, faults - last_faults, lowmem_pressure_level);
+
+	last = now;
+	last_faults = faults;
+	last_time = jiffies;
+out:
+	mutex_unlock(&lowmem_pressure_lock);
+out_unlocked:
+	level = min_t(int, lowmem_pressure_level, array_size);
+
+	if (!level)
+		return OOM_ADJUST_MAX + 1;
+	return lowmem_adj[array_size - level];
+}
+
+static int lowmem_shrink(int nr_to_scan, gfp_t gfp_mask)
+{
+	struct task_struct *selected;
+	int rem = 0;
 	int i;
 	int min_adj = OOM_ADJUST_MAX + 1;
 	int selected_tasksize = 0;
 	int selected_oom_adj;
+	ktime_t start;
+	s64 select_us;
 	int array_size = ARRAY_SIZE(lowmem_adj);
 	int other_free = global_page_state(NR_FREE_PAGES);
 	int other_file = global_page_state(NR_FILE_PAGES);
@@ -175,6 +584,13 @@ static int lowmem_shrink(int nr_to_scan, gfp_t gfp_mask)
 			}
 		}
 	}
+	if (lowmem_pressure) {
+		int critical = (i == 0 && array_size > 0);
+		int pressure_adj = lowmem_pressure_min_adj(array_size);
+
+		if (!critical || pressure_adj < min_adj)
+			min_adj = pressure_adj;
+	}
 	if (nr_to_scan > 0)
 		lowmem_print(3, "lowmem_shrink %d, %x, ofree %d %d, ma %d\n",
 			     nr_to_scan, gfp_mask, other_free, other_file,
@@ -190,47 +606,25 @@ static int lowmem_shrink(int nr_to_scan, gfp_t gfp_mask)
 	}
 	selected_oom_adj = min_adj;
 
-	read_lock(&tasklist_lock);
-	for_each_process(p) {
-		struct mm_struct *mm;
-		struct signal_struct *sig;
-		int oom_adj;
-
-		if (p == lowmem_deathpending) {
-			lowmem_print(2, "skip death pending task %d (%s)\n",
-							p->pid, p->comm);
-			continue;
-		}
+	start = ktime_get();
+	if (lowmem_untracked) {
+		selected = lowmem_select_scan(min_adj, &selected_oom_adj,
+					      &selected_tasksize);
+		if (lowmem_task_cachep &&
+		    time_after_eq(jiffies, lowmem_rebuild_after))
+			lowmem_rebuild();
+	} else
+		selected = lowmem_select_tracked(min_adj, &selected_oom_adj,
+						 &selected_tasksize);
+	select_us = ktime_us_delta(ktime_get(), start);
+
+	lowmem_select_count++;
+	lowmem_select_time_total_us += select_us;
+	if (select_us > lowmem_select_time_max_us)
+		lowmem_select_time_max_us = select_us;
+	trace_lowmem_select(selected ? selected->pid : 0, selected_oom_adj,
+			    selected_tasksize, min_adj, select_us);
 
-		task_lock(p);
-		mm = p->mm;
-		sig = p->signal;
-		if (!mm || !sig) {
-			task_unlock(p);
-			continue;
-		}
-		oom_adj = sig->oom_adj;
-		if (oom_adj < min_adj) {
-			task_unlock(p);
-			continue;
-		}
-		tasksize = get_mm_rss(mm);
-		task_unlock(p);
-		if (tasksize <= 0)
-			continue;
-		if (selected) {
-			if (oom_adj < selected_oom_adj)
-				continue;
-			if (oom_adj == selected_oom_adj &&
-			    tasksize <= selected_tasksize)
-				continue;
-		}
-		selected = p;
-		selected_tasksize = tasksize;
-		selected_oom_adj = oom_adj;
-		lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
-			     p->pid, p->comm, oom_adj, tasksize);
-	}
 	if (selected) {
 		lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
 			     selected->pid, selected->comm,
@@ -238,6 +632,7 @@ static int lowmem_shrink(int nr_to_scan, gfp_t gfp_mask)
 		lowmem_deathpending = selected;
 		lowmem_deathpending_timeout = jiffies + HZ;
 		force_sig(SIGKILL, selected);
+		put_task_struct(selected);
 		rem -= selected_tasksize;
 	}
 	else {
@@ -246,7 +641,6 @@ static int lowmem_shrink(int nr_to_scan, gfp_t gfp_mask)
 
 	lowmem_print(4, "lowmem_shrink %d, %x, return %d\n",
 		     nr_to_scan, gfp_mask, rem);
-	read_unlock(&tasklist_lock);
 	return rem;
 }
 
@@ -257,7 +651,22 @@ static struct shrinker lowmem_shrinker = {
 
 static int __init lowmem_init(void)
 {
+	int i;
+
+	for (i = 0; i < LOWMEM_BUCKETS; i++)
+		INIT_LIST_HEAD(&lowmem_buckets[i]);
+	lowmem_task_cachep = KMEM_CACHE(lowmem_task, 0);
+	if (!lowmem_task_cachep)
+		lowmem_untracked = 1;
+
 	task_free_register(&task_nb);
+	if (lowmem_task_cachep) {
+		profile_event_register(PROFILE_TASK_EXIT, &task_exit_nb);
+		register_oom_adj_notifier(&oom_adj_nb);
+
+		/* pick up the processes that already exist */
+		lowmem_rebuild();
+	}
 	register_shrinker(&lowmem_shrinker);
 	return 0;
 }
@@ -265,6 +674,10 @@ static int __init lowmem_init(void)
 static void __exit lowmem_exit(void)
 {
 	unregister_shrinker(&lowmem_shrinker);
+	if (lowmem_task_cachep) {
+		unregister_oom_adj_notifier(&oom_adj_nb);
+		profile_event_unregister(PROFILE_TASK_EXIT, &task_exit_nb);
+	}
 	task_free_unregister(&task_nb);
 }
 
@@ -285,6 +698,27 @@ module_param_named(ignore_deathpending, ignore_lowmem_deathpending, int,
 module_param_named(max_deathpending_retries, lowmem_max_deathpending_retries, int,
 			 S_IRUGO | S_IWUSR);
 
+module_param_named(rss_ttl_ms, lowmem_rss_ttl_ms, uint, S_IRUGO | S_IWUSR);
+
+module_param_named(pressure, lowmem_pressure, uint, S_IRUGO | S_IWUSR);
+module_param_named(pressure_window_ms, lowmem_pressure_window_ms, uint,
+		   S_IRUGO | S_IWUSR);
+module_param_named(pressure_min_scanned, lowmem_pressure_min_scanned, uint,
+		   S_IRUGO | S_IWUSR);
+module_param_named(pressure_efficiency, lowmem_pressure_efficiency, uint,
+		   S_IRUGO | S_IWUSR);
+module_param_named(pressure_stall_ms, lowmem_pressure_stall_ms, uint,
+		   S_IRUGO | S_IWUSR);
+module_param_named(pressure_refaults, lowmem_pressure_refaults, uint,
+		   S_IRUGO | S_IWUSR);
+module_param_named(pressure_level, lowmem_pressure_level, uint, S_IRUGO);
+module_param_named(select_count, lowmem_select_count, uint, S_IRUGO);
+module_param_named(select_time_max_us, lowmem_select_time_max_us, uint,
+		   S_IRUGO);
+module_param_named(select_time_total_us, lowmem_select_time_total_us, uint,
+		   S_IRUGO);
+module_param_named(tracked, lowmem_tracked, uint, S_IRUGO);
+
 module_init(lowmem_init);
 module_exit(lowmem_exit);
 
@@ -20,10 +20,14 @@
 #include <linux/bitops.h>
 #include <linux/blkdev.h>
 #include <linux/buffer_head.h>
+#include <linux/crypto.h>
 #include <linux/device.h>
 #include <linux/genhd.h>
+#include <linux/hash.h>
 #include <linux/highmem.h>
-#include <linux/lzo.h>
+#include <linux/jhash.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
 #include <linux/slab.h>
 #include <linux/string.h>
 #include <linux/swap.h>
@@ -39,6 +43,7 @@ static unsigned int num_devices;
 static unsigned long disksize_kb;
 static unsigned long memlimit_kb;
 static char backing_swap[MAX_SWAP_NAME_LEN];
+static char compressor[MAX_COMPRESSOR_NAME_LEN];
 
 /* Globals */
 static int ramzswap_major;
@@ -69,6 +74,12 @@ static void rzs_clear_flag(struct ramzswap *rzs, u32 index,
 	rzs->table[index].flags &= ~BIT(flag);
 }
 
+static void ramzswap_set_default_compressor(struct ramzswap *rzs)
+{
+	strlcpy(rzs->compressor, compressor[0] ? compressor :
+		default_compressor, MAX_COMPRESSOR_NAME_LEN);
+}
+
 static int page_zero_filled(void *ptr)
 {
 	unsigned int pos;
@@ -299,6 +310,34 @@ static void ramzswap_ioctl_get_stats(struct ramzswap *rzs,
 #endif /* CONFIG_RAMZSWAP_STATS */
 }
 
+static void ramzswap_ioctl_get_stats_ext(struct ramzswap *rzs,
+			struct ramzswap_ioctl_stats_ext *s)
+{
+	s->version = RAMZSWAP_STATS_EXT_VERSION;
+	strlcpy(s->compressor, rzs->compressor, MAX_COMPRESSOR_NAME_LEN);
+
+#if defined(CONFIG_RAMZSWAP_STATS)
+	{
+	struct ramzswap_stats *rs = &rzs->stats;
+	size_t pool_pages;
+
+	s->pages_dedup = rs->pages_dedup;
+	s->dedup_hits = stat64_read(rzs, &rs->dedup_hits);
+
+	s->compress_ns = stat64_read(rzs, &rs->compress_ns);
+	s->decompress_ns = stat64_read(rzs, &rs->decompress_ns);
+	s->bdev_num_writeback = stat64_read(rzs, &rs->bdev_num_writeback);
+
+	pool_pages = xv_get_total_size_bytes(rzs->mem_pool) >> PAGE_SHIFT;
+	if (pool_pages)
+		s->frag_pct = (pool_pages - (xv_get_used_size_bytes(
+				rzs->mem_pool) >> PAGE_SHIFT)) * 100 / pool_pages;
+	s->compact_objs_moved = stat64_read(rzs, &rs->compact_objs_moved);
+	s->compact_pages_freed = stat64_read(rzs, &rs->compact_pages_freed);
+	}
+#endif /* CONFIG_RAMZSWAP_STATS */
+}
+
 static int add_backing_swap_extent(struct ramzswap *rzs,
 				pgoff_t phy_pagenum,
 				pgoff_t num_pages)
@@ -616,10 +655,135 @@ static u32 map_backing_swap_page(struct ramzswap *rzs, u32 pagenum)
 	return se->phy_pagenum + se_offset;
 }
 
-static void ramzswap_free_page(struct ramzswap *rzs, size_t index)
+static struct hlist_head *dedup_bucket(struct ramzswap *rzs, u32 checksum)
+{
+	return &rzs->dedup_table[hash_32(checksum, rzs->dedup_bits)];
+}
+
+/*
+ * Look for an already stored object with the same compressed
+ * contents. On a hit, table entry 'index' is made to share it.
+ * Called with the slot lock of 'index' held.
+ */
+static int dedup_find(struct ramzswap *rzs, u32 index, unsigned char *src,
+			size_t clen, u32 checksum)
+{
+	int found = 0;
+	unsigned char *cmem;
+	struct hlist_node *pos;
+	struct ramzswap_dedup *dd;
+
+	spin_lock(&rzs->dedup_lock);
+	hlist_for_each_entry(dd, pos, dedup_bucket(rzs, checksum), node) {
+		if (dd->checksum != checksum || dd->clen != clen)
+			continue;
+
+		cmem = kmap_atomic(dd->page, KM_USER1) + dd->offset;
+		found = !memcmp(cmem + sizeof(struct zobj_header), src, clen);
+		kunmap_atomic(cmem, KM_USER1);
+
+		if (found) {
+			dd->count++;
+			rzs->table[index].page = dd->page;
+			rzs->table[index].offset = dd->offset;
+			rzs_set_flag(rzs, index, RZS_DEDUP);
+			break;
+		}
+	}
+	spin_unlock(&rzs->dedup_lock);
+
+	return found;
+}
+
+static void dedup_insert(struct ramzswap *rzs, u32 index,
+			struct ramzswap_dedup *dd, size_t clen, u32 checksum)
+{
+	dd->page = rzs->table[index].page;
+	dd->offset = rzs->table[index].offset;
+	dd->clen = clen;
+	dd->checksum = checksum;
+	dd->count = 1;
+
+	spin_lock(&rzs->dedup_lock);
+	hlist_add_head(&dd->node, dedup_bucket(rzs, checksum));
+	rzs_set_flag(rzs, index, RZS_DEDUP);
+	spin_unlock(&rzs->dedup_lock);
+}
+
+/*
+ * Find the dedup entry of the object at <page, offset>.
+ * Called with rzs->dedup_lock held.
+ */
+static struct ramzswap_dedup *dedup_lookup(struct ramzswap *rzs,
+			struct page *page, u32 offset, u32 checksum)
+{
+	struct hlist_node *pos;
+	struct ramzswap_dedup *dd;
+
+	hlist_for_each_entry(dd, pos, dedup_bucket(rzs, checksum), node)
+		if (dd->page == page && dd->offset == offset)
+			return dd;
+
+	return NULL;
+}
+
+/*
+ * Drop a reference to the shared object at <page, offset>, whose
+ * compressed data is 'cmem'. Returns 1 if this was the last one and
+ * the object must now be freed.
+ */
+static int dedup_put(struct ramzswap *rzs, struct page *page, u32 offset,
+			unsigned char *cmem, size_t clen)
+{
+	int last = 1;
+	struct ramzswap_dedup *dd;
+
+	spin_lock(&rzs->dedup_lock);
+	dd = dedup_lookup(rzs, page, offset, jhash(cmem, clen, 0));
+	if (dd) {
+		last = !--dd->count;
+		if (last) {
+			hlist_del(&dd->node);
+			kfree(dd);
+		}
+	}
+	spin_unlock(&rzs->dedup_lock);
+
+	/* should NEVER happen */
+	WARN_ON(!dd);
+	return last;
+}
+
+static spinlock_t *rzs_slot_lock(struct ramzswap *rzs, u32 index)
+{
+	return &rzs->slot_lock[index & (RZS_SLOT_LOCKS - 1)];
+}
+
+static struct ramzswap_stream *ramzswap_get_stream(struct ramzswap *rzs)
+{
+	struct ramzswap_stream *stream;
+
+	stream = per_cpu_ptr(rzs->streams, raw_smp_processor_id());
+	mutex_lock(&stream->lock);
+	return stream;
+}
+
+static void ramzswap_put_stream(struct ramzswap_stream *stream)
+{
+	mutex_unlock(&stream->lock);
+}
+
+static void ramzswap_mark_accessed(struct ramzswap *rzs, u32 index)
+{
+	if (rzs->idle_map)
+		clear_bit(index, rzs->idle_map);
+}
+
+static void __ramzswap_free_page(struct ramzswap *rzs, size_t index)
 {
 	u32 clen;
 	void *obj;
+	int last = 1;
 
 	struct page *page = rzs->table[index].page;
 	u32 offset = rzs->table[index].offset;
@@ -631,7 +795,9 @@ static void ramzswap_free_page(struct ramzswap *rzs, size_t index)
 		 */
 		if (rzs_test_flag(rzs, index, RZS_ZERO)) {
 			rzs_clear_flag(rzs, index, RZS_ZERO);
+			spin_lock(&rzs->stat_lock);
 			stat_dec(&rzs->stats.pages_zero);
+			spin_unlock(&rzs->stat_lock);
 		}
 		return;
 	}
@@ -640,58 +806,60 @@ static void ramzswap_free_page(struct ramzswap *rzs, size_t index)
 		clen = PAGE_SIZE;
 		__free_page(page);
 		rzs_clear_flag(rzs, index, RZS_UNCOMPRESSED);
+		spin_lock(&rzs->stat_lock);
 		stat_dec(&rzs->stats.pages_expand);
 		goto out;
 	}
 
 	obj = kmap_atomic(page, KM_USER0) + offset;
 	clen = xv_get_object_size(obj) - sizeof(struct zobj_header);
+	if (rzs_test_flag(rzs, index, RZS_DEDUP))
+		last = dedup_put(rzs, page, offset,
+				obj + sizeof(struct zobj_header), clen);
 	kunmap_atomic(obj, KM_USER0);
 
+	if (rzs_test_flag(rzs, index, RZS_DEDUP)) {
+		rzs_clear_flag(rzs, index, RZS_DEDUP);
+		if (!last) {
+			/* Object is still used by other table entries */
+			spin_lock(&rzs->stat_lock);
+			stat_dec(&rzs->stats.pages_dedup);
+			goto out_shared;
+		}
+	}
+
 	xv_free(rzs->mem_pool, page, offset);
+	spin_lock(&rzs->stat_lock);
 	if (clen <= PAGE_SIZE / 2)
 		stat_dec(&rzs->stats.good_compress);
 
 out:
 	rzs->stats.compr_size -= clen;
+out_shared:
 	stat_dec(&rzs->stats.pages_stored);
+	spin_unlock(&rzs->stat_lock);
 
 	rzs->table[index].page = NULL;
 	rzs->table[index].offset = 0;
 }
 
-static int handle_zero_page(struct bio *bio)
+static void ramzswap_free_page(struct ramzswap *rzs, size_t index)
 {
-	void *user_mem;
-	struct page *page = bio->bi_io_vec[0].bv_page;
+	spinlock_t *slot_lock = rzs_slot_lock(rzs, index);
 
-	user_mem = kmap_atomic(page, KM_USER0);
-	memset(user_mem, 0, PAGE_SIZE);
-	kunmap_atomic(user_mem, KM_USER0);
-
-	ramzswap_flush_dcache_page(page);
-
-	set_bit(BIO_UPTODATE, &bio->bi_flags);
-	bio_endio(bio, 0);
-	return 0;
+	spin_lock(slot_lock);
+	__ramzswap_free_page(rzs, index);
+	spin_unlock(slot_lock);
 }
 
-static int handle_uncompressed_page(struct ramzswap *rzs, struct bio *bio)
+static int handle_zero_page(struct bio *bio)
 {
-	u32 index;
-	struct page *page;
-	unsigned char *user_mem, *cmem;
-
-	page = bio->bi_io_vec[0].bv_page;
-	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
+	void *user_mem;
+	struct page *page = bio->bi_io_vec[0].bv_page;
 
 	user_mem = kmap_atomic(page, KM_USER0);
-	cmem = kmap_atomic(rzs->table[index].page, KM_USER1) +
-			rzs->table[index].offset;
-
-	memcpy(user_mem, cmem, PAGE_SIZE);
+	memset(user_mem, 0, PAGE_SIZE);
 	kunmap_atomic(user_mem, KM_USER0);
-	kunmap_atomic(cmem, KM_USER1);
 
 	ramzswap_flush_dcache_page(page);
 
@@ -700,7 +868,6 @@ static int handle_uncompressed_page(struct ramzswap *rzs, struct bio *bio)
 	return 0;
 }
 
-
 /*
  * Called when request page is not present in ramzswap.
  * Its either in backing swap device (if present) or
@@ -746,47 +913,84 @@ static int handle_ramzswap_fault(struct ramzswap *rzs, struct bio *bio)
 	return 0;
 }
 
+/*
+ * Copy the page stored in table entry 'index' to 'page', decompressing
+ * it if needed. Called with the slot lock of 'index' held.
+ */
+static int ramzswap_load_page(struct ramzswap *rzs,
+			struct ramzswap_stream *stream, u32 index,
+			struct page *page)
+{
+	int ret = 0;
+	unsigned int clen = PAGE_SIZE;
+	ktime_t start;
+	unsigned char *user_mem, *cmem;
+
+	user_mem = kmap_atomic(page, KM_USER0);
+	cmem = kmap_atomic(rzs->table[index].page, KM_USER1) +
+			rzs->table[index].offset;
+
+	/* Page is stored uncompressed since it's incompressible */
+	if (unlikely(rzs_test_flag(rzs, index, RZS_UNCOMPRESSED))) {
+		memcpy(user_mem, cmem, PAGE_SIZE);
+		goto out;
+	}
+
+	start = ktime_get();
+	ret = crypto_comp_decompress(stream->comp,
+		cmem + sizeof(struct zobj_header),
+		xv_get_object_size(cmem) - sizeof(struct zobj_header),
+		user_mem, &clen);
+	stat64_add(rzs, &rzs->stats.decompress_ns,
+		ktime_to_ns(ktime_sub(ktime_get(), start)));
+
+	if (!ret && clen != PAGE_SIZE)
+		ret = -EINVAL;
+
+out:
+	kunmap_atomic(cmem, KM_USER1);
+	kunmap_atomic(user_mem, KM_USER0);
+	return ret;
+}
+
 static int ramzswap_read(struct ramzswap *rzs, struct bio *bio)
 {
 	int ret;
 	u32 index;
-	size_t clen;
 	struct page *page;
-	struct zobj_header *zheader;
-	unsigned char *user_mem, *cmem;
+	spinlock_t *slot_lock;
+	struct ramzswap_stream *stream;
 
 	stat64_inc(rzs, &rzs->stats.num_reads);
 
 	page = bio->bi_io_vec[0].bv_page;
 	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
+	slot_lock = rzs_slot_lock(rzs, index);
 
 	if (rzs_test_flag(rzs, index, RZS_ZERO))
 		return handle_zero_page(bio);
 
-	/* Requested page is not present in compressed area */
-	if (!rzs->table[index].page)
-		return handle_ramzswap_fault(rzs, bio);
+	stream = ramzswap_get_stream(rzs);
+	spin_lock(slot_lock);
+	ramzswap_mark_accessed(rzs, index);
 
-	/* Page is stored uncompressed since it's incompressible */
-	if (unlikely(rzs_test_flag(rzs, index, RZS_UNCOMPRESSED)))
-		return handle_uncompressed_page(rzs, bio);
-
-	user_mem = kmap_atomic(page, KM_USER0);
-	clen = PAGE_SIZE;
-
-	cmem = kmap_atomic(rzs->table[index].page, KM_USER1) +
-			rzs->table[index].offset;
-
-	ret = lzo1x_decompress_safe(
-		cmem + sizeof(*zheader),
-		xv_get_object_size(cmem) - sizeof(*zheader),
-		user_mem, &clen);
+	/*
+	 * Requested page is not present in compressed area. Checked
+	 * under the slot lock since writeback may have just moved it
+	 * to the backing swap.
+	 */
+	if (!rzs->table[index].page) {
+		spin_unlock(slot_lock);
+		ramzswap_put_stream(stream);
+		return handle_ramzswap_fault(rzs, bio);
+	}
 
-	kunmap_atomic(user_mem, KM_USER0);
-	kunmap_atomic(cmem, KM_USER1);
+	ret = ramzswap_load_page(rzs, stream, index, page);
+	spin_unlock(slot_lock);
+	ramzswap_put_stream(stream);
 
 	/* should NEVER happen */
-	if (unlikely(ret != LZO_E_OK)) {
+	if (unlikely(ret)) {
 		pr_err("Decompression failed! err=%d, page=%u\n",
 			ret, index);
 		stat64_inc(rzs, &rzs->stats.failed_reads);
@@ -804,12 +1008,170 @@ out:
 	return 0;
 }
 
+static int ramzswap_need_writeback(struct ramzswap *rzs, unsigned perc)
+{
+	return rzs->stats.compr_size > rzs->memlimit / 100 * perc;
+}
+
+static int ramzswap_in_writeback(struct ramzswap *rzs, u32 index)
+{
+	int ret;
+	spinlock_t *slot_lock = rzs_slot_lock(rzs, index);
+
+	spin_lock(slot_lock);
+	ret = rzs_test_flag(rzs, index, RZS_WRITEBACK);
+	spin_unlock(slot_lock);
+
+	return ret;
+}
+
+static void ramzswap_end_writeback_io(struct bio *bio, int err)
+{
+	complete(bio->bi_private);
+}
+
+/*
+ * Synchronously write 'page' to the backing swap location of
+ * table entry 'index'.
+ */
+static int ramzswap_writeback_io(struct ramzswap *rzs, u32 index,
+				struct page *page)
+{
+	int ret;
+	struct bio *bio;
+	DECLARE_COMPLETION_ONSTACK(done);
+
+	bio = bio_alloc(GFP_NOIO, 1);
+	if (!bio)
+		return -ENOMEM;
+
+	bio->bi_bdev = rzs->backing_swap;
+	bio->bi_sector = map_backing_swap_page(rzs, index)
+					<< SECTORS_PER_PAGE_SHIFT;
+	bio->bi_end_io = ramzswap_end_writeback_io;
+	bio->bi_private = &done;
+	bio_add_page(bio, page, PAGE_SIZE, 0);
+
+	submit_bio(WRITE, bio);
+	wait_for_completion(&done);
+
+	ret = test_bit(BIO_UPTODATE, &bio->bi_flags) ? 0 : -EIO;
+	bio_put(bio);
+
+	return ret;
+}
+
+/*
+ * Move table entry 'index' to backing swap if it stayed idle since
+ * the writeback cursor last passed it. Later reads of this slot find
+ * no page and are forwarded to backing swap by handle_ramzswap_fault.
+ * The slot lock is dropped for the I/O; RZS_WRITEBACK keeps a forwarded
+ * write of new contents from racing ahead of our copy of the old ones.
+ */
+static void ramzswap_writeback_slot(struct ramzswap *rzs, u32 index,
+				struct page *buf)
+{
+	int ret, err;
+	u16 offset;
+	struct page *page;
+	struct ramzswap_stream *stream;
+	spinlock_t *slot_lock = rzs_slot_lock(rzs, index);
+
+	stream = ramzswap_get_stream(rzs);
+	spin_lock(slot_lock);
+	page = rzs->table[index].page;
+	offset = rzs->table[index].offset;
+	if (!page || !test_and_set_bit(index, rzs->idle_map)) {
+		spin_unlock(slot_lock);
+		ramzswap_put_stream(stream);
+		return;
+	}
+
+	ret = ramzswap_load_page(rzs, stream, index, buf);
+	if (!ret)
+		rzs_set_flag(rzs, index, RZS_WRITEBACK);
+	spin_unlock(slot_lock);
+	ramzswap_put_stream(stream);
+
+	if (ret)
+		return;
+
+	err = ramzswap_writeback_io(rzs, index, buf);
+
+	/* Keep the page if it was accessed or replaced meanwhile */
+	spin_lock(slot_lock);
+	rzs_clear_flag(rzs, index, RZS_WRITEBACK);
+	ret = !err && rzs->table[index].page == page &&
+		rzs->table[index].offset == offset &&
+		test_bit(index, rzs->idle_map);
+	if (ret)
+		__ramzswap_free_page(rzs, index);
+	spin_unlock(slot_lock);
+	wake_up(&rzs->writeback_done);
+
+	if (ret)
+		stat64_inc(rzs, &rzs->stats.bdev_num_writeback);
+}
+
+static int ramzswap_writeback_thread(void *data)
+{
+	struct ramzswap *rzs = data;
+	size_t index, scanned, num_pages;
+	struct page *buf;
+
+	num_pages = rzs->disksize >> PAGE_SHIFT;
+
+	while (!kthread_should_stop()) {
+		wait_event_interruptible(rzs->writeback_wait,
+			kthread_should_stop() ||
+			ramzswap_need_writeback(rzs, writeback_high_perc));
+		if (kthread_should_stop())
+			break;
+
+		buf = alloc_page(GFP_KERNEL);
+		if (!buf) {
+			schedule_timeout_interruptible(HZ);
+			continue;
+		}
+
+		/*
+		 * Two passes at most: the first marks every stored page
+		 * idle, the second writes back those still idle.
+		 */
+		for (scanned = 0; scanned < 2 * num_pages; scanned++) {
+			if (kthread_should_stop() ||
+				!ramzswap_need_writeback(rzs,
+						writeback_low_perc))
+				break;
+
+			/* Slot 0 holds the swap header, skip it */
+			index = rzs->writeback_cursor;
+			if (++rzs->writeback_cursor >= num_pages)
+				rzs->writeback_cursor = 1;
+
+			ramzswap_writeback_slot(rzs, index, buf);
+			cond_resched();
+		}
+		__free_page(buf);
+
+		/* Nothing idle enough was found: do not busy loop */
+		if (ramzswap_need_writeback(rzs, writeback_high_perc))
+			schedule_timeout_interruptible(HZ);
+	}
+
+	return 0;
+}
+
 static int ramzswap_write(struct ramzswap *rzs, struct bio *bio)
 {
 	int ret, fwd_write_request = 0;
-	u32 offset, index;
-	size_t clen;
+	u32 offset, index, checksum;
+	unsigned int clen;
+	ktime_t start;
+	spinlock_t *slot_lock;
 	struct zobj_header *zheader;
+	struct ramzswap_dedup *dd;
+	struct ramzswap_stream *stream;
 	struct page *page, *page_store;
 	unsigned char *user_mem, *cmem, *src;
 
@@ -817,8 +1179,8 @@ static int ramzswap_write(struct ramzswap *rzs, struct bio *bio)
 
 	page = bio->bi_io_vec[0].bv_page;
 	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
-
-	src = rzs->compress_buffer;
+	slot_lock = rzs_slot_lock(rzs, index);
+	ramzswap_mark_accessed(rzs, index);
 
 #ifndef CONFIG_SWAP_FREE_NOTIFY
 	/*
@@ -830,35 +1192,49 @@ static int ramzswap_write(struct ramzswap *rzs, struct bio *bio)
 		ramzswap_free_page(rzs, index);
 #endif
 
-	mutex_lock(&rzs->lock);
-
 	user_mem = kmap_atomic(page, KM_USER0);
 	if (page_zero_filled(user_mem)) {
 		kunmap_atomic(user_mem, KM_USER0);
+		spin_lock(slot_lock);
 		rzs_set_flag(rzs, index, RZS_ZERO);
-		mutex_unlock(&rzs->lock);
+		spin_unlock(slot_lock);
+
+		spin_lock(&rzs->stat_lock);
 		stat_inc(&rzs->stats.pages_zero);
+		spin_unlock(&rzs->stat_lock);
 
 		set_bit(BIO_UPTODATE, &bio->bi_flags);
 		bio_endio(bio, 0);
 		return 0;
 	}
+	kunmap_atomic(user_mem, KM_USER0);
 
+	/*
+	 * Checked without stat_lock: concurrent writers may overshoot
+	 * memlimit by at most a page each.
+	 */
 	if (rzs->backing_swap &&
 		(rzs->stats.compr_size > rzs->memlimit - PAGE_SIZE)) {
-		kunmap_atomic(user_mem, KM_USER0);
-		mutex_unlock(&rzs->lock);
 		fwd_write_request = 1;
 		goto out;
 	}
 
-	ret = lzo1x_1_compress(user_mem, PAGE_SIZE, src, &clen,
-				rzs->compress_workmem);
+	/* Taking the stream may sleep, so do it before mapping the page */
+	stream = ramzswap_get_stream(rzs);
+	src = stream->buffer;
+
+	clen = 2 * PAGE_SIZE;
+	user_mem = kmap_atomic(page, KM_USER0);
+	start = ktime_get();
+	ret = crypto_comp_compress(stream->comp, user_mem, PAGE_SIZE,
+				src, &clen);
+	stat64_add(rzs, &rzs->stats.compress_ns,
+		ktime_to_ns(ktime_sub(ktime_get(), start)));
 
 	kunmap_atomic(user_mem, KM_USER0);
 
-	if (unlikely(ret != LZO_E_OK)) {
-		mutex_unlock(&rzs->lock);
+	if (unlikely(ret)) {
+		ramzswap_put_stream(stream);
 		pr_err("Compression failed! err=%d\n", ret);
 		stat64_inc(rzs, &rzs->stats.failed_writes);
 		goto out;
@@ -871,8 +1247,8 @@ static int ramzswap_write(struct ramzswap *rzs, struct bio *bio)
 	 * errors which has side effect of hanging the system.
 	 */
 	if (unlikely(clen > max_zpage_size)) {
+		ramzswap_put_stream(stream);
 		if (rzs->backing_swap) {
-			mutex_unlock(&rzs->lock);
 			fwd_write_request = 1;
 			goto out;
 		}
@@ -880,61 +1256,99 @@ static int ramzswap_write(struct ramzswap *rzs, struct bio *bio)
 		clen = PAGE_SIZE;
 		page_store = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
 		if (unlikely(!page_store)) {
-			mutex_unlock(&rzs->lock);
 			pr_info("Error allocating memory for incompressible "
 				"page: %u\n", index);
 			stat64_inc(rzs, &rzs->stats.failed_writes);
 			goto out;
 		}
 
-		offset = 0;
+		user_mem = kmap_atomic(page, KM_USER0);
+		cmem = kmap_atomic(page_store, KM_USER1);
+		memcpy(cmem, user_mem, PAGE_SIZE);
+		kunmap_atomic(cmem, KM_USER1);
+		kunmap_atomic(user_mem, KM_USER0);
+
+		spin_lock(slot_lock);
+		rzs->table[index].page = page_store;
+		rzs->table[index].offset = 0;
 		rzs_set_flag(rzs, index, RZS_UNCOMPRESSED);
+		spin_unlock(slot_lock);
+
+		spin_lock(&rzs->stat_lock);
 		stat_inc(&rzs->stats.pages_expand);
-		rzs->table[index].page = page_store;
-		src = kmap_atomic(page, KM_USER0);
-		goto memstore;
+		goto account;
+	}
+
+	/*
+	 * Identical pages (e.g. from forked Dalvik heaps) compress to
+	 * identical objects. Share an existing copy if there is one.
+	 */
+	checksum = jhash(src, clen, 0);
+	spin_lock(slot_lock);
+	ret = dedup_find(rzs, index, src, clen, checksum);
+	spin_unlock(slot_lock);
+	if (ret) {
+		ramzswap_put_stream(stream);
+		spin_lock(&rzs->stat_lock);
+		stat_inc(&rzs->stats.pages_stored);
+		stat_inc(&rzs->stats.pages_dedup);
+		spin_unlock(&rzs->stat_lock);
+		stat64_inc(rzs, &rzs->stats.dedup_hits);
+
+		set_bit(BIO_UPTODATE, &bio->bi_flags);
+		bio_endio(bio, 0);
+		return 0;
 	}
 
-	if (xv_malloc(rzs->mem_pool, clen + sizeof(*zheader),
-			&rzs->table[index].page, &offset,
-			GFP_NOIO | __GFP_HIGHMEM)) {
-		mutex_unlock(&rzs->lock);
+	/* Not being able to share this object later is not an error */
+	dd = kmalloc(sizeof(*dd), GFP_NOIO);
+
+	mutex_lock(&rzs->lock);
+	ret = xv_malloc(rzs->mem_pool, clen + sizeof(*zheader),
+			&page_store, &offset, GFP_NOIO | __GFP_HIGHMEM);
+	mutex_unlock(&rzs->lock);
+	if (ret) {
+		ramzswap_put_stream(stream);
+		kfree(dd);
 		pr_info("Error allocating memory for compressed "
-			"page: %u, size=%zu\n", index, clen);
+			"page: %u, size=%u\n", index, clen);
 		stat64_inc(rzs, &rzs->stats.failed_writes);
 		if (rzs->backing_swap)
 			fwd_write_request = 1;
 		goto out;
 	}
 
-memstore:
-	rzs->table[index].offset = offset;
+	cmem = kmap_atomic(page_store, KM_USER1) + offset;
 
-	cmem = kmap_atomic(rzs->table[index].page, KM_USER1) +
-			rzs->table[index].offset;
-
-#if 0
 	/* Back-reference needed for memory defragmentation */
-	if (!rzs_test_flag(rzs, index, RZS_UNCOMPRESSED)) {
-		zheader = (struct zobj_header *)cmem;
-		zheader->table_idx = index;
-		cmem += sizeof(*zheader);
-	}
-#endif
+	zheader = (struct zobj_header *)cmem;
+	zheader->table_idx = index;
+	cmem += sizeof(*zheader);
 
 	memcpy(cmem, src, clen);
 
 	kunmap_atomic(cmem, KM_USER1);
-	if (unlikely(rzs_test_flag(rzs, index, RZS_UNCOMPRESSED)))
-		kunmap_atomic(src, KM_USER0);
+	ramzswap_put_stream(stream);
+
+	spin_lock(slot_lock);
+	rzs->table[index].page = page_store;
+	rzs->table[index].offset = offset;
+	if (dd)
+		dedup_insert(rzs, index, dd, clen, checksum);
+	spin_unlock(slot_lock);
 
+	spin_lock(&rzs->stat_lock);
+account:
 	/* Update stats */
 	rzs->stats.compr_size += clen;
 	stat_inc(&rzs->stats.pages_stored);
 	if (clen <= PAGE_SIZE / 2)
 		stat_inc(&rzs->stats.good_compress);
+	spin_unlock(&rzs->stat_lock);
 
-	mutex_unlock(&rzs->lock);
+	if (rzs->writeback_thread && ramzswap_need_writeback(rzs,
+						writeback_high_perc))
+		wake_up(&rzs->writeback_wait);
 
 	set_bit(BIO_UPTODATE, &bio->bi_flags);
 	bio_endio(bio, 0);
@@ -942,6 +1356,9 @@ memstore:
 
 out:
 	if (fwd_write_request) {
+		/* Older contents of this slot may still be on their way */
+		wait_event(rzs->writeback_done,
+			!ramzswap_in_writeback(rzs, index));
 		stat64_inc(rzs, &rzs->stats.bdev_num_writes);
 		bio->bi_bdev = rzs->backing_swap;
 #if 0
@@ -1022,6 +1439,254 @@ static int ramzswap_make_request(struct request_queue *queue, struct bio *bio)
 	return ret;
 }
 
+/*
+ * The slot recorded in a shared object's header may have been freed
+ * while other slots still use the object. Find one of those; this only
+ * happens for shared objects during compaction, so a scan is fine.
+ * Returns the number of table entries if there is none.
+ */
+static u32 ramzswap_find_owner(struct ramzswap *rzs, struct page *page,
+				u32 offset)
+{
+	u32 index, num_pages = rzs->disksize >> PAGE_SHIFT;
+
+	for (index = 0; index < num_pages; index++)
+		if (rzs->table[index].page == page &&
+				rzs->table[index].offset == offset)
+			break;
+
+	return index;
+}
+
+/*
+ * Move the object at <page, offset> out of its isolated page and
+ * repoint the table entry (and dedup entry) that owns it. Objects
+ * shared by several table entries are left in place.
+ */
+static int ramzswap_migrate_object(struct ramzswap *rzs, struct page *page,
+				u32 offset)
+{
+	int ret = -EBUSY;
+	u32 index, clen;
+	spinlock_t *slot_lock;
+	struct ramzswap_dedup *dd = NULL;
+	unsigned char *obj;
+
+	obj = kmap_atomic(page, KM_USER0) + offset;
+	index = ((struct zobj_header *)obj)->table_idx;
+	kunmap_atomic(obj, KM_USER0);
+
+	if (index >= rzs->disksize >> PAGE_SHIFT ||
+			rzs->table[index].page != page ||
+			rzs->table[index].offset != offset)
+		index = ramzswap_find_owner(rzs, page, offset);
+
+	/* Object may have been freed since we found it */
+	if (index >= rzs->disksize >> PAGE_SHIFT)
+		return -EBUSY;
+
+	slot_lock = rzs_slot_lock(rzs, index);
+	spin_lock(slot_lock);
+	if (rzs->table[index].page != page ||
+			rzs->table[index].offset != offset)
+		goto out;
+
+	if (rzs_test_flag(rzs, index, RZS_DEDUP)) {
+		u32 checksum;
+
+		obj = kmap_atomic(page, KM_USER0) + offset;
+		clen = xv_get_object_size(obj) - sizeof(struct zobj_header);
+		checksum = jhash(obj + sizeof(struct zobj_header), clen, 0);
+		kunmap_atomic(obj, KM_USER0);
+
+		spin_lock(&rzs->dedup_lock);
+		dd = dedup_lookup(rzs, page, offset, checksum);
+		if (!dd || dd->count > 1) {
+			spin_unlock(&rzs->dedup_lock);
+			goto out;
+		}
+	}
+
+	/* We are the only user now: take over the back-reference */
+	obj = kmap_atomic(page, KM_USER0) + offset;
+	((struct zobj_header *)obj)->table_idx = index;
+	kunmap_atomic(obj, KM_USER0);
+
+	ret = xv_migrate(rzs->mem_pool, &page, &offset);
+	if (!ret) {
+		rzs->table[index].page = page;
+		rzs->table[index].offset = offset;
+		if (dd) {
+			dd->page = page;
+			dd->offset = offset;
+		}
+	}
+
+	if (dd)
+		spin_unlock(&rzs->dedup_lock);
+out:
+	spin_unlock(slot_lock);
+	return ret;
+}
+
+/*
+ * Evacuate up to 'nr_pages' sparsely used allocator pages.
+ * Called with rzs->compact_lock held.
+ */
+static void ramzswap_compact(struct ramzswap *rzs, unsigned long nr_pages)
+{
+	u32 offset;
+	struct page *page;
+
+	while (nr_pages--) {
+		page = xv_isolate_page(rzs->mem_pool, max_compact_page_used);
+		if (!page)
+			break;
+
+		/* Objects that cannot move yet are skipped, not waited on */
+		offset = 0;
+		while (!xv_first_object(rzs->mem_pool, page, &offset)) {
+			if (ramzswap_migrate_object(rzs, page, offset)) {
+				offset++;
+				continue;
+			}
+			stat64_inc(rzs, &rzs->stats.compact_objs_moved);
+		}
+
+		if (xv_putback_page(rzs->mem_pool, page))
+			stat64_inc(rzs, &rzs->stats.compact_pages_freed);
+	}
+}
+
+/*
+ * Allocator pages that compaction could give back: pool size less
+ * what the stored objects would need if tightly packed.
+ */
+static unsigned long ramzswap_compactable_pages(struct ramzswap *rzs)
+{
+	u64 total, used;
+
+	total = xv_get_total_size_bytes(rzs->mem_pool) >> PAGE_SHIFT;
+	used = DIV_ROUND_UP(xv_get_used_size_bytes(rzs->mem_pool), PAGE_SIZE);
+
+	return total > used ? total - used : 0;
+}
+
+static int ramzswap_shrink(int nr_to_scan, gfp_t gfp_mask)
+{
+	int i;
+	unsigned long nr = 0;
+
+	for (i = 0; i < num_devices; i++) {
+		struct ramzswap *rzs = &devices[i];
+
+		if (!rzs->init_done || !mutex_trylock(&rzs->compact_lock))
+			continue;
+
+		if (rzs->init_done) {
+			if (nr_to_scan > 0)
+				ramzswap_compact(rzs, nr_to_scan);
+			nr += ramzswap_compactable_pages(rzs);
+		}
+		mutex_unlock(&rzs->compact_lock);
+	}
+
+	return min_t(unsigned long, nr, INT_MAX);
+}
+
+static struct shrinker ramzswap_shrinker = {
+	.shrink = ramzswap_shrink,
+	.seeks = DEFAULT_SEEKS
+};
+
+static void ramzswap_free_streams(struct ramzswap *rzs)
+{
+	int cpu;
+
+	if (!rzs->streams)
+		return;
+
+	for_each_possible_cpu(cpu) {
+		struct ramzswap_stream *stream = per_cpu_ptr(rzs->streams, cpu);
+
+		if (stream->comp)
+			crypto_free_comp(stream->comp);
+		free_pages((unsigned long)stream->buffer, 1);
+	}
+	free_percpu(rzs->streams);
+	rzs->streams = NULL;
+}
+
+static int ramzswap_alloc_streams(struct ramzswap *rzs)
+{
+	int cpu;
+
+	rzs->streams = alloc_percpu(struct ramzswap_stream);
+	if (!rzs->streams) {
+		pr_err("Error allocating compression streams\n");
+		return -ENOMEM;
+	}
+
+	for_each_possible_cpu(cpu) {
+		struct ramzswap_stream *stream = per_cpu_ptr(rzs->streams, cpu);
+
+		mutex_init(&stream->lock);
+		stream->comp = crypto_alloc_comp(rzs->compressor, 0, 0);
+		if (IS_ERR(stream->comp)) {
+			int err = PTR_ERR(stream->comp);
+
+			pr_err("Error allocating %s compressor!\n",
+				rzs->compressor);
+			stream->comp = NULL;
+			return err;
+		}
+
+		stream->buffer = (void *)__get_free_pages(__GFP_ZERO, 1);
+		if (!stream->buffer) {
+			pr_err("Error allocating compressor buffer space\n");
+			return -ENOMEM;
+		}
+	}
+
+	return 0;
+}
+
+static int ramzswap_start_writeback(struct ramzswap *rzs, int dev_id)
+{
+	int ret;
+	size_t map_size;
+
+	map_size = BITS_TO_LONGS(rzs->disksize >> PAGE_SHIFT) * sizeof(long);
+	rzs->idle_map = vmalloc(map_size);
+	if (!rzs->idle_map) {
+		pr_err("Error allocating idle page bitmap\n");
+		return -ENOMEM;
+	}
+	memset(rzs->idle_map, 0, map_size);
+
+	rzs->writeback_cursor = 1;
+	rzs->writeback_thread = kthread_run(ramzswap_writeback_thread, rzs,
+					"ramzswap%d_wb", dev_id);
+	if (IS_ERR(rzs->writeback_thread)) {
+		pr_err("Error starting writeback thread\n");
+		ret = PTR_ERR(rzs->writeback_thread);
+		rzs->writeback_thread = NULL;
+		return ret;
+	}
+
+	return 0;
+}
+
+static void ramzswap_stop_writeback(struct ramzswap *rzs)
+{
+	if (rzs->writeback_thread)
+		kthread_stop(rzs->writeback_thread);
+	rzs->writeback_thread = NULL;
+
+	vfree(rzs->idle_map);
+	rzs->idle_map = NULL;
+}
+
 static void reset_device(struct ramzswap *rzs, struct block_device *bdev)
 {
 	int is_backing_blkdev = 0;
@@ -1034,17 +1699,19 @@ static void reset_device(struct ramzswap *rzs, struct block_device *bdev)
 
 	rzs->init_done = 0;
 
+	ramzswap_stop_writeback(rzs);
+
+	/* Wait for any compaction run to finish */
+	mutex_lock(&rzs->compact_lock);
+	mutex_unlock(&rzs->compact_lock);
+
 	if (rzs->backing_swap && !rzs->num_extents)
 		is_backing_blkdev = 1;
 
 	num_pages = rzs->disksize >> PAGE_SHIFT;
 
 	/* Free various per-device buffers */
-	kfree(rzs->compress_workmem);
-	free_pages((unsigned long)rzs->compress_buffer, 1);
-
-	rzs->compress_workmem = NULL;
-	rzs->compress_buffer = NULL;
+	ramzswap_free_streams(rzs);
 
 	/* Free all pages that are still in this ramzswap device */
 	for (index = 0; index < num_pages; index++) {
@@ -1057,12 +1724,31 @@ static void reset_device(struct ramzswap *rzs, struct block_device *bdev)
 		if (!page)
 			continue;
 
+		/* Shared objects are freed below, exactly once */
+		if (rzs_test_flag(rzs, index, RZS_DEDUP))
+			continue;
+
 		if (unlikely(rzs_test_flag(rzs, index, RZS_UNCOMPRESSED)))
 			__free_page(page);
 		else
 			xv_free(rzs->mem_pool, page, offset);
 	}
 
+	for (index = 0; rzs->dedup_table &&
+			index < (1 << rzs->dedup_bits); index++) {
+		struct ramzswap_dedup *dd;
+		struct hlist_node *pos, *n;
+
+		hlist_for_each_entry_safe(dd, pos, n,
+				&rzs->dedup_table[index], node) {
+			xv_free(rzs->mem_pool, dd->page, dd->offset);
+			kfree(dd);
+		}
+	}
+	vfree(rzs->dedup_table);
+	rzs->dedup_table = NULL;
+	rzs->dedup_bits = 0;
+
 	entries_per_page = PAGE_SIZE / sizeof(*rzs->table);
 	num_table_pages = DIV_ROUND_UP(num_pages * sizeof(*rzs->table),
 					PAGE_SIZE);
@@ -1108,12 +1794,13 @@ static void reset_device(struct ramzswap *rzs, struct block_device *bdev)
 
 	rzs->disksize = 0;
 	rzs->memlimit = 0;
+	ramzswap_set_default_compressor(rzs);
 }
 
 static int ramzswap_ioctl_init_device(struct ramzswap *rzs)
 {
 	int ret, dev_id;
-	size_t num_pages;
+	size_t index, num_pages;
 	struct page *page;
 	union swap_header *swap_header;
 
@@ -1133,19 +1820,9 @@ static int ramzswap_ioctl_init_device(struct ramzswap *rzs)
 	else
 		ramzswap_set_disksize(rzs, totalram_pages << PAGE_SHIFT);
 
-	rzs->compress_workmem = kzalloc(LZO1X_MEM_COMPRESS, GFP_KERNEL);
-	if (!rzs->compress_workmem) {
-		pr_err("Error allocating compressor working memory!\n");
-		ret = -ENOMEM;
-		goto fail;
-	}
-
-	rzs->compress_buffer = (void *)__get_free_pages(__GFP_ZERO, 1);
-	if (!rzs->compress_buffer) {
-		pr_err("Error allocating compressor buffer space\n");
-		ret = -ENOMEM;
+	ret = ramzswap_alloc_streams(rzs);
+	if (ret)
 		goto fail;
-	}
 
 	num_pages = rzs->disksize >> PAGE_SHIFT;
 	rzs->table = vmalloc(num_pages * sizeof(*rzs->table));
@@ -1158,6 +1835,18 @@ static int ramzswap_ioctl_init_device(struct ramzswap *rzs)
 	}
 	memset(rzs->table, 0, num_pages * sizeof(*rzs->table));
 
+	rzs->dedup_bits = ilog2(roundup_pow_of_two(
+			max_t(size_t, num_pages >> DEDUP_BUCKET_SHIFT, 1)));
+	rzs->dedup_table = vmalloc(sizeof(*rzs->dedup_table)
+					<< rzs->dedup_bits);
+	if (!rzs->dedup_table) {
+		pr_err("Error allocating ramzswap dedup table\n");
+		ret = -ENOMEM;
+		goto fail;
+	}
+	for (index = 0; index < (1 << rzs->dedup_bits); index++)
+		INIT_HLIST_HEAD(&rzs->dedup_table[index]);
+
 	map_backing_swap_extents(rzs);
 
 	page = alloc_page(__GFP_ZERO);
@@ -1206,15 +1895,23 @@ static int ramzswap_ioctl_init_device(struct ramzswap *rzs)
 		max_zpage_size = max_zpage_size_nobdev;
 	pr_debug("Max compressed page size: %u bytes\n", max_zpage_size);
 
+	if (rzs->backing_swap) {
+		ret = ramzswap_start_writeback(rzs, dev_id);
+		if (ret)
+			goto fail;
+	}
+
 	rzs->init_done = 1;
 
 	if (rzs->backing_swap) {
 		pr_info("/dev/ramzswap%d initialized: "
-			"backing_swap=%s, memlimit_kb=%zu\n",
-			dev_id, rzs->backing_swap_name, rzs->memlimit >> 10);
+			"backing_swap=%s, memlimit_kb=%zu, compressor=%s\n",
+			dev_id, rzs->backing_swap_name, rzs->memlimit >> 10,
+			rzs->compressor);
 	} else {
 		pr_info("/dev/ramzswap%d initialized: "
-			"disksize_kb=%zu", dev_id, rzs->disksize >> 10);
+			"disksize_kb=%zu, compressor=%s\n", dev_id,
+			rzs->disksize >> 10, rzs->compressor);
 	}
 	return 0;
 
@@ -1287,6 +1984,29 @@ static int ramzswap_ioctl(struct block_device *bdev, fmode_t mode,
 		pr_debug("Backing swap set to %s\n", rzs->backing_swap_name);
 		break;
 
+	case RZSIO_SET_COMPRESSOR:
+	{
+		char name[MAX_COMPRESSOR_NAME_LEN];
+		if (rzs->init_done) {
+			ret = -EBUSY;
+			goto out;
+		}
+
+		if (copy_from_user(name, (void *)arg, _IOC_SIZE(cmd))) {
+			ret = -EFAULT;
+			goto out;
+		}
+		name[MAX_COMPRESSOR_NAME_LEN - 1] = '\0';
+		if (!crypto_has_comp(name, 0, 0)) {
+			pr_info("Compressor %s not available\n", name);
+			ret = -EINVAL;
+			goto out;
+		}
+		strlcpy(rzs->compressor, name, MAX_COMPRESSOR_NAME_LEN);
+		pr_debug("Compressor set to %s\n", rzs->compressor);
+		break;
+	}
+
 	case RZSIO_GET_STATS:
 	{
 		struct ramzswap_ioctl_stats *stats;
@@ -1308,10 +2028,41 @@ static int ramzswap_ioctl(struct block_device *bdev, fmode_t mode,
 		kfree(stats);
 		break;
 	}
+	case RZSIO_GET_STATS_EXT:
+	{
+		struct ramzswap_ioctl_stats_ext *stats;
+		if (!rzs->init_done) {
+			ret = -ENOTTY;
+			goto out;
+		}
+		stats = kzalloc(sizeof(*stats), GFP_KERNEL);
+		if (!stats) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		ramzswap_ioctl_get_stats_ext(rzs, stats);
+		if (copy_to_user((void *)arg, stats, sizeof(*stats))) {
+			kfree(stats);
+			ret = -EFAULT;
+			goto out;
+		}
+		kfree(stats);
+		break;
+	}
 	case RZSIO_INIT:
 		ret = ramzswap_ioctl_init_device(rzs);
 		break;
 
+	case RZSIO_COMPACT:
+		mutex_lock(&rzs->compact_lock);
+		if (rzs->init_done)
+			ramzswap_compact(rzs, xv_get_total_size_bytes(
+					rzs->mem_pool) >> PAGE_SHIFT);
+		else
+			ret = -EINVAL;
+		mutex_unlock(&rzs->compact_lock);
+		break;
+
 	case RZSIO_RESET:
 		/* Do not reset an active device! */
 		if (bdev->bd_holders) {
@@ -1353,10 +2104,18 @@ static struct block_device_operations ramzswap_devops = {
 
 static int create_device(struct ramzswap *rzs, int device_id)
 {
-	int ret = 0;
+	int i, ret = 0;
 
 	mutex_init(&rzs->lock);
+	mutex_init(&rzs->compact_lock);
+	spin_lock_init(&rzs->dedup_lock);
+	init_waitqueue_head(&rzs->writeback_wait);
+	init_waitqueue_head(&rzs->writeback_done);
+	for (i = 0; i < RZS_SLOT_LOCKS; i++)
+		spin_lock_init(&rzs->slot_lock[i]);
+	ramzswap_set_default_compressor(rzs);
 	spin_lock_init(&rzs->stat64_lock);
+	spin_lock_init(&rzs->stat_lock);
 	INIT_LIST_HEAD(&rzs->backing_swap_extent_list);
 
 	rzs->queue = blk_alloc_queue(GFP_KERNEL);
@@ -1453,6 +2212,8 @@ static int __init ramzswap_init(void)
 		}
 	}
 
+	register_shrinker(&ramzswap_shrinker);
+
 	/*
 	 * Initialize the first device (/dev/ramzswap0)
 	 * if parameters are provided
@@ -1466,7 +2227,7 @@ static int __init ramzswap_init(void)
 		rzs->disksize = disksize_kb << 10;
 		ret = ramzswap_ioctl_init_device(rzs);
 		if (ret)
-			goto free_devices;
+			goto remove_shrinker;
 		goto out;
 	}
 
@@ -1477,7 +2238,7 @@ static int __init ramzswap_init(void)
 		rzs->backing_swap_name[MAX_SWAP_NAME_LEN - 1] = '\0';
 		ret = ramzswap_ioctl_init_device(rzs);
 		if (ret)
-			goto free_devices;
+			goto remove_shrinker;
 		goto out;
 	}
 
@@ -1486,11 +2247,13 @@ static int __init ramzswap_init(void)
 		pr_info("memlimit_kb parameter is valid only when "
 			"backing_swap is also specified. Aborting.\n");
 		ret = -EINVAL;
-		goto free_devices;
+		goto remove_shrinker;
 	}
 
 	return 0;
 
+remove_shrinker:
+	unregister_shrinker(&ramzswap_shrinker);
 free_devices:
 	while(dev_id)
 		destroy_device(&devices[--dev_id]);
@@ -1505,6 +2268,8 @@ static void __exit ramzswap_exit(void)
 	int i;
 	struct ramzswap *rzs;
 
+	unregister_shrinker(&ramzswap_shrinker);
+
 	for (i = 0; i < num_devices; i++) {
 		rzs = &devices[i];
 
@@ -1552,6 +2317,17 @@ MODULE_PARM_DESC(memlimit_kb, "Memlimit in KB");
 module_param_string(backing_swap, backing_swap, sizeof(backing_swap), 0);
 MODULE_PARM_DESC(backing_swap, "Backing swap name");
 
+/*
+ * Compression algorithm (any crypto API "compress" type, e.g. lzo or
+ * deflate) used by every device unless changed with rzscontrol before
+ * the device is initialized. LZO is fast and suits interactive use,
+ * deflate packs tighter at a higher CPU cost.
+ */
+
+/* Optional: default = lzo */
+module_param_string(compressor, compressor, sizeof(compressor), 0);
+MODULE_PARM_DESC(compressor, "Compression algorithm");
+
 module_init(ramzswap_init);
 module_exit(ramzswap_exit);
 
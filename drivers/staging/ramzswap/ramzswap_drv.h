@@ -17,9 +17,12 @@
 
 #include <linux/spinlock.h>
 #include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/wait.h>
+
+#include <linux/xvmalloc.h>
 
 #include "ramzswap_ioctl.h"
-#include "xvmalloc.h"
 
 /*
  * Some arbitrary value. This is just to catch
@@ -35,9 +38,7 @@ static const unsigned max_num_devices = 32;
  * migrating compressed pages to backing swap disk.
  */
 struct zobj_header {
-#if 0
 	u32 table_idx;
-#endif
 };
 
 /*-- Configurable parameters */
@@ -46,6 +47,12 @@ struct zobj_header {
 static const unsigned default_disksize_perc_ram = 25;
 static const unsigned default_memlimit_perc_ram = 15;
 
+/*
+ * Crypto API compression algorithm used unless another one is
+ * selected with the compressor module param or RZSIO_SET_COMPRESSOR.
+ */
+static const char default_compressor[] = "lzo";
+
 /*
  * Max compressed page size when backing device is provided.
  * Pages that compress to size greater than this are sent to
@@ -60,6 +67,20 @@ static const unsigned max_zpage_size_bdev = PAGE_SIZE / 2;
  */
 static const unsigned max_zpage_size_nobdev = PAGE_SIZE / 4 * 3;
 
+/*
+ * With a backing swap device, idle pages are written back to it in the
+ * background once compressed data exceeds writeback_high_perc of
+ * memlimit, until it drops below writeback_low_perc.
+ */
+static const unsigned writeback_high_perc = 80;
+static const unsigned writeback_low_perc = 70;
+
+/*
+ * Compaction moves objects out of allocator pages that have at most
+ * this many bytes in use, so that those pages can be freed.
+ */
+static const unsigned max_compact_page_used = PAGE_SIZE / 2;
+
 /*
  * NOTE: max_zpage_size_{bdev,nobdev} sizes must be
  * less than or equal to:
@@ -82,6 +103,12 @@ enum rzs_pageflags {
 	/* Page consists entirely of zeros */
 	RZS_ZERO,
 
+	/* Compressed object is shared through the dedup table */
+	RZS_DEDUP,
+
+	/* Contents are being written to backing swap by writeback */
+	RZS_WRITEBACK,
+
 	__NR_RZS_PAGEFLAGS,
 };
 
@@ -98,6 +125,41 @@ struct table {
 	u8 flags;
 } __attribute__((aligned(4)));
 
+/*
+ * Compressed object that may be shared by several table entries.
+ * Hashed on the checksum of its compressed data; the object is
+ * returned to the pool only when its last reference goes away.
+ */
+struct ramzswap_dedup {
+	struct hlist_node node;
+	struct page *page;
+	u16 offset;
+	u16 clen;
+	u32 checksum;
+	u32 count;
+};
+
+/*
+ * Per-CPU compression stream. Writers (and readers, for decompression)
+ * pick the stream of the CPU they start on so that kswapd and direct
+ * reclaimers on different CPUs compress in parallel. The mutex is only
+ * contended if a task migrates while holding its stream.
+ */
+struct ramzswap_stream {
+	struct mutex lock;
+	struct crypto_comp *comp;
+	void *buffer;		/* 2 pages: compressed output may expand */
+};
+
+/*
+ * Table entries are protected by a hashed set of spinlocks: adjacent
+ * swap slots map to different locks.
+ */
+#define RZS_SLOT_LOCKS		64
+
+/* One dedup hash bucket for every (1 << DEDUP_BUCKET_SHIFT) swap slots */
+#define DEDUP_BUCKET_SHIFT	2
+
 /*
  * Swap extent information in case backing swap is a regular
  * file. These extent entries must fit exactly in a page.
@@ -123,18 +185,30 @@ struct ramzswap_stats {
 	u32 pages_stored;	/* no. of pages currently stored */
 	u32 good_compress;	/* % of pages with compression ratio<=50% */
 	u32 pages_expand;	/* % of incompressible pages */
+	u32 pages_dedup;	/* no. of pages sharing a stored object */
+	u64 dedup_hits;		/* no. of writes satisfied by dedup */
 	u64 bdev_num_reads;	/* no. of reads on backing dev */
 	u64 bdev_num_writes;	/* no. of writes on backing dev */
+	u64 compress_ns;	/* total time spent compressing */
+	u64 decompress_ns;	/* total time spent decompressing */
+	u64 bdev_num_writeback;	/* no. of idle pages written back */
+	u64 compact_objs_moved;	/* no. of objects moved by compaction */
+	u64 compact_pages_freed; /* no. of pages freed by compaction */
 #endif
 };
 
 struct ramzswap {
 	struct xv_pool *mem_pool;
-	void *compress_workmem;
-	void *compress_buffer;
+	struct ramzswap_stream *streams;	/* per-cpu */
 	struct table *table;
+	spinlock_t slot_lock[RZS_SLOT_LOCKS];
+	struct hlist_head *dedup_table;
+	unsigned int dedup_bits;
+	spinlock_t dedup_lock;	/* protect dedup_table and refcounts */
 	spinlock_t stat64_lock;	/* protect 64-bit stats */
-	struct mutex lock;
+	spinlock_t stat_lock;	/* compr_size and the page counters */
+	struct mutex lock;	/* xv_malloc */
+	struct mutex compact_lock;
 	struct request_queue *queue;
 	struct gendisk *disk;
 	int init_done;
@@ -150,6 +224,8 @@ struct ramzswap {
 	 */
 	size_t disksize;	/* bytes */
 
+	char compressor[MAX_COMPRESSOR_NAME_LEN];
+
 	struct ramzswap_stats stats;
 
 	/* backing swap device info */
@@ -159,6 +235,19 @@ struct ramzswap {
 	char backing_swap_name[MAX_SWAP_NAME_LEN];
 	struct block_device *backing_swap;
 	struct file *swap_file;
+
+	/*
+	 * Background writeback to backing swap. A bit in idle_map is
+	 * set when the writeback cursor passes a slot and cleared on any
+	 * access; slots still idle on the next pass are written back.
+	 * Forwarded writes to a slot wait on writeback_done while it has
+	 * RZS_WRITEBACK set, so they always reach the disk last.
+	 */
+	unsigned long *idle_map;
+	size_t writeback_cursor;
+	struct task_struct *writeback_thread;
+	wait_queue_head_t writeback_wait;
+	wait_queue_head_t writeback_done;
 };
 
 /*-- */
@@ -189,6 +278,13 @@ static void stat64_dec(struct ramzswap *rzs, u64 *v)
 	spin_unlock(&rzs->stat64_lock);
 }
 
+static void stat64_add(struct ramzswap *rzs, u64 *v, u64 delta)
+{
+	spin_lock(&rzs->stat64_lock);
+	*v = *v + delta;
+	spin_unlock(&rzs->stat64_lock);
+}
+
 static u64 stat64_read(struct ramzswap *rzs, u64 *v)
 {
 	u64 val;
@@ -204,6 +300,7 @@ static u64 stat64_read(struct ramzswap *rzs, u64 *v)
 #define stat_dec(v)
 #define stat64_inc(r, v)
 #define stat64_dec(r, v)
+#define stat64_add(r, v, d)
 #define stat64_read(r, v)
 #endif /* CONFIG_RAMZSWAP_STATS */
 
@@ -16,6 +16,7 @@
 #define _RAMZSWAP_IOCTL_H_
 
 #define MAX_SWAP_NAME_LEN 128
+#define MAX_COMPRESSOR_NAME_LEN 32
 
 struct ramzswap_ioctl_stats {
 	char backing_swap_name[MAX_SWAP_NAME_LEN];
@@ -40,11 +41,34 @@ struct ramzswap_ioctl_stats {
 	u64 bdev_num_writes;	/* no. of writes on backing dev */
 } __attribute__ ((packed, aligned(4)));
 
+/*
+ * Counters added after RZSIO_GET_STATS was fixed. The layout of a given
+ * version never changes; new counters need a new version and ioctl.
+ */
+#define RAMZSWAP_STATS_EXT_VERSION 1
+
+struct ramzswap_ioctl_stats_ext {
+	u32 version;		/* RAMZSWAP_STATS_EXT_VERSION */
+	u32 pages_dedup;	/* no. of pages sharing a stored object */
+	u64 dedup_hits;		/* no. of writes satisfied by dedup */
+	char compressor[MAX_COMPRESSOR_NAME_LEN];
+	u64 compress_ns;	/* total time spent compressing */
+	u64 decompress_ns;	/* total time spent decompressing */
+	u64 bdev_num_writeback;	/* no. of idle pages written back */
+	u32 frag_pct;		/* % of allocator pages not used by objects */
+	u64 compact_objs_moved;	/* no. of objects moved by compaction */
+	u64 compact_pages_freed; /* no. of pages freed by compaction */
+} __attribute__ ((packed, aligned(4)));
+
 #define RZSIO_SET_DISKSIZE_KB	_IOW('z', 0, size_t)
 #define RZSIO_SET_MEMLIMIT_KB	_IOW('z', 1, size_t)
 #define RZSIO_SET_BACKING_SWAP	_IOW('z', 2, unsigned char[MAX_SWAP_NAME_LEN])
 #define RZSIO_GET_STATS		_IOR('z', 3, struct ramzswap_ioctl_stats)
 #define RZSIO_INIT		_IO('z', 4)
 #define RZSIO_RESET		_IO('z', 5)
+#define RZSIO_GET_STATS_EXT	_IOR('z', 6, struct ramzswap_ioctl_stats_ext)
+#define RZSIO_SET_COMPRESSOR	_IOW('z', 7, \
+				unsigned char[MAX_COMPRESSOR_NAME_LEN])
+#define RZSIO_COMPACT		_IO('z', 8)
 
 #endif
@@ -130,6 +130,10 @@ static __inline__ int ylist_empty(struct ylist_head *entry)
 	for (itervar = (list)->next, saveVar = (list)->next->next; \
 		itervar != (list); itervar = saveVar, saveVar = saveVar->next)
 
+/* ylist_for_each_prev iterates from the tail of the list to the head */
+#define ylist_for_each_prev(itervar, list) \
+	for (itervar = (list)->prev; itervar != (list); itervar = itervar->prev)
+
 
 #if !(defined __KERNEL__)
 
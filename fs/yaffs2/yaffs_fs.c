@@ -51,6 +51,8 @@ extern const char *yaffs_guts_c_version;
 #include <linux/interrupt.h>
 #include <linux/string.h>
 #include <linux/ctype.h>
+#include <linux/kthread.h>
+#include <linux/freezer.h>
 
 #include "asm/div64.h"
 
@@ -121,12 +123,24 @@ static uint32_t YCALCBLOCKS(uint64_t partition_size, uint32_t block_size)
 unsigned int yaffs_traceMask = YAFFS_TRACE_BAD_BLOCKS;
 unsigned int yaffs_wr_attempts = YAFFS_WR_ATTEMPTS;
 unsigned int yaffs_auto_checkpoint = 1;
+unsigned int yaffs_bg_gc = 1;
+unsigned int yaffs_bg_gc_idle_ms = 500;
+unsigned int yaffs_bg_gc_urgent_blocks = 10;
+unsigned int yaffs_checkpoint_interval = 600;
+unsigned int yaffs_checkpoint_min_writes = 1024;
+unsigned int yaffs_batch_chunks = YAFFS_MAX_BATCH_CHUNKS;
 
 /* Module Parameters */
 #if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 5, 0))
 module_param(yaffs_traceMask, uint, 0644);
 module_param(yaffs_wr_attempts, uint, 0644);
 module_param(yaffs_auto_checkpoint, uint, 0644);
+module_param(yaffs_bg_gc, uint, 0644);
+module_param(yaffs_bg_gc_idle_ms, uint, 0644);
+module_param(yaffs_bg_gc_urgent_blocks, uint, 0644);
+module_param(yaffs_checkpoint_interval, uint, 0644);
+module_param(yaffs_checkpoint_min_writes, uint, 0644);
+module_param(yaffs_batch_chunks, uint, 0644);
 #else
 MODULE_PARM(yaffs_traceMask, "i");
 MODULE_PARM(yaffs_wr_attempts, "i");
@@ -169,6 +183,7 @@ static struct inode *yaffs_iget(struct super_block *sb, unsigned long ino);
 		} while(0)
 		
 static void yaffs_put_super(struct super_block *sb);
+static int yaffs_remount_fs(struct super_block *sb, int *flags, char *data);
 
 static ssize_t yaffs_file_write(struct file *f, const char *buf, size_t n,
 				loff_t *pos);
@@ -359,6 +374,7 @@ static const struct super_operations yaffs_super_ops = {
 	.put_inode = yaffs_put_inode,
 #endif
 	.put_super = yaffs_put_super,
+	.remount_fs = yaffs_remount_fs,
 	.delete_inode = yaffs_delete_inode,
 	.clear_inode = yaffs_clear_inode,
 	.sync_fs = yaffs_sync_fs,
@@ -368,6 +384,7 @@ static const struct super_operations yaffs_super_ops = {
 static void yaffs_GrossLock(yaffs_Device *dev)
 {
 	T(YAFFS_TRACE_OS, ("yaffs locking %p\n", current));
+	dev->lastForeground = jiffies;
 	down(&dev->grossLock);
 	T(YAFFS_TRACE_OS, ("yaffs locked %p\n", current));
 }
@@ -563,22 +580,35 @@ static struct dentry *yaffs_lookup(struct inode *dir, struct dentry *dentry)
 {
 	yaffs_Object *obj;
 	struct inode *inode = NULL;	/* NCB 2.5/2.6 needs NULL here */
+	int complete;
 
 	yaffs_Device *dev = yaffs_InodeToObject(dir)->myDev;
 
-	yaffs_GrossLock(dev);
-
 	T(YAFFS_TRACE_OS,
 		("yaffs_lookup for %d:%s\n",
 		yaffs_InodeToObject(dir)->objectId, dentry->d_name.name));
 
-	obj = yaffs_FindObjectByName(yaffs_InodeToObject(dir),
-					dentry->d_name.name);
+	/* Most lookups can be answered from RAM without waiting for
+	 * the gross lock, which a writer may hold through garbage
+	 * collection.
+	 */
+	down_read(&dev->dirLock);
+	obj = yaffs_FindObjectByNameCached(yaffs_InodeToObject(dir),
+					dentry->d_name.name, &complete);
+	up_read(&dev->dirLock);
 
-	obj = yaffs_GetEquivalentObject(obj);	/* in case it was a hardlink */
+	if (!complete) {
+		yaffs_GrossLock(dev);
 
-	/* Can't hold gross lock when calling yaffs_get_inode() */
-	yaffs_GrossUnlock(dev);
+		obj = yaffs_FindObjectByName(yaffs_InodeToObject(dir),
+						dentry->d_name.name);
+
+		/* in case it was a hardlink */
+		obj = yaffs_GetEquivalentObject(obj);
+
+		/* Can't hold gross lock when calling yaffs_get_inode() */
+		yaffs_GrossUnlock(dev);
+	}
 
 	if (obj) {
 		T(YAFFS_TRACE_OS,
@@ -1745,6 +1775,22 @@ static int yaffs_statfs(struct super_block *sb, struct statfs *buf)
 }
 
 
+/*
+ * Page writes other than garbage collection copies, i.e. those that change
+ * the file system. Checkpoint writes are excluded by sampling this after
+ * the checkpoint has been saved.
+ */
+static int yaffs_DataPageWrites(yaffs_Device *dev)
+{
+	return dev->nPageWrites - dev->nGCCopies;
+}
+
+static void yaffs_NoteCheckpoint(yaffs_Device *dev)
+{
+	dev->lastCheckpoint = jiffies;
+	dev->checkpointPageWrites = yaffs_DataPageWrites(dev);
+}
+
 static int yaffs_do_sync_fs(struct super_block *sb)
 {
 
@@ -1757,6 +1803,7 @@ static int yaffs_do_sync_fs(struct super_block *sb)
 		if (dev) {
 			yaffs_FlushEntireDeviceCache(dev);
 			yaffs_CheckpointSave(dev);
+			yaffs_NoteCheckpoint(dev);
 		}
 
 		yaffs_GrossUnlock(dev);
@@ -1859,7 +1906,122 @@ static void yaffs_read_inode(struct inode *inode)
 
 static YLIST_HEAD(yaffs_dev_list);
 
-#if 0 /* not used */
+/*
+ * Rewrite the checkpoint of an idle device whose checkpoint is invalid, so
+ * that a mount after an unclean shutdown can usually restore it instead of
+ * scanning every chunk. Each rewrite costs a full checkpoint write, and the
+ * erase of those blocks on the next write, so it is only done once at least
+ * yaffs_checkpoint_min_writes data chunks have been written since the last
+ * save and at most once every yaffs_checkpoint_interval seconds. Garbage
+ * collection alone does not count. Like sync_fs, this is disabled by
+ * yaffs_auto_checkpoint = 0. Called with the gross lock held.
+ */
+static void yaffs_BackgroundCheckpoint(yaffs_Device *dev)
+{
+	if (!yaffs_auto_checkpoint || !yaffs_checkpoint_interval ||
+	    dev->isCheckpointed || dev->skipCheckpointWrite)
+		return;
+
+	if (yaffs_DataPageWrites(dev) - dev->checkpointPageWrites <
+	    (int)max(yaffs_checkpoint_min_writes, 1U))
+		return;
+
+	if (time_before(jiffies, dev->lastCheckpoint +
+			yaffs_checkpoint_interval * HZ))
+		return;
+
+	T(YAFFS_TRACE_CHECKPOINT,
+		("yaffs_background checkpoint for %s\n", dev->name));
+
+	yaffs_FlushEntireDeviceCache(dev);
+	yaffs_CheckpointSave(dev);
+	yaffs_NoteCheckpoint(dev);
+	dev->nCheckpointRefreshes++;
+}
+
+/*
+ * Background garbage collection and checkpointing.
+ * Each writable device gets a thread that pre-cleans blocks while the file
+ * system is idle, so that writes seldom have to collect inline, and then
+ * refreshes the checkpoint. The thread never waits for the gross lock, and
+ * it backs off for yaffs_bg_gc_idle_ms after any foreground access unless
+ * the device is running short of erased blocks.
+ */
+static int yaffs_BackgroundThread(void *data)
+{
+	yaffs_Device *dev = (yaffs_Device *)data;
+	struct super_block *sb = (struct super_block *)dev->superBlock;
+	unsigned long idle;
+	long delay;
+	int urgency = 0;
+
+	T(YAFFS_TRACE_GC,
+		("yaffs_background starting for %s\n", dev->name));
+
+	set_freezable();
+
+	while (!kthread_should_stop()) {
+		try_to_freeze();
+
+		idle = msecs_to_jiffies(yaffs_bg_gc_idle_ms) + 1;
+		delay = dev->lastForeground + idle - jiffies;
+
+		if (sb->s_flags & MS_RDONLY) {
+			/* Remount in progress: leave the flash alone */
+			urgency = 0;
+			delay = 2 * HZ;
+		} else if (urgency < 2 && delay > 0) {
+			dev->backgroundGCBackoffs++;
+		} else if (down_trylock(&dev->grossLock)) {
+			dev->backgroundGCBackoffs++;
+			delay = (urgency < 2) ? idle : 1;
+		} else {
+			urgency = 0;
+			if (yaffs_bg_gc)
+				urgency = yaffs_BackgroundGarbageCollect(dev,
+						yaffs_bg_gc_urgent_blocks);
+			if (!urgency && delay <= 0)
+				yaffs_BackgroundCheckpoint(dev);
+			up(&dev->grossLock);
+
+			if (urgency == 2)
+				delay = 1;
+			else if (urgency == 1)
+				delay = HZ / 10;
+			else
+				delay = 2 * HZ;
+		}
+
+		schedule_timeout_interruptible(delay);
+	}
+
+	T(YAFFS_TRACE_GC,
+		("yaffs_background stopping for %s\n", dev->name));
+	return 0;
+}
+
+static void yaffs_BackgroundStart(yaffs_Device *dev)
+{
+	if (dev->bgThread || (!yaffs_bg_gc && !yaffs_checkpoint_interval))
+		return;
+
+	dev->bgThread = kthread_run(yaffs_BackgroundThread, dev,
+				    "yaffs-gc-%s", dev->name);
+	if (IS_ERR(dev->bgThread)) {
+		T(YAFFS_TRACE_ALWAYS,
+		  ("yaffs: no background gc thread for %s\n", dev->name));
+		dev->bgThread = NULL;
+	}
+}
+
+static void yaffs_BackgroundStop(yaffs_Device *dev)
+{
+	if (dev->bgThread) {
+		kthread_stop(dev->bgThread);
+		dev->bgThread = NULL;
+	}
+}
+
 static int yaffs_remount_fs(struct super_block *sb, int *flags, char *data)
 {
 	yaffs_Device    *dev = yaffs_SuperToDevice(sb);
@@ -1870,6 +2032,9 @@ static int yaffs_remount_fs(struct super_block *sb, int *flags, char *data)
 		T(YAFFS_TRACE_OS,
 			("yaffs_remount_fs: %s: RO\n", dev->name));
 
+		/* Must not collect or checkpoint once the flash is read-only */
+		yaffs_BackgroundStop(dev);
+
 		yaffs_GrossLock(dev);
 
 		yaffs_FlushEntireDeviceCache(dev);
@@ -1883,11 +2048,12 @@ static int yaffs_remount_fs(struct super_block *sb, int *flags, char *data)
 	} else {
 		T(YAFFS_TRACE_OS,
 			("yaffs_remount_fs: %s: RW\n", dev->name));
+
+		yaffs_BackgroundStart(dev);
 	}
 
 	return 0;
 }
-#endif
 
 static void yaffs_put_super(struct super_block *sb)
 {
@@ -1895,6 +2061,8 @@ static void yaffs_put_super(struct super_block *sb)
 
 	T(YAFFS_TRACE_OS, ("yaffs_put_super\n"));
 
+	yaffs_BackgroundStop(dev);
+
 	yaffs_GrossLock(dev);
 
 	yaffs_FlushEntireDeviceCache(dev);
@@ -2210,9 +2378,13 @@ static struct super_block *yaffs_internal_read_super(int yaffsVersion,
 		    nandmtd2_WriteChunkWithTagsToNAND;
 		dev->readChunkWithTagsFromNAND =
 		    nandmtd2_ReadChunkWithTagsFromNAND;
+		dev->readChunksWithTagsFromNAND =
+		    nandmtd2_ReadChunksWithTagsFromNAND;
 		dev->markNANDBlockBad = nandmtd2_MarkNANDBlockBad;
 		dev->queryNANDBlock = nandmtd2_QueryNANDBlock;
-		dev->spareBuffer = YMALLOC(mtd->oobsize);
+		dev->spareBuffer = YMALLOC(max_t(unsigned, mtd->oobsize,
+				YAFFS_MAX_BATCH_CHUNKS * mtd->oobavail));
+		dev->nBatchChunks = yaffs_batch_chunks;
 		dev->isYaffs2 = 1;
 #if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 17))
 		dev->totalBytesPerChunk = mtd->writesize;
@@ -2269,10 +2441,15 @@ static struct super_block *yaffs_internal_read_super(int yaffsVersion,
         dev->removeObjectCallback = yaffs_RemoveObjectCallback;
 
 	init_MUTEX(&dev->grossLock);
+	init_rwsem(&dev->dirLock);
 
 	yaffs_GrossLock(dev);
 
+	dev->mountTime = jiffies;
 	err = yaffs_GutsInitialise(dev);
+	dev->mountTime = jiffies_to_msecs(jiffies - dev->mountTime);
+	dev->mountedFromCheckpoint = dev->isCheckpointed;
+	yaffs_NoteCheckpoint(dev);
 
 	T(YAFFS_TRACE_OS,
 	  ("yaffs_read_super: guts initialised %s\n",
@@ -2307,6 +2484,9 @@ static struct super_block *yaffs_internal_read_super(int yaffsVersion,
 	T(YAFFS_TRACE_ALWAYS,
 	  ("yaffs_read_super: isCheckpointed %d\n", dev->isCheckpointed));
 
+	if (!(sb->s_flags & MS_RDONLY))
+		yaffs_BackgroundStart(dev);
+
 	T(YAFFS_TRACE_OS, ("yaffs_read_super: done\n"));
 	return sb;
 }
@@ -2431,6 +2611,17 @@ static char *yaffs_dump_dev(char *buf, yaffs_Device * dev)
 	buf += sprintf(buf, "garbageCollections. %d\n", dev->garbageCollections);
 	buf += sprintf(buf, "passiveGCs......... %d\n",
 		    dev->passiveGarbageCollections);
+	buf += sprintf(buf, "backgroundGCs...... %d\n",
+		    dev->backgroundGarbageCollections);
+	buf += sprintf(buf, "backgroundBackoffs. %d\n",
+		    dev->backgroundGCBackoffs);
+	buf += sprintf(buf, "backgroundGCThread. %d\n", dev->bgThread ? 1 : 0);
+	buf += sprintf(buf, "isCheckpointed..... %d\n", dev->isCheckpointed);
+	buf += sprintf(buf, "ckptRefreshes...... %d\n",
+		    dev->nCheckpointRefreshes);
+	buf += sprintf(buf, "mountTimeMs........ %u\n", dev->mountTime);
+	buf += sprintf(buf, "mountFromCkpt...... %d\n",
+		    dev->mountedFromCheckpoint);
 	buf += sprintf(buf, "nRetriedWrites..... %d\n", dev->nRetriedWrites);
 	buf += sprintf(buf, "nShortOpCaches..... %d\n", dev->nShortOpCaches);
 	buf += sprintf(buf, "nRetireBlocks...... %d\n", dev->nRetiredBlocks);
@@ -2439,6 +2630,8 @@ static char *yaffs_dump_dev(char *buf, yaffs_Device * dev)
 	buf += sprintf(buf, "tagsEccFixed....... %d\n", dev->tagsEccFixed);
 	buf += sprintf(buf, "tagsEccUnfixed..... %d\n", dev->tagsEccUnfixed);
 	buf += sprintf(buf, "cacheHits.......... %d\n", dev->cacheHits);
+	buf += sprintf(buf, "nBatchChunks....... %d\n", dev->nBatchChunks);
+	buf += sprintf(buf, "nBatchedReads...... %d\n", dev->nBatchedReads);
 	buf += sprintf(buf, "nDeletedFiles...... %d\n", dev->nDeletedFiles);
 	buf += sprintf(buf, "nUnlinkedFiles..... %d\n", dev->nUnlinkedFiles);
 	buf +=
@@ -294,11 +294,36 @@ int yaffs_IsManagedTempBuffer(yaffs_Device *dev, const __u8 *buffer)
 	if (buffer == dev->checkpointBuffer)
 		return 1;
 
+	if (dev->batchBuffer && buffer >= dev->batchBuffer &&
+	    buffer < dev->batchBuffer +
+		     dev->nBatchChunks * dev->totalBytesPerChunk)
+		return 1;
+
 	T(YAFFS_TRACE_ALWAYS,
 		(TSTR("yaffs: unmaged buffer detected.\n" TENDSTR)));
 	return 0;
 }
 
+/*
+ * The batch buffer holds nBatchChunks chunks for batched reads, with their
+ * tags in batchTags. There is only one, so if it is taken (or batching is
+ * off) NULL is returned and the caller reads one chunk at a time.
+ */
+static __u8 *yaffs_GetBatchBuffer(yaffs_Device *dev)
+{
+	if (dev->nBatchChunks < 2 || !dev->batchBuffer ||
+	    dev->batchBufferInUse)
+		return NULL;
+
+	dev->batchBufferInUse = 1;
+	return dev->batchBuffer;
+}
+
+static void yaffs_ReleaseBatchBuffer(yaffs_Device *dev)
+{
+	dev->batchBufferInUse = 0;
+}
+
 
 
 /*
@@ -1126,8 +1151,53 @@ static __u16 yaffs_CalcNameSum(const YCHAR *name)
 	return sum;
 }
 
+/* Directory entries are hashed on (parent, name sum). The parent is
+ * part of the key so one table serves every directory on the device.
+ */
+static int yaffs_NameHashFunction(const yaffs_Object *directory, int sum)
+{
+	return (directory->objectId * 31 + sum) & (YAFFS_NAME_HASH_BUCKETS - 1);
+}
+
+/* Move an object to the name hash bucket for its current parent and sum.
+ * Must be called with the directory write lock held.
+ */
+static void yaffs_HashObjectName(yaffs_Object *obj)
+{
+	yaffs_Device *dev = obj->myDev;
+
+	ylist_del_init(&obj->nameHashLink);
+
+	if (obj->parent && dev->nameHash)
+		ylist_add(&obj->nameHashLink,
+			  &dev->nameHash[yaffs_NameHashFunction(obj->parent,
+								obj->sum)]);
+}
+
+/* Returns the object id encoded in a made up "objNNN" name, or 0 */
+static __u32 yaffs_LostNFoundNameToId(const YCHAR *name)
+{
+	int prefixLength = yaffs_strlen(_Y(YAFFS_LOSTNFOUND_PREFIX));
+	__u32 id = 0;
+	int n = 0;
+
+	if (yaffs_strncmp(name, _Y(YAFFS_LOSTNFOUND_PREFIX), prefixLength))
+		return 0;
+
+	for (name += prefixLength; *name; name++, n++) {
+		if (*name < '0' || *name > '9' || n >= 9)
+			return 0;
+		id = id * 10 + (*name - '0');
+	}
+
+	return id;
+}
+
 static void yaffs_SetObjectName(yaffs_Object *obj, const YCHAR *name)
 {
+	int sum = yaffs_CalcNameSum(name);
+
+	YAFFS_DIR_WRITE_LOCK(obj->myDev);
 #ifdef CONFIG_YAFFS_SHORT_NAMES_IN_RAM
 	memset(obj->shortName, 0, sizeof(YCHAR) * (YAFFS_SHORT_NAME_LENGTH+1));
 	if (name && yaffs_strlen(name) <= YAFFS_SHORT_NAME_LENGTH)
@@ -1135,7 +1205,9 @@ static void yaffs_SetObjectName(yaffs_Object *obj, const YCHAR *name)
 	else
 		obj->shortName[0] = _Y('\0');
 #endif
-	obj->sum = yaffs_CalcNameSum(name);
+	obj->sum = sum;
+	yaffs_HashObjectName(obj);
+	YAFFS_DIR_WRITE_UNLOCK(obj->myDev);
 }
 
 /*-------------------- TNODES -------------------
@@ -1920,13 +1992,17 @@ static yaffs_Object *yaffs_AllocateEmptyObject(yaffs_Device *dev)
 		tn->variantType = YAFFS_OBJECT_TYPE_UNKNOWN;
 		YINIT_LIST_HEAD(&(tn->hardLinks));
 		YINIT_LIST_HEAD(&(tn->hashLink));
+		YINIT_LIST_HEAD(&tn->nameHashLink);
 		YINIT_LIST_HEAD(&tn->siblings);
 
 
 		/* Now make the directory sane */
 		if (dev->rootDir) {
+			YAFFS_DIR_WRITE_LOCK(dev);
 			tn->parent = dev->rootDir;
 			ylist_add(&(tn->siblings), &dev->rootDir->variant.directoryVariant.children);
+			yaffs_HashObjectName(tn);
+			YAFFS_DIR_WRITE_UNLOCK(dev);
 		}
 
 		/* Add it to the lost and found directory.
@@ -2042,6 +2118,10 @@ static void yaffs_DeinitialiseObjects(yaffs_Device *dev)
 
 	dev->freeObjects = NULL;
 	dev->nFreeObjects = 0;
+
+	if (dev->nameHash)
+		YFREE(dev->nameHash);
+	dev->nameHash = NULL;
 }
 
 static void yaffs_InitialiseObjects(yaffs_Device *dev)
@@ -2056,6 +2136,14 @@ static void yaffs_InitialiseObjects(yaffs_Device *dev)
 		YINIT_LIST_HEAD(&dev->objectBucket[i].list);
 		dev->objectBucket[i].count = 0;
 	}
+
+	/* Without the name hash, lookups fall back to walking the directory */
+	dev->nameHash = YMALLOC(YAFFS_NAME_HASH_BUCKETS *
+				sizeof(struct ylist_head));
+	if (dev->nameHash) {
+		for (i = 0; i < YAFFS_NAME_HASH_BUCKETS; i++)
+			YINIT_LIST_HEAD(&dev->nameHash[i]);
+	}
 }
 
 static int yaffs_FindNiceObjectBucket(yaffs_Device *dev)
@@ -2211,6 +2299,7 @@ yaffs_Object *yaffs_CreateNewObject(yaffs_Device *dev, int number,
 		case YAFFS_OBJECT_TYPE_DIRECTORY:
 			YINIT_LIST_HEAD(&theObject->variant.directoryVariant.
 					children);
+			theObject->variant.directoryVariant.childrenLoaded = 0;
 			break;
 		case YAFFS_OBJECT_TYPE_SYMLINK:
 		case YAFFS_OBJECT_TYPE_HARDLINK:
@@ -2972,6 +3061,8 @@ static int yaffs_GarbageCollectBlock(yaffs_Device *dev, int block,
 	int isCheckpointBlock;
 	int matchingChunk;
 	int maxCopies;
+	int batchStart = 0;
+	int batchCount = 0;
 
 	int chunksBefore = yaffs_GetErasedChunks(dev);
 	int chunksAfter;
@@ -3017,6 +3108,8 @@ static int yaffs_GarbageCollectBlock(yaffs_Device *dev, int block,
 	} else {
 
 		__u8 *buffer = yaffs_GetTempBuffer(dev, __LINE__);
+		__u8 *batch = yaffs_GetBatchBuffer(dev);
+		__u8 *chunkData;
 
 		yaffs_VerifyBlock(dev, bi, block);
 
@@ -3033,14 +3126,45 @@ static int yaffs_GarbageCollectBlock(yaffs_Device *dev, int block,
 
 				/* This page is in use and might need to be copied off */
 
+				if (batch &&
+				    (dev->gcChunk < batchStart ||
+				     dev->gcChunk >= batchStart + batchCount)) {
+					/* Read this chunk and the in use chunks
+					 * straight after it in one go.
+					 */
+					batchStart = dev->gcChunk;
+					batchCount = 1;
+					while (batchCount < dev->nBatchChunks &&
+					       batchCount < maxCopies &&
+					       batchStart + batchCount < dev->nChunksPerBlock &&
+					       yaffs_CheckChunkBit(dev, block,
+							batchStart + batchCount))
+						batchCount++;
+
+					for (i = 0; i < batchCount; i++)
+						yaffs_InitialiseTags(&dev->batchTags[i]);
+
+					yaffs_ReadChunksWithTagsFromNAND(dev, oldChunk,
+									 batchCount, batch,
+									 dev->batchTags);
+				}
+
 				maxCopies--;
 
 				markNAND = 1;
 
-				yaffs_InitialiseTags(&tags);
+				if (batch) {
+					i = dev->gcChunk - batchStart;
+					chunkData = batch + i * dev->totalBytesPerChunk;
+					tags = dev->batchTags[i];
+				} else {
+					chunkData = buffer;
+
+					yaffs_InitialiseTags(&tags);
 
-				yaffs_ReadChunkWithTagsFromNAND(dev, oldChunk,
-								buffer, &tags);
+					yaffs_ReadChunkWithTagsFromNAND(dev, oldChunk,
+									chunkData, &tags);
+				}
 
 				object =
 				    yaffs_FindObjectByNumber(dev,
@@ -3125,7 +3249,7 @@ static int yaffs_GarbageCollectBlock(yaffs_Device *dev, int block,
 						 */
 
 						yaffs_ObjectHeader *oh;
-						oh = (yaffs_ObjectHeader *)buffer;
+						oh = (yaffs_ObjectHeader *)chunkData;
 						oh->isShrink = 0;
 						tags.extraIsShrinkHeader = 0;
 						oh->shadowsObject = 0;
@@ -3136,7 +3260,7 @@ static int yaffs_GarbageCollectBlock(yaffs_Device *dev, int block,
 					}
 
 					newChunk =
-					    yaffs_WriteNewChunkWithTagsToNAND(dev, buffer, &tags, 1);
+					    yaffs_WriteNewChunkWithTagsToNAND(dev, chunkData, &tags, 1);
 
 					if (newChunk < 0) {
 						retVal = YAFFS_FAIL;
@@ -3164,6 +3288,8 @@ static int yaffs_GarbageCollectBlock(yaffs_Device *dev, int block,
 			}
 		}
 
+		if (batch)
+			yaffs_ReleaseBatchBuffer(dev);
 		yaffs_ReleaseTempBuffer(dev, buffer, __LINE__);
 
 
@@ -3286,6 +3412,56 @@ static int yaffs_CheckGarbageCollection(yaffs_Device *dev)
 	return aggressive ? gcOk : YAFFS_OK;
 }
 
+/* yaffs_BackgroundGarbageCollect()
+ * Does one bounded step of garbage collection for the background thread,
+ * which must hold the gross lock. Normally only the very dirty blocks that
+ * passive gc would accept are taken; once the erased blocks fall to within
+ * urgentBlocks of the reserve, blocks are selected aggressively.
+ *
+ * Returns 0 if there was nothing worth collecting, 1 after a leisurely step
+ * and 2 if the device is short of erased blocks and wants more soon.
+ */
+int yaffs_BackgroundGarbageCollect(yaffs_Device *dev, int urgentBlocks)
+{
+	int checkpointBlockAdjust;
+	int urgent;
+
+	if (dev->isDoingGC || !dev->isMounted)
+		return 0;
+
+	checkpointBlockAdjust = yaffs_CalcCheckpointBlocksRequired(dev) - dev->blocksInCheckpoint;
+	if (checkpointBlockAdjust < 0)
+		checkpointBlockAdjust = 0;
+
+	urgent = dev->nErasedBlocks <
+		(dev->nReservedBlocks + checkpointBlockAdjust + urgentBlocks);
+
+	/* Erasing invalidates the checkpoint, so leave an idle checkpointed
+	 * device alone; the next write will invalidate it anyway.
+	 */
+	if (!urgent && dev->isCheckpointed)
+		return 0;
+
+	if (dev->gcBlock <= 0) {
+		dev->gcBlock = yaffs_FindBlockForGarbageCollection(dev, urgent);
+		dev->gcChunk = 0;
+	}
+
+	if (dev->gcBlock <= 0)
+		return 0;
+
+	dev->backgroundGarbageCollections++;
+
+	T(YAFFS_TRACE_GC,
+	  (TSTR("yaffs: background GC erasedBlocks %d urgent %d" TENDSTR),
+	   dev->nErasedBlocks, urgent));
+
+	/* Never a whole block at once, so foreground waits stay short */
+	yaffs_GarbageCollectBlock(dev, dev->gcBlock, 0);
+
+	return urgent ? 2 : 1;
+}
+
 /*-------------------------  TAGS --------------------------------*/
 
 static int yaffs_TagsMatch(const yaffs_ExtendedTags *tags, int objectId,
@@ -3875,6 +4051,33 @@ static int yaffs_ObjectHasCachedWriteData(yaffs_Object *obj)
 }
 
 
+/* Short op caches are hashed on (object, chunkId) and kept on an LRU
+ * list with the most recently used entry at the head. Free entries sit
+ * at the tail so they are picked before any entry holding data.
+ */
+static int yaffs_ChunkCacheHash(const yaffs_Object *obj, int chunkId)
+{
+	return (obj->objectId + chunkId) & (YAFFS_CACHE_HASH_BUCKETS - 1);
+}
+
+/* Assign a cache entry to (obj, chunkId), or free it if obj is NULL */
+static void yaffs_SetChunkCache(yaffs_Device *dev, yaffs_ChunkCache *cache,
+				yaffs_Object *obj, int chunkId)
+{
+	ylist_del_init(&cache->hashLink);
+	ylist_del(&cache->lruLink);
+
+	cache->object = obj;
+	cache->chunkId = chunkId;
+
+	if (obj) {
+		ylist_add(&cache->hashLink,
+			  &dev->srCacheHash[yaffs_ChunkCacheHash(obj, chunkId)]);
+		ylist_add(&cache->lruLink, &dev->srCacheLru);
+	} else
+		ylist_add_tail(&cache->lruLink, &dev->srCacheLru);
+}
+
 static void yaffs_FlushFilesChunkCache(yaffs_Object *obj)
 {
 	yaffs_Device *dev = obj->myDev;
@@ -3911,7 +4114,7 @@ static void yaffs_FlushFilesChunkCache(yaffs_Object *obj)
 								 cache->nBytes,
 								 1);
 				cache->dirty = 0;
-				cache->object = NULL;
+				yaffs_SetChunkCache(dev, cache, NULL, 0);
 			}
 
 		} while (cache && chunkWritten > 0);
@@ -3963,13 +4166,14 @@ void yaffs_FlushEntireDeviceCache(yaffs_Device *dev)
  */
 static yaffs_ChunkCache *yaffs_GrabChunkCacheWorker(yaffs_Device *dev)
 {
-	int i;
+	yaffs_ChunkCache *cache;
 
 	if (dev->nShortOpCaches > 0) {
-		for (i = 0; i < dev->nShortOpCaches; i++) {
-			if (!dev->srCache[i].object)
-				return &dev->srCache[i];
-		}
+		/* Free entries are always at the tail of the LRU list */
+		cache = ylist_entry(dev->srCacheLru.prev, yaffs_ChunkCache,
+				    lruLink);
+		if (!cache->object)
+			return cache;
 	}
 
 	return NULL;
@@ -3978,10 +4182,8 @@ static yaffs_ChunkCache *yaffs_GrabChunkCacheWorker(yaffs_Device *dev)
 static yaffs_ChunkCache *yaffs_GrabChunkCache(yaffs_Device *dev)
 {
 	yaffs_ChunkCache *cache;
-	yaffs_Object *theObj;
-	int usage;
-	int i;
-	int pushout;
+	yaffs_ChunkCache *c;
+	struct ylist_head *i;
 
 	if (dev->nShortOpCaches > 0) {
 		/* Try find a non-dirty one... */
@@ -3989,33 +4191,23 @@ static yaffs_ChunkCache *yaffs_GrabChunkCache(yaffs_Device *dev)
 		cache = yaffs_GrabChunkCacheWorker(dev);
 
 		if (!cache) {
-			/* They were all dirty, find the last recently used object and flush
-			 * its cache, then  find again.
-			 * NB what's here is not very accurate, we actually flush the object
-			 * the last recently used page.
+			/* They were all in use, so take the least recently used
+			 * unlocked entry. If it is dirty, flush the object it
+			 * belongs to and find again.
 			 */
 
-			/* With locking we can't assume we can use entry zero */
-
-			theObj = NULL;
-			usage = -1;
-			cache = NULL;
-			pushout = -1;
-
-			for (i = 0; i < dev->nShortOpCaches; i++) {
-				if (dev->srCache[i].object &&
-				    !dev->srCache[i].locked &&
-				    (dev->srCache[i].lastUse < usage || !cache)) {
-					usage = dev->srCache[i].lastUse;
-					theObj = dev->srCache[i].object;
-					cache = &dev->srCache[i];
-					pushout = i;
+			ylist_for_each_prev(i, &dev->srCacheLru) {
+				c = ylist_entry(i, yaffs_ChunkCache, lruLink);
+				if (!c->locked) {
+					cache = c;
+					break;
 				}
 			}
 
 			if (!cache || cache->dirty) {
 				/* Flush and try again */
-				yaffs_FlushFilesChunkCache(theObj);
+				if (cache)
+					yaffs_FlushFilesChunkCache(cache->object);
 				cache = yaffs_GrabChunkCacheWorker(dev);
 			}
 
@@ -4026,43 +4218,45 @@ static yaffs_ChunkCache *yaffs_GrabChunkCache(yaffs_Device *dev)
 
 }
 
-/* Find a cached chunk */
-static yaffs_ChunkCache *yaffs_FindChunkCache(const yaffs_Object *obj,
-					      int chunkId)
+/* Look up a cached chunk without counting it as a hit */
+static yaffs_ChunkCache *yaffs_LookupChunkCache(const yaffs_Object *obj,
+						int chunkId)
 {
 	yaffs_Device *dev = obj->myDev;
-	int i;
-	if (dev->nShortOpCaches > 0) {
-		for (i = 0; i < dev->nShortOpCaches; i++) {
-			if (dev->srCache[i].object == obj &&
-			    dev->srCache[i].chunkId == chunkId) {
-				dev->cacheHits++;
+	yaffs_ChunkCache *cache;
+	struct ylist_head *i;
 
-				return &dev->srCache[i];
-			}
+	if (dev->nShortOpCaches > 0) {
+		ylist_for_each(i, &dev->srCacheHash[yaffs_ChunkCacheHash(obj, chunkId)]) {
+			cache = ylist_entry(i, yaffs_ChunkCache, hashLink);
+			if (cache->object == obj &&
+			    cache->chunkId == chunkId)
+				return cache;
 		}
 	}
 	return NULL;
 }
 
+/* Find a cached chunk */
+static yaffs_ChunkCache *yaffs_FindChunkCache(const yaffs_Object *obj,
+					      int chunkId)
+{
+	yaffs_ChunkCache *cache = yaffs_LookupChunkCache(obj, chunkId);
+
+	if (cache)
+		obj->myDev->cacheHits++;
+
+	return cache;
+}
+
 /* Mark the chunk for the least recently used algorithym */
 static void yaffs_UseChunkCache(yaffs_Device *dev, yaffs_ChunkCache *cache,
 				int isAWrite)
 {
 
 	if (dev->nShortOpCaches > 0) {
-		if (dev->srLastUse < 0 || dev->srLastUse > 100000000) {
-			/* Reset the cache usages */
-			int i;
-			for (i = 1; i < dev->nShortOpCaches; i++)
-				dev->srCache[i].lastUse = 0;
-
-			dev->srLastUse = 0;
-		}
-
-		dev->srLastUse++;
-
-		cache->lastUse = dev->srLastUse;
+		ylist_del(&cache->lruLink);
+		ylist_add(&cache->lruLink, &dev->srCacheLru);
 
 		if (isAWrite)
 			cache->dirty = 1;
@@ -4079,7 +4273,7 @@ static void yaffs_InvalidateChunkCache(yaffs_Object *object, int chunkId)
 		yaffs_ChunkCache *cache = yaffs_FindChunkCache(object, chunkId);
 
 		if (cache)
-			cache->object = NULL;
+			yaffs_SetChunkCache(object->myDev, cache, NULL, 0);
 	}
 }
 
@@ -4095,7 +4289,8 @@ static void yaffs_InvalidateWholeChunkCache(yaffs_Object *in)
 		/* Invalidate it. */
 		for (i = 0; i < dev->nShortOpCaches; i++) {
 			if (dev->srCache[i].object == in)
-				dev->srCache[i].object = NULL;
+				yaffs_SetChunkCache(dev, &dev->srCache[i],
+						    NULL, 0);
 		}
 	}
 }
@@ -4299,8 +4494,11 @@ static int yaffs_CheckpointObjectToObject(yaffs_Object *obj, yaffs_CheckpointObj
 	else if (obj->variantType == YAFFS_OBJECT_TYPE_HARDLINK)
 		obj->variant.hardLinkVariant.equivalentObjectId = cp->fileSizeOrEquivalentObjectId;
 
-	if (obj->hdrChunk > 0)
+	if (obj->hdrChunk > 0) {
 		obj->lazyLoaded = 1;
+		if (obj->parent)
+			obj->parent->variant.directoryVariant.childrenLoaded = 0;
+	}
 	return 1;
 }
 
@@ -4676,6 +4874,61 @@ int yaffs_CheckpointRestore(yaffs_Device *dev)
  * Curve-balls: the first chunk might also be the last chunk.
  */
 
+/* Read up to maxChunks whole chunks of a file with one batched read.
+ * The run stops at the first chunk that is not the next one in NAND, is
+ * in another block or is in the short op cache (which may be newer than
+ * NAND). Returns the number of chunks read, or 0 if the run is shorter
+ * than two chunks and the caller should read the chunk itself.
+ */
+static int yaffs_ReadChunksDataFromObject(yaffs_Object *in, int chunkInInode,
+					  int maxChunks, __u8 *buffer)
+{
+	yaffs_Device *dev = in->myDev;
+	int chunkInNAND;
+	int nChunks;
+	int i;
+	__u8 *batch;
+
+	if (maxChunks > dev->nBatchChunks)
+		maxChunks = dev->nBatchChunks;
+	if (maxChunks < 2)
+		return 0;
+
+	chunkInNAND = yaffs_FindChunkInFile(in, chunkInInode, NULL);
+	if (chunkInNAND < 0)
+		return 0;
+
+	for (nChunks = 1; nChunks < maxChunks; nChunks++) {
+		if ((chunkInNAND + nChunks) % dev->nChunksPerBlock == 0 ||
+		    yaffs_FindChunkInFile(in, chunkInInode + nChunks, NULL) !=
+		    chunkInNAND + nChunks ||
+		    yaffs_LookupChunkCache(in, chunkInInode + nChunks))
+			break;
+	}
+
+	if (nChunks < 2)
+		return 0;
+
+	batch = yaffs_GetBatchBuffer(dev);
+	if (!batch)
+		return 0;
+
+	for (i = 0; i < nChunks; i++)
+		yaffs_InitialiseTags(&dev->batchTags[i]);
+
+	yaffs_ReadChunksWithTagsFromNAND(dev, chunkInNAND, nChunks, batch,
+					 dev->batchTags);
+
+	for (i = 0; i < nChunks; i++)
+		memcpy(buffer + i * dev->nDataBytesPerChunk,
+		       batch + i * dev->totalBytesPerChunk,
+		       dev->nDataBytesPerChunk);
+
+	yaffs_ReleaseBatchBuffer(dev);
+
+	return nChunks;
+}
+
 int yaffs_ReadDataFromFile(yaffs_Object *in, __u8 *buffer, loff_t offset,
 			int nBytes)
 {
@@ -4718,8 +4971,7 @@ int yaffs_ReadDataFromFile(yaffs_Object *in, __u8 *buffer, loff_t offset,
 
 				if (!cache) {
 					cache = yaffs_GrabChunkCache(in->myDev);
-					cache->object = in;
-					cache->chunkId = chunk;
+					yaffs_SetChunkCache(dev, cache, in, chunk);
 					cache->dirty = 0;
 					cache->locked = 0;
 					yaffs_ReadChunkDataFromObject(in, chunk,
@@ -4752,9 +5004,17 @@ int yaffs_ReadDataFromFile(yaffs_Object *in, __u8 *buffer, loff_t offset,
 			}
 
 		} else {
+			/* Full chunks. Read a run of them in one go if they are
+			 * consecutive in NAND, else read this one directly into
+			 * the supplied buffer.
+			 */
+			int nChunks = yaffs_ReadChunksDataFromObject(in, chunk,
+					n / dev->nDataBytesPerChunk, buffer);
 
-			/* A full chunk. Read directly into the supplied buffer. */
-			yaffs_ReadChunkDataFromObject(in, chunk, buffer);
+			if (nChunks > 1)
+				nToCopy = nChunks * dev->nDataBytesPerChunk;
+			else
+				yaffs_ReadChunkDataFromObject(in, chunk, buffer);
 
 		}
 
@@ -4848,8 +5108,7 @@ int yaffs_WriteDataToFile(yaffs_Object *in, const __u8 *buffer, loff_t offset,
 				    && yaffs_CheckSpaceForAllocation(in->
 								     myDev)) {
 					cache = yaffs_GrabChunkCache(in->myDev);
-					cache->object = in;
-					cache->chunkId = chunk;
+					yaffs_SetChunkCache(dev, cache, in, chunk);
 					cache->dirty = 0;
 					cache->locked = 0;
 					yaffs_ReadChunkDataFromObject(in, chunk,
@@ -5291,7 +5550,11 @@ static int yaffs_UnlinkWorker(yaffs_Object *obj)
 		hl = ylist_entry(obj->hardLinks.next, yaffs_Object, hardLinks);
 
 		ylist_del_init(&hl->hardLinks);
+		/* Lookups walk the children list under dirLock alone */
+		YAFFS_DIR_WRITE_LOCK(obj->myDev);
 		ylist_del_init(&hl->siblings);
+		ylist_del_init(&hl->nameHashLink);
+		YAFFS_DIR_WRITE_UNLOCK(obj->myDev);
 
 		yaffs_GetObjectName(hl, name, YAFFS_MAX_NAME_LENGTH + 1);
 
@@ -5897,6 +6160,7 @@ static int yaffs_Scan(yaffs_Device *dev)
 						YINIT_LIST_HEAD(&parent->variant.
 								directoryVariant.
 								children);
+						parent->variant.directoryVariant.childrenLoaded = 0;
 					} else if (!parent || parent->variantType !=
 						   YAFFS_OBJECT_TYPE_DIRECTORY) {
 						/* Hoosterman, another problem....
@@ -6050,7 +6314,6 @@ static void yaffs_CheckObjectDetailsLoaded(yaffs_Object *in)
 #endif
 
 	if (in->lazyLoaded && in->hdrChunk > 0) {
-		in->lazyLoaded = 0;
 		chunkData = yaffs_GetTempBuffer(dev, __LINE__);
 
 		result = yaffs_ReadChunkWithTagsFromNAND(dev, in->hdrChunk, chunkData, &tags);
@@ -6082,6 +6345,11 @@ static void yaffs_CheckObjectDetailsLoaded(yaffs_Object *in)
 				alloc_failed = 1; /* Not returned to caller */
 		}
 
+		/* Only now may cached lookups trust the name */
+		YAFFS_DIR_WRITE_LOCK(dev);
+		in->lazyLoaded = 0;
+		YAFFS_DIR_WRITE_UNLOCK(dev);
+
 		yaffs_ReleaseTempBuffer(dev, chunkData, __LINE__);
 	}
 }
@@ -6109,6 +6377,9 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 	int nBlocks = dev->internalEndBlock - dev->internalStartBlock + 1;
 	int itsUnlinked;
 	__u8 *chunkData;
+	__u8 *batch;
+	int batchFirst;
+	int batchBlock;
 
 	int fileSize;
 	int isShrink;
@@ -6150,6 +6421,7 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 	dev->blocksInCheckpoint = 0;
 
 	chunkData = yaffs_GetTempBuffer(dev, __LINE__);
+	batch = yaffs_GetBatchBuffer(dev);
 
 	/* Scan all the blocks to determine their state */
 	for (blk = dev->internalStartBlock; blk <= dev->internalEndBlock; blk++) {
@@ -6268,6 +6540,8 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 
 		/* For each chunk in each block that needs scanning.... */
 		foundChunksInBlock = 0;
+		batchFirst = dev->nChunksPerBlock;
+		batchBlock = 0;
 		for (c = dev->nChunksPerBlock - 1;
 		     !alloc_failed && c >= 0 &&
 		     (state == YAFFS_BLOCK_STATE_NEEDS_SCANNING ||
@@ -6278,8 +6552,41 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 
 			chunk = blk * dev->nChunksPerBlock + c;
 
-			result = yaffs_ReadChunkWithTagsFromNAND(dev, chunk, NULL,
-							&tags);
+			/* Only batch the tag reads of blocks known to be full.
+			 * A window that mixes written and erased chunks makes
+			 * the driver report an ECC failure, so the last chunk
+			 * of each block is read on its own first, and the rest
+			 * of an empty or partially written block is read one
+			 * chunk at a time as before. That costs one extra
+			 * read per full block. If a batched read still turns
+			 * up an unused chunk, its tags are not trusted and the
+			 * rest of the block is read singly.
+			 */
+			if (batchBlock && c < batchFirst) {
+				int i;
+
+				batchFirst = c - dev->nBatchChunks + 1;
+				if (batchFirst < 0)
+					batchFirst = 0;
+				for (i = 0; i <= c - batchFirst; i++)
+					yaffs_InitialiseTags(&dev->batchTags[i]);
+
+				yaffs_ReadChunksWithTagsFromNAND(dev,
+					chunk - (c - batchFirst),
+					c - batchFirst + 1, NULL,
+					dev->batchTags);
+			}
+
+			if (batchBlock && dev->batchTags[c - batchFirst].chunkUsed) {
+				tags = dev->batchTags[c - batchFirst];
+			} else {
+				batchBlock = 0;
+				result = yaffs_ReadChunkWithTagsFromNAND(dev, chunk, NULL,
+								&tags);
+				if (batch && c == dev->nChunksPerBlock - 1 &&
+				    tags.chunkUsed)
+					batchBlock = 1;
+			}
 
 			/* Let's have a good look at this chunk... */
 
@@ -6551,6 +6858,8 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 					} else {
 						in->variantType = tags.extraObjectType;
 						in->lazyLoaded = 1;
+						if (in->parent)
+							in->parent->variant.directoryVariant.childrenLoaded = 0;
 					}
 
 					in->hdrChunk = chunk;
@@ -6627,6 +6936,7 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 						YINIT_LIST_HEAD(&parent->variant.
 							directoryVariant.
 							children);
+						parent->variant.directoryVariant.childrenLoaded = 0;
 					} else if (!parent || parent->variantType !=
 						   YAFFS_OBJECT_TYPE_DIRECTORY) {
 						/* Hoosterman, another problem....
@@ -6741,6 +7051,8 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 	yaffs_HardlinkFixup(dev, hardList);
 
 
+	if (batch)
+		yaffs_ReleaseBatchBuffer(dev);
 	yaffs_ReleaseTempBuffer(dev, chunkData, __LINE__);
 
 	if (alloc_failed)
@@ -6866,8 +7178,11 @@ static void yaffs_RemoveObjectFromDirectory(yaffs_Object *obj)
 		dev->removeObjectCallback(obj);
 
 
+	YAFFS_DIR_WRITE_LOCK(dev);
 	ylist_del_init(&obj->siblings);
+	ylist_del_init(&obj->nameHashLink);
 	obj->parent = NULL;
+	YAFFS_DIR_WRITE_UNLOCK(dev);
 	
 	yaffs_VerifyDirectory(parent);
 }
@@ -6903,8 +7218,13 @@ static void yaffs_AddObjectToDirectory(yaffs_Object *directory,
 
 
 	/* Now add it */
+	YAFFS_DIR_WRITE_LOCK(obj->myDev);
 	ylist_add(&obj->siblings, &directory->variant.directoryVariant.children);
 	obj->parent = directory;
+	yaffs_HashObjectName(obj);
+	if (obj->lazyLoaded)
+		directory->variant.directoryVariant.childrenLoaded = 0;
+	YAFFS_DIR_WRITE_UNLOCK(obj->myDev);
 
 	if (directory == obj->myDev->unlinkedDir
 			|| directory == obj->myDev->deletedDir) {
@@ -6917,6 +7237,62 @@ static void yaffs_AddObjectToDirectory(yaffs_Object *directory,
 	yaffs_VerifyObjectInDirectory(obj);
 }
 
+/* Name lookup through the name hash.
+ * Lazy loaded children have no name or sum yet, so the first lookup in a
+ * directory loads all of its children. After that only the bucket for
+ * (directory, sum) is searched. Made up "objNNN" names of objects that
+ * have no header and lost+found itself don't follow the sum, so they are
+ * matched directly.
+ */
+static yaffs_Object *yaffs_FindObjectByNameHashed(yaffs_Object *directory,
+						  const YCHAR *name, int sum)
+{
+	yaffs_Device *dev = directory->myDev;
+	struct ylist_head *i;
+	YCHAR buffer[YAFFS_MAX_NAME_LENGTH + 1];
+	yaffs_Object *l;
+	__u32 id;
+
+	if (!directory->variant.directoryVariant.childrenLoaded) {
+		ylist_for_each(i, &directory->variant.directoryVariant.children) {
+			l = ylist_entry(i, yaffs_Object, siblings);
+
+			if (l->parent != directory)
+				YBUG();
+
+			yaffs_CheckObjectDetailsLoaded(l);
+		}
+		YAFFS_DIR_WRITE_LOCK(dev);
+		directory->variant.directoryVariant.childrenLoaded = 1;
+		YAFFS_DIR_WRITE_UNLOCK(dev);
+	}
+
+	l = dev->lostNFoundDir;
+	if (l && l->parent == directory &&
+	    yaffs_strcmp(name, YAFFS_LOSTNFOUND_NAME) == 0)
+		return l;
+
+	id = yaffs_LostNFoundNameToId(name);
+	if (id) {
+		l = yaffs_FindObjectByNumber(dev, id);
+		if (l && l->parent == directory && l->hdrChunk <= 0)
+			return l;
+	}
+
+	ylist_for_each(i, &dev->nameHash[yaffs_NameHashFunction(directory, sum)]) {
+		l = ylist_entry(i, yaffs_Object, nameHashLink);
+
+		if (l->parent != directory || !yaffs_SumCompare(l->sum, sum))
+			continue;
+
+		yaffs_GetObjectName(l, buffer, YAFFS_MAX_NAME_LENGTH + 1);
+		if (yaffs_strncmp(name, buffer, YAFFS_MAX_NAME_LENGTH) == 0)
+			return l;
+	}
+
+	return NULL;
+}
+
 yaffs_Object *yaffs_FindObjectByName(yaffs_Object *directory,
 				     const YCHAR *name)
 {
@@ -6947,6 +7323,9 @@ yaffs_Object *yaffs_FindObjectByName(yaffs_Object *directory,
 
 	sum = yaffs_CalcNameSum(name);
 
+	if (directory->myDev->nameHash)
+		return yaffs_FindObjectByNameHashed(directory, name, sum);
+
 	ylist_for_each(i, &directory->variant.directoryVariant.children) {
 		if (i) {
 			l = ylist_entry(i, yaffs_Object, siblings);
@@ -6975,6 +7354,101 @@ yaffs_Object *yaffs_FindObjectByName(yaffs_Object *directory,
 	return NULL;
 }
 
+/*
+ * yaffs_FindObjectByNameCached() is the lookup fast path. It is called
+ * with only the directory read lock held, not the gross lock, so it must
+ * not read NAND or load object details. Hard links are followed.
+ *
+ * The directory lock covers the children lists, the name hash, the in-RAM
+ * names and lazyLoaded. When the result cannot be decided from RAM (a lazy
+ * loaded child, a matching sum without a short name or a made up "objNNN"
+ * name), *complete is cleared and the caller must fall back to
+ * yaffs_FindObjectByName() under the gross lock.
+ */
+yaffs_Object *yaffs_FindObjectByNameCached(yaffs_Object *directory,
+					   const YCHAR *name, int *complete)
+{
+	struct ylist_head *i;
+	yaffs_Object *l;
+	yaffs_Device *dev;
+	int sum;
+
+	*complete = 0;
+
+#ifdef CONFIG_YAFFS_SHORT_NAMES_IN_RAM
+	if (!name || !directory ||
+	    directory->variantType != YAFFS_OBJECT_TYPE_DIRECTORY)
+		return NULL;
+
+	dev = directory->myDev;
+	sum = yaffs_CalcNameSum(name);
+
+	if (dev->nameHash) {
+		if (!directory->variant.directoryVariant.childrenLoaded ||
+		    yaffs_LostNFoundNameToId(name))
+			return NULL;
+
+		l = dev->lostNFoundDir;
+		if (l && l->parent == directory &&
+		    yaffs_strcmp(name, YAFFS_LOSTNFOUND_NAME) == 0)
+			goto found;
+
+		ylist_for_each(i, &dev->nameHash[yaffs_NameHashFunction(directory, sum)]) {
+			l = ylist_entry(i, yaffs_Object, nameHashLink);
+
+			if (l->parent != directory ||
+			    !yaffs_SumCompare(l->sum, sum) ||
+			    l->hdrChunk <= 0 ||
+			    l->objectId == YAFFS_OBJECTID_LOSTNFOUND)
+				continue;
+			if (!l->shortName[0])
+				return NULL;
+			if (yaffs_strncmp(name, l->shortName,
+					  YAFFS_MAX_NAME_LENGTH) == 0)
+				goto found;
+		}
+
+		*complete = 1;
+		return NULL;
+	}
+
+	ylist_for_each(i, &directory->variant.directoryVariant.children) {
+		l = ylist_entry(i, yaffs_Object, siblings);
+
+		if (l->lazyLoaded)
+			return NULL;
+
+		if (l->objectId == YAFFS_OBJECTID_LOSTNFOUND) {
+			if (yaffs_strcmp(name, YAFFS_LOSTNFOUND_NAME))
+				continue;
+		} else if (yaffs_SumCompare(l->sum, sum) || l->hdrChunk <= 0) {
+			if (!l->shortName[0])
+				return NULL;
+			if (yaffs_strncmp(name, l->shortName,
+					  YAFFS_MAX_NAME_LENGTH))
+				continue;
+		} else
+			continue;
+
+		goto found;
+	}
+
+	*complete = 1;
+	return NULL;
+
+found:
+	if (l->variantType == YAFFS_OBJECT_TYPE_HARDLINK) {
+		l = l->variant.hardLinkVariant.equivalentObject;
+		if (!l || l->lazyLoaded)
+			return NULL;
+	}
+	*complete = 1;
+	return l;
+#else
+	return NULL;
+#endif
+}
+
 
 #if 0
 int yaffs_ApplyToDirectoryChildren(yaffs_Object *theDir,
@@ -7441,6 +7915,8 @@ int yaffs_GutsInitialise(yaffs_Device *dev)
 	/* More device initialisation */
 	dev->garbageCollections = 0;
 	dev->passiveGarbageCollections = 0;
+	dev->backgroundGarbageCollections = 0;
+	dev->backgroundGCBackoffs = 0;
 	dev->currentDirtyChecker = 0;
 	dev->bufferedBlock = -1;
 	dev->doingBufferedBlockRewrite = 0;
@@ -7480,20 +7956,49 @@ int yaffs_GutsInitialise(yaffs_Device *dev)
 		if (dev->srCache)
 			memset(dev->srCache, 0, srCacheBytes);
 
+		for (i = 0; i < YAFFS_CACHE_HASH_BUCKETS; i++)
+			YINIT_LIST_HEAD(&dev->srCacheHash[i]);
+		YINIT_LIST_HEAD(&dev->srCacheLru);
+
 		for (i = 0; i < dev->nShortOpCaches && buf; i++) {
 			dev->srCache[i].object = NULL;
-			dev->srCache[i].lastUse = 0;
 			dev->srCache[i].dirty = 0;
+			YINIT_LIST_HEAD(&dev->srCache[i].hashLink);
+			ylist_add_tail(&dev->srCache[i].lruLink,
+				       &dev->srCacheLru);
 			dev->srCache[i].data = buf = YMALLOC_DMA(dev->totalBytesPerChunk);
 		}
 		if (!buf)
 			init_failed = 1;
-
-		dev->srLastUse = 0;
 	}
 
 	dev->cacheHits = 0;
 
+	dev->batchBuffer = NULL;
+	dev->batchTags = NULL;
+	dev->batchBufferInUse = 0;
+	dev->nBatchedReads = 0;
+
+	if (dev->nBatchChunks > YAFFS_MAX_BATCH_CHUNKS)
+		dev->nBatchChunks = YAFFS_MAX_BATCH_CHUNKS;
+
+	if (!init_failed && dev->nBatchChunks > 1) {
+		dev->batchBuffer = YMALLOC_DMA(dev->nBatchChunks *
+					       dev->totalBytesPerChunk);
+		dev->batchTags = YMALLOC(dev->nBatchChunks *
+					 sizeof(yaffs_ExtendedTags));
+		if (!dev->batchBuffer || !dev->batchTags) {
+			/* Not fatal, we just read one chunk at a time */
+			if (dev->batchBuffer)
+				YFREE(dev->batchBuffer);
+			if (dev->batchTags)
+				YFREE(dev->batchTags);
+			dev->batchBuffer = NULL;
+			dev->batchTags = NULL;
+			dev->nBatchChunks = 0;
+		}
+	}
+
 	if (!init_failed) {
 		dev->gcCleanupList = YMALLOC(dev->nChunksPerBlock * sizeof(__u32));
 		if (!dev->gcCleanupList)
@@ -7614,6 +8119,13 @@ void yaffs_Deinitialise(yaffs_Device *dev)
 
 		YFREE(dev->gcCleanupList);
 
+		if (dev->batchBuffer)
+			YFREE(dev->batchBuffer);
+		if (dev->batchTags)
+			YFREE(dev->batchTags);
+		dev->batchBuffer = NULL;
+		dev->batchTags = NULL;
+
 		for (i = 0; i < YAFFS_N_TEMP_BUFFERS; i++)
 			YFREE(dev->tempBuffer[i].buffer);
 
@@ -60,6 +60,12 @@
 
 #define YAFFS_NOBJECT_BUCKETS		256
 
+/* Directory entries are hashed on (parent objectId, name sum) into a
+ * device-wide table so that lookups in large directories don't have to
+ * walk every child. Must be a power of 2.
+ */
+#define YAFFS_NAME_HASH_BUCKETS		1024
+
 
 #define YAFFS_OBJECT_SPACE		0x40000
 
@@ -89,9 +95,13 @@
 /* */
 
 #define YAFFS_MAX_SHORT_OP_CACHES	20
+#define YAFFS_CACHE_HASH_BUCKETS	32	/* Must be a power of 2 */
 
 #define YAFFS_N_TEMP_BUFFERS		6
 
+/* Largest number of chunks read from NAND in one batched read */
+#define YAFFS_MAX_BATCH_CHUNKS		8
+
 /* We limit the number attempts at sucessfully saving a chunk of data.
  * Small-page devices have 32 pages per block; large-page devices have 64.
  * Default to something in the order of 5 to 10 blocks worth of chunks.
@@ -115,7 +125,8 @@
 typedef struct {
 	struct yaffs_ObjectStruct *object;
 	int chunkId;
-	int lastUse;
+	struct ylist_head hashLink;	/* (object, chunkId) hash bucket */
+	struct ylist_head lruLink;	/* most recently used first */
 	int dirty;
 	int nBytes;		/* Only valid if the cache is dirty */
 	int locked;		/* Can't push out or flush while locked. */
@@ -387,6 +398,8 @@ typedef struct {
 
 typedef struct {
 	struct ylist_head children;     /* list of child links */
+	int childrenLoaded;		/* no lazy-loaded children, so every
+					 * child is in the name hash */
 } yaffs_DirectoryStructure;
 
 typedef struct {
@@ -432,6 +445,7 @@ struct yaffs_ObjectStruct {
 	struct yaffs_DeviceStruct *myDev;       /* The device I'm on */
 
 	struct ylist_head hashLink;     /* list of objects in this hash bucket */
+	struct ylist_head nameHashLink; /* list of entries in this name hash bucket */
 
 	struct ylist_head hardLinks;    /* all the equivalent hard linked objects */
 
@@ -555,6 +569,10 @@ struct yaffs_DeviceStruct {
 	int nShortOpCaches;	/* If <= 0, then short op caching is disabled, else
 				 * the number of short op caches (don't use too many)
 				 */
+	int nBatchChunks;	/* If <= 1, then batched reads are disabled, else
+				 * the most chunks to read at once (up to
+				 * YAFFS_MAX_BATCH_CHUNKS)
+				 */
 
 	int useHeaderFileSize;	/* Flag to determine if we should use file sizes from the header */
 
@@ -589,6 +607,13 @@ struct yaffs_DeviceStruct {
 	int (*readChunkWithTagsFromNAND) (struct yaffs_DeviceStruct *dev,
 					  int chunkInNAND, __u8 *data,
 					  yaffs_ExtendedTags *tags);
+	/* Optional. Reads nChunks consecutive chunks; data (if not NULL) holds
+	 * totalBytesPerChunk per chunk and tags is an array of nChunks.
+	 */
+	int (*readChunksWithTagsFromNAND) (struct yaffs_DeviceStruct *dev,
+					   int chunkInNAND, int nChunks,
+					   __u8 *data,
+					   yaffs_ExtendedTags *tags);
 	int (*markNANDBlockBad) (struct yaffs_DeviceStruct *dev, int blockNo);
 	int (*queryNANDBlock) (struct yaffs_DeviceStruct *dev, int blockNo,
 			       yaffs_BlockState *state, __u32 *sequenceNumber);
@@ -640,9 +665,17 @@ struct yaffs_DeviceStruct {
 	struct semaphore sem;	/* Semaphore for waiting on erasure.*/
 	struct semaphore grossLock;	/* Gross locking semaphore */
 	struct rw_semaphore dirLock; /* Lock the directory structure */
+	struct task_struct *bgThread;	/* Background gc and checkpointing */
+	unsigned long lastForeground;	/* jiffies of last VFS entry */
+	unsigned long lastCheckpoint;	/* jiffies of last checkpoint save */
+	int checkpointPageWrites;	/* data page writes at that save */
+	unsigned mountTime;		/* msecs taken by yaffs_GutsInitialise */
+	int mountedFromCheckpoint;
+	int nCheckpointRefreshes;
 	__u8 *spareBuffer;	/* For mtdif2 use. Don't know the size of the buffer
 				 * at compile time so we have to allocate it.
-
+				 * Holds the oob of YAFFS_MAX_BATCH_CHUNKS chunks
+				 * for batched reads.
 				 */
 	void (*putSuperFunc) (struct super_block *sb);
         struct ylist_head searchContexts;
@@ -712,6 +745,8 @@ struct yaffs_DeviceStruct {
 
 	yaffs_ObjectBucket objectBucket[YAFFS_NOBJECT_BUCKETS];
 
+	struct ylist_head *nameHash;	/* YAFFS_NAME_HASH_BUCKETS entries */
+
 	int nFreeChunks;
 
 	int currentDirtyChecker;	/* Used to find current dirtiest block */
@@ -727,6 +762,8 @@ struct yaffs_DeviceStruct {
 	int nGCCopies;
 	int garbageCollections;
 	int passiveGarbageCollections;
+	int backgroundGarbageCollections;
+	int backgroundGCBackoffs;
 	int nRetriedWrites;
 	int nRetiredBlocks;
 	int eccFixed;
@@ -751,7 +788,8 @@ struct yaffs_DeviceStruct {
 	int doingBufferedBlockRewrite;
 
 	yaffs_ChunkCache *srCache;
-	int srLastUse;
+	struct ylist_head srCacheHash[YAFFS_CACHE_HASH_BUCKETS];
+	struct ylist_head srCacheLru;
 
 	int cacheHits;
 
@@ -771,6 +809,12 @@ struct yaffs_DeviceStruct {
 	int unmanagedTempAllocations;
 	int unmanagedTempDeallocations;
 
+	/* Batched read buffer, nBatchChunks chunks and their tags */
+	__u8 *batchBuffer;
+	yaffs_ExtendedTags *batchTags;
+	int batchBufferInUse;
+	int nBatchedReads;
+
 	/* yaffs2 runtime stuff */
 	unsigned sequenceNumber;	/* Sequence number of currently allocating block */
 	unsigned oldestDirtySequence;
@@ -858,10 +902,15 @@ void yaffs_FlushEntireDeviceCache(yaffs_Device *dev);
 int yaffs_CheckpointSave(yaffs_Device *dev);
 int yaffs_CheckpointRestore(yaffs_Device *dev);
 
+/* Garbage collection on behalf of a background thread */
+int yaffs_BackgroundGarbageCollect(yaffs_Device *dev, int urgentBlocks);
+
 /* Directory operations */
 yaffs_Object *yaffs_MknodDirectory(yaffs_Object *parent, const YCHAR *name,
 				__u32 mode, __u32 uid, __u32 gid);
 yaffs_Object *yaffs_FindObjectByName(yaffs_Object *theDir, const YCHAR *name);
+yaffs_Object *yaffs_FindObjectByNameCached(yaffs_Object *theDir,
+					const YCHAR *name, int *complete);
 int yaffs_ApplyToDirectoryChildren(yaffs_Object *theDir,
 				   int (*fn) (yaffs_Object *));
 
@@ -187,6 +187,80 @@ int nandmtd2_ReadChunkWithTagsFromNAND(yaffs_Device *dev, int chunkInNAND,
 		return YAFFS_FAIL;
 }
 
+/* Batched read of nChunks consecutive chunks in one mtd->read_oob call.
+ * With MTD_OOB_AUTO the MTD layer packs the free oob bytes of each page
+ * one after another, so the tags of chunk i start at i * oobavail.
+ * The ECC status of a multi-page read can't be pinned to a page, so if the
+ * batched read reports anything but success each chunk is read again on
+ * its own. Inband tags and MTDs without enough free oob are read one chunk
+ * at a time too.
+ */
+int nandmtd2_ReadChunksWithTagsFromNAND(yaffs_Device *dev, int chunkInNAND,
+					int nChunks, __u8 *data,
+					yaffs_ExtendedTags *tags)
+{
+	struct mtd_info *mtd = (struct mtd_info *)(dev->genericDevice);
+#if (MTD_VERSION_CODE > MTD_VERSION(2, 6, 17))
+	struct mtd_oob_ops ops;
+	yaffs_PackedTags2 pt;
+	int tagsLength;
+#endif
+	int retval = YAFFS_OK;
+	int i;
+
+	loff_t addr = ((loff_t) chunkInNAND) * dev->totalBytesPerChunk;
+
+	T(YAFFS_TRACE_MTD,
+	  (TSTR
+	   ("nandmtd2_ReadChunksWithTagsFromNAND chunk %d n %d data %p tags %p"
+	    TENDSTR), chunkInNAND, nChunks, data, tags));
+
+#if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 17))
+#ifdef CONFIG_YAFFS_DOES_ECC
+	tagsLength = sizeof(pt);
+#else
+	tagsLength = sizeof(pt.t);	/* tags ECC is ignored */
+#endif
+	if (!dev->inbandTags && mtd->read_oob &&
+	    mtd->oobavail >= tagsLength &&
+	    nChunks <= YAFFS_MAX_BATCH_CHUNKS) {
+		ops.mode = MTD_OOB_AUTO;
+		ops.ooblen = nChunks * mtd->oobavail;
+		ops.len = data ? nChunks * dev->nDataBytesPerChunk : ops.ooblen;
+		ops.ooboffs = 0;
+		ops.datbuf = data;
+		ops.oobbuf = dev->spareBuffer;
+		ops.retlen = 0;
+		ops.oobretlen = 0;
+
+		if (mtd->read_oob(mtd, addr, &ops) == 0 &&
+		    ops.oobretlen == ops.ooblen &&
+		    (!data || ops.retlen == ops.len)) {
+			for (i = 0; i < nChunks; i++) {
+				memset(&pt, 0xff, sizeof(pt));
+				memcpy(&pt, dev->spareBuffer + i * mtd->oobavail,
+				       min_t(int, sizeof(pt), mtd->oobavail));
+				yaffs_UnpackTags2(&tags[i], &pt);
+			}
+			return YAFFS_OK;
+		}
+
+		T(YAFFS_TRACE_MTD,
+		  (TSTR("batched read of chunk %d failed, reading singly"
+			TENDSTR), chunkInNAND));
+	}
+#endif
+
+	for (i = 0; i < nChunks; i++) {
+		if (nandmtd2_ReadChunkWithTagsFromNAND(dev, chunkInNAND + i,
+				data ? data + i * dev->totalBytesPerChunk : NULL,
+				&tags[i]) != YAFFS_OK)
+			retval = YAFFS_FAIL;
+	}
+
+	return retval;
+}
+
 int nandmtd2_MarkNANDBlockBad(struct yaffs_DeviceStruct *dev, int blockNo)
 {
 	struct mtd_info *mtd = (struct mtd_info *)(dev->genericDevice);
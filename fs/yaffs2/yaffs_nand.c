@@ -53,6 +53,45 @@ int yaffs_ReadChunkWithTagsFromNAND(yaffs_Device *dev, int chunkInNAND,
 	return result;
 }
 
+/* Read nChunks consecutive chunks. buffer (if not NULL) holds
+ * totalBytesPerChunk bytes per chunk and tags must hold nChunks entries.
+ * Devices without a batched reader get one read per chunk.
+ */
+int yaffs_ReadChunksWithTagsFromNAND(yaffs_Device *dev, int chunkInNAND,
+					int nChunks, __u8 *buffer,
+					yaffs_ExtendedTags *tags)
+{
+	int result = YAFFS_OK;
+	int i;
+
+	if (nChunks < 2 || !dev->readChunksWithTagsFromNAND) {
+		for (i = 0; i < nChunks; i++) {
+			if (yaffs_ReadChunkWithTagsFromNAND(dev, chunkInNAND + i,
+					buffer ? buffer + i * dev->totalBytesPerChunk : NULL,
+					&tags[i]) != YAFFS_OK)
+				result = YAFFS_FAIL;
+		}
+		return result;
+	}
+
+	dev->nPageReads += nChunks;
+	dev->nBatchedReads++;
+
+	result = dev->readChunksWithTagsFromNAND(dev,
+						 chunkInNAND - dev->chunkOffset,
+						 nChunks, buffer, tags);
+
+	for (i = 0; i < nChunks; i++) {
+		if (tags[i].eccResult > YAFFS_ECC_RESULT_NO_ERROR) {
+			yaffs_BlockInfo *bi =
+			    yaffs_GetBlockInfo(dev, (chunkInNAND + i)/dev->nChunksPerBlock);
+			yaffs_HandleChunkError(dev, bi);
+		}
+	}
+
+	return result;
+}
+
 int yaffs_WriteChunkWithTagsToNAND(yaffs_Device *dev,
 						   int chunkInNAND,
 						   const __u8 *buffer,
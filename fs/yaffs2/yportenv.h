@@ -101,6 +101,12 @@
 #define compile_time_assertion(assertion) \
 	({ int x = __builtin_choose_expr(assertion, 0, (void)0); (void) x; })
 
+/* Directory structure lock, see yaffs_FindObjectByNameCached() */
+#define YAFFS_DIR_READ_LOCK(dev)	down_read(&(dev)->dirLock)
+#define YAFFS_DIR_READ_UNLOCK(dev)	up_read(&(dev)->dirLock)
+#define YAFFS_DIR_WRITE_LOCK(dev)	down_write(&(dev)->dirLock)
+#define YAFFS_DIR_WRITE_UNLOCK(dev)	up_write(&(dev)->dirLock)
+
 #elif defined CONFIG_YAFFS_DIRECT
 
 #define MTD_VERSION_CODE MTD_VERSION(2, 6, 22)
@@ -158,6 +164,14 @@
 
 #endif
 
+/* Environments that only ever run yaffs under one lock need no dirLock */
+#ifndef YAFFS_DIR_READ_LOCK
+#define YAFFS_DIR_READ_LOCK(dev)	do { } while (0)
+#define YAFFS_DIR_READ_UNLOCK(dev)	do { } while (0)
+#define YAFFS_DIR_WRITE_LOCK(dev)	do { } while (0)
+#define YAFFS_DIR_WRITE_UNLOCK(dev)	do { } while (0)
+#endif
+
 /* see yaffs_fs.c */
 extern unsigned int yaffs_traceMask;
 extern unsigned int yaffs_wr_attempts;
@@ -57,6 +57,20 @@
 #define PMEM_CLEAN_INV_CACHES	_IOW(PMEM_IOCTL_MAGIC, 11, unsigned int)
 #define PMEM_CLEAN_CACHES	_IOW(PMEM_IOCTL_MAGIC, 12, unsigned int)
 #define PMEM_INV_CACHES		_IOW(PMEM_IOCTL_MAGIC, 13, unsigned int)
+/* cleaning and invalidating a range is flushing it */
+#define PMEM_FLUSH_CACHES	PMEM_CLEAN_INV_CACHES
+
+#define PMEM_GET_CACHE_MODE	_IOR(PMEM_IOCTL_MAGIC, 14, unsigned int)
+
+/* Mapping modes PMEM_GET_CACHE_MODE stores at its argument. The mode
+ * follows the platform's cached and buffered flags and O_SYNC; it cannot
+ * be chosen per file, since the kernel keeps a single mapping of the whole
+ * region and aliasing it with another memory type is unpredictable on
+ * ARMv6 and up. O_SYNC on a cached region still asks for uncached
+ * mappings, as it always has. */
+#define PMEM_CACHE_CACHED	1
+#define PMEM_CACHE_WRITECOMBINE	2
+#define PMEM_CACHE_UNCACHED	3
 
 struct pmem_region {
 	unsigned long offset;
@@ -19,7 +19,11 @@
 
 #define ASHMEM_NAME_DEF		"dev/ashmem"
 
-/* Return values from ASHMEM_PIN: Was the mapping purged while unpinned? */
+/*
+ * Return values from ASHMEM_PIN: Was the mapping purged while unpinned?
+ * The shrinker may purge only part of an unpinned interval; use
+ * ASHMEM_PIN_PURGE_MAP to find out which pages were lost.
+ */
 #define ASHMEM_NOT_PURGED	0
 #define ASHMEM_WAS_PURGED	1
 
@@ -32,6 +36,17 @@ struct ashmem_pin {
 	__u32 len;	/* length forward from offset, in bytes, page-aligned */
 };
 
+/*
+ * ASHMEM_PIN_PURGE_MAP pins like ASHMEM_PIN, and also fills 'purge_map' with
+ * one bit per page of the interval (bit n % 8 of byte n / 8 for page n),
+ * set if that page was purged while unpinned.
+ */
+struct ashmem_pin_purge_map {
+	__u32 offset;	/* offset into region, in bytes, page-aligned */
+	__u32 len;	/* length forward from offset, in bytes, page-aligned */
+	__u64 purge_map;/* user pointer to (len / PAGE_SIZE + 7) / 8 bytes */
+};
+
 #define __ASHMEMIOC		0x77
 
 #define ASHMEM_SET_NAME		_IOW(__ASHMEMIOC, 1, char[ASHMEM_NAME_LEN])
@@ -44,5 +59,16 @@ struct ashmem_pin {
 #define ASHMEM_UNPIN		_IOW(__ASHMEMIOC, 8, struct ashmem_pin)
 #define ASHMEM_GET_PIN_STATUS	_IO(__ASHMEMIOC, 9)
 #define ASHMEM_PURGE_ALL_CACHES	_IO(__ASHMEMIOC, 10)
+#define ASHMEM_PIN_PURGE_MAP	_IOW(__ASHMEMIOC, 11, struct ashmem_pin_purge_map)
+
+#ifdef __KERNEL__
+struct file;
+
+#ifdef CONFIG_ASHMEM
+int is_ashmem_file(struct file *file);
+#else
+static inline int is_ashmem_file(struct file *file) { return 0; }
+#endif
+#endif
 
 #endif	/* _LINUX_ASHMEM_H */
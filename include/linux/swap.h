@@ -222,6 +222,18 @@ extern int vm_swappiness;
 extern int remove_mapping(struct address_space *mapping, struct page *page);
 extern long vm_total_pages;
 
+/*
+ * Running totals of global reclaim since boot: LRU pages scanned and
+ * reclaimed, and the number and duration of direct reclaim stalls.
+ */
+struct vm_pressure {
+	unsigned long scanned;
+	unsigned long reclaimed;
+	unsigned long stalls;
+	unsigned long stall_us;
+};
+extern void vm_pressure_sample(struct vm_pressure *p);
+
 #ifdef CONFIG_NUMA
 extern int zone_reclaim_mode;
 extern int sysctl_min_unmapped_ratio;
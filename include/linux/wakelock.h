@@ -18,6 +18,8 @@
 
 #include <linux/list.h>
 #include <linux/ktime.h>
+#include <linux/rbtree.h>
+#include <linux/spinlock.h>
 
 /* A wake_lock prevents the system from entering suspend or other low power
  * states when active. If the type is set to WAKE_LOCK_SUSPEND, the wake_lock
@@ -35,6 +37,8 @@ enum {
 struct wake_lock {
 #ifdef CONFIG_HAS_WAKELOCK
 	struct list_head    link;
+	struct rb_node      timeout_node;
+	spinlock_t          lock;
 	int                 flags;
 	const char         *name;
 	unsigned long       expires;
@@ -47,6 +51,7 @@ struct wake_lock {
 		ktime_t         prevent_suspend_time;
 		ktime_t         max_time;
 		ktime_t         last_time;
+		ktime_t         wait_start;
 	} stat;
 #endif
 #endif
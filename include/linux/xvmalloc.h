@@ -10,11 +10,12 @@
  * Released under the terms of GNU General Public License Version 2.0
  */
 
-#ifndef _XV_MALLOC_H_
-#define _XV_MALLOC_H_
+#ifndef _LINUX_XVMALLOC_H
+#define _LINUX_XVMALLOC_H
 
 #include <linux/types.h>
 
+struct page;
 struct xv_pool;
 
 struct xv_pool *xv_create_pool(void);
@@ -26,5 +27,11 @@ void xv_free(struct xv_pool *pool, struct page *page, u32 offset);
 
 u32 xv_get_object_size(void *obj);
 u64 xv_get_total_size_bytes(struct xv_pool *pool);
+u64 xv_get_used_size_bytes(struct xv_pool *pool);
+
+struct page *xv_isolate_page(struct xv_pool *pool, u32 max_used);
+int xv_first_object(struct xv_pool *pool, struct page *page, u32 *offset);
+int xv_migrate(struct xv_pool *pool, struct page **page, u32 *offset);
+int xv_putback_page(struct xv_pool *pool, struct page *page);
 
 #endif
@@ -0,0 +1,23 @@
+#ifndef _TRACE_BINDER_H
+#define _TRACE_BINDER_H
+
+#include <linux/ktime.h>
+#include <linux/tracepoint.h>
+
+/* a transaction or reply has been queued for the target */
+DECLARE_TRACE(binder_transaction,
+	TPPROTO(int debug_id, int reply, unsigned int flags,
+		int from_pid, int to_pid, int to_node),
+		TPARGS(debug_id, reply, flags, from_pid, to_pid, to_node));
+
+/* a target thread has picked up the transaction in binder_thread_read */
+DECLARE_TRACE(binder_transaction_received,
+	TPPROTO(int debug_id, int to_thread, s64 queue_us),
+		TPARGS(debug_id, to_thread, queue_us));
+
+/* the target has replied to a synchronous transaction */
+DECLARE_TRACE(binder_transaction_replied,
+	TPPROTO(int debug_id, int to_node, s64 service_us, s64 total_us),
+		TPARGS(debug_id, to_node, service_us, total_us));
+
+#endif
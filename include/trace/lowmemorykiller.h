@@ -0,0 +1,13 @@
+#ifndef _TRACE_LOWMEMORYKILLER_H
+#define _TRACE_LOWMEMORYKILLER_H
+
+#include <linux/ktime.h>
+#include <linux/tracepoint.h>
+
+/* a victim has been picked; pid is 0 if nothing was eligible */
+DECLARE_TRACE(lowmem_select,
+	TPPROTO(int pid, int oom_adj, int tasksize, int min_adj,
+		s64 select_us),
+		TPARGS(pid, oom_adj, tasksize, min_adj, select_us));
+
+#endif
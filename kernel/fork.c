@@ -60,6 +60,7 @@
 #include <linux/tty.h>
 #include <linux/proc_fs.h>
 #include <linux/blkdev.h>
+#include <linux/oom.h>
 #include <trace/sched.h>
 
 #include <asm/pgtable.h>
@@ -1423,6 +1424,9 @@ long do_fork(unsigned long clone_flags,
 		audit_finish_fork(p);
 		tracehook_report_clone(trace, regs, clone_flags, nr, p);
 
+		if (!(clone_flags & CLONE_THREAD))
+			oom_adj_changed(p);
+
 		/*
 		 * We set PF_STARTING at creation in case tracing wants to
 		 * use this to distinguish a fully live task from one that
@@ -39,11 +39,32 @@ module_param_named(debug_mask, debug_mask, int, S_IRUGO | S_IWUSR | S_IWGRP);
 #define WAKE_LOCK_INITIALIZED            (1U << 8)
 #define WAKE_LOCK_ACTIVE                 (1U << 9)
 #define WAKE_LOCK_AUTO_EXPIRE            (1U << 10)
-#define WAKE_LOCK_PREVENTING_SUSPEND     (1U << 11)
 
+/*
+ * Lock ordering: list_lock -> lock->lock -> timeout_lock.
+ *
+ * list_lock only protects the list of all wake locks, which is walked for
+ * statistics and debug output. The state of a single wake lock is protected
+ * by its own spinlock, so taking and releasing a lock without a timeout only
+ * touches that lock and the atomic active_count of its type.
+ *
+ * Wake locks with a timeout are kept in timed_locks, ordered by expiry time,
+ * under timeout_lock. Because expiry happens from has_wake_lock without the
+ * per-lock spinlock, the flags and stats of a lock with WAKE_LOCK_AUTO_EXPIRE
+ * set may only be changed with timeout_lock held as well.
+ */
 static DEFINE_SPINLOCK(list_lock);
-static LIST_HEAD(inactive_locks);
-static struct list_head active_wake_locks[WAKE_LOCK_TYPE_COUNT];
+static LIST_HEAD(wake_locks);
+static atomic_t active_count[WAKE_LOCK_TYPE_COUNT];
+
+struct timed_wake_locks {
+	struct rb_root root;
+	struct rb_node *first;	/* expires first */
+	struct rb_node *last;	/* expires last */
+};
+static DEFINE_SPINLOCK(timeout_lock);
+static struct timed_wake_locks timed_locks[WAKE_LOCK_TYPE_COUNT];
+
 static int current_event_num;
 struct workqueue_struct *suspend_work_queue;
 struct wake_lock main_wake_lock;
@@ -52,9 +73,44 @@ static struct wake_lock unknown_wakeup;
 
 #ifdef CONFIG_WAKELOCK_STAT
 static struct wake_lock deleted_wake_locks;
-static ktime_t last_sleep_time_update;
 static int wait_for_wakeup;
 
+/*
+ * The sleep wait clock only runs while main_wake_lock is released. A suspend
+ * wake lock records the clock when it is taken and adds the difference to
+ * its prevent_suspend_time when it is released, so no event has to walk the
+ * active locks.
+ */
+static DEFINE_SEQLOCK(sleep_wait_lock);
+static ktime_t sleep_wait_total;
+static ktime_t sleep_wait_since;
+static int sleep_waiting;
+
+static ktime_t sleep_wait_clock(ktime_t now)
+{
+	unsigned long seq;
+	ktime_t ret;
+
+	do {
+		seq = read_seqbegin(&sleep_wait_lock);
+		ret = sleep_wait_total;
+		if (sleep_waiting && now.tv64 > sleep_wait_since.tv64)
+			ret = ktime_add(ret, ktime_sub(now, sleep_wait_since));
+	} while (read_seqretry(&sleep_wait_lock, seq));
+	return ret;
+}
+
+static void sleep_wait_update(int waiting, ktime_t now)
+{
+	write_seqlock(&sleep_wait_lock);
+	if (sleep_waiting)
+		sleep_wait_total = ktime_add(sleep_wait_total,
+					     ktime_sub(now, sleep_wait_since));
+	sleep_waiting = waiting;
+	sleep_wait_since = now;
+	write_sequnlock(&sleep_wait_lock);
+}
+
 int get_expired_time(struct wake_lock *lock, ktime_t *expire_time)
 {
 	struct timespec ts;
@@ -91,6 +147,8 @@ static int print_lock_stat(struct seq_file *m, struct wake_lock *lock)
 	ktime_t max_time = lock->stat.max_time;
 
 	ktime_t prevent_suspend_time = lock->stat.prevent_suspend_time;
+	int type = lock->flags & WAKE_LOCK_TYPE_MASK;
+
 	if (lock->flags & WAKE_LOCK_ACTIVE) {
 		ktime_t now, add_time;
 		int expired = get_expired_time(lock, &now);
@@ -103,9 +161,10 @@ static int print_lock_stat(struct seq_file *m, struct wake_lock *lock)
 		else
 			expire_count++;
 		total_time = ktime_add(total_time, add_time);
-		if (lock->flags & WAKE_LOCK_PREVENTING_SUSPEND)
+		if (type == WAKE_LOCK_SUSPEND)
 			prevent_suspend_time = ktime_add(prevent_suspend_time,
-					ktime_sub(now, last_sleep_time_update));
+					ktime_sub(sleep_wait_clock(now),
+						  lock->stat.wait_start));
 		if (add_time.tv64 > max_time.tv64)
 			max_time = add_time;
 	}
@@ -124,22 +183,31 @@ static int wakelock_stats_show(struct seq_file *m, void *unused)
 	unsigned long irqflags;
 	struct wake_lock *lock;
 	int ret;
-	int type;
 
 	spin_lock_irqsave(&list_lock, irqflags);
 
 	ret = seq_puts(m, "name\tcount\texpire_count\twake_count\tactive_since"
 			"\ttotal_time\tsleep_time\tmax_time\tlast_change\n");
-	list_for_each_entry(lock, &inactive_locks, link)
+	list_for_each_entry(lock, &wake_locks, link) {
+		spin_lock(&lock->lock);
+		spin_lock(&timeout_lock);
 		ret = print_lock_stat(m, lock);
-	for (type = 0; type < WAKE_LOCK_TYPE_COUNT; type++) {
-		list_for_each_entry(lock, &active_wake_locks[type], link)
-			ret = print_lock_stat(m, lock);
+		spin_unlock(&timeout_lock);
+		spin_unlock(&lock->lock);
 	}
 	spin_unlock_irqrestore(&list_lock, irqflags);
 	return 0;
 }
 
+static void wake_lock_stat_locked(struct wake_lock *lock)
+{
+	ktime_t now = ktime_get();
+
+	lock->stat.last_time = now;
+	if ((lock->flags & WAKE_LOCK_TYPE_MASK) == WAKE_LOCK_SUSPEND)
+		lock->stat.wait_start = sleep_wait_clock(now);
+}
+
 static void wake_unlock_stat_locked(struct wake_lock *lock, int expired)
 {
 	ktime_t duration;
@@ -157,62 +225,93 @@ static void wake_unlock_stat_locked(struct wake_lock *lock, int expired)
 	lock->stat.total_time = ktime_add(lock->stat.total_time, duration);
 	if (ktime_to_ns(duration) > ktime_to_ns(lock->stat.max_time))
 		lock->stat.max_time = duration;
-	lock->stat.last_time = ktime_get();
-	if (lock->flags & WAKE_LOCK_PREVENTING_SUSPEND) {
-		duration = ktime_sub(now, last_sleep_time_update);
+	lock->stat.last_time = now;
+	if ((lock->flags & WAKE_LOCK_TYPE_MASK) == WAKE_LOCK_SUSPEND) {
+		duration = ktime_sub(sleep_wait_clock(now),
+				     lock->stat.wait_start);
 		lock->stat.prevent_suspend_time = ktime_add(
 			lock->stat.prevent_suspend_time, duration);
-		lock->flags &= ~WAKE_LOCK_PREVENTING_SUSPEND;
 	}
 }
+#endif
+
 
-static void update_sleep_wait_stats_locked(int done)
+/* Caller must hold timeout_lock */
+static void timeout_insert(struct wake_lock *lock, int type)
 {
-	struct wake_lock *lock;
-	ktime_t now, etime, elapsed, add;
-	int expired;
-
-	now = ktime_get();
-	elapsed = ktime_sub(now, last_sleep_time_update);
-	list_for_each_entry(lock, &active_wake_locks[WAKE_LOCK_SUSPEND], link) {
-		expired = get_expired_time(lock, &etime);
-		if (lock->flags & WAKE_LOCK_PREVENTING_SUSPEND) {
-			if (expired)
-				add = ktime_sub(etime, last_sleep_time_update);
-			else
-				add = elapsed;
-			lock->stat.prevent_suspend_time = ktime_add(
-				lock->stat.prevent_suspend_time, add);
+	struct timed_wake_locks *t = &timed_locks[type];
+	struct rb_node **p = &t->root.rb_node;
+	struct rb_node *parent = NULL;
+	struct wake_lock *entry;
+	int first = 1, last = 1;
+
+	while (*p) {
+		parent = *p;
+		entry = rb_entry(parent, struct wake_lock, timeout_node);
+		if (time_before(lock->expires, entry->expires)) {
+			p = &parent->rb_left;
+			last = 0;
+		} else {
+			p = &parent->rb_right;
+			first = 0;
 		}
-		if (done || expired)
-			lock->flags &= ~WAKE_LOCK_PREVENTING_SUSPEND;
-		else
-			lock->flags |= WAKE_LOCK_PREVENTING_SUSPEND;
 	}
-	last_sleep_time_update = now;
+	if (first)
+		t->first = &lock->timeout_node;
+	if (last)
+		t->last = &lock->timeout_node;
+	rb_link_node(&lock->timeout_node, parent, p);
+	rb_insert_color(&lock->timeout_node, &t->root);
 }
-#endif
 
+/* Caller must hold timeout_lock */
+static void timeout_erase(struct wake_lock *lock, int type)
+{
+	struct timed_wake_locks *t = &timed_locks[type];
 
-static void expire_wake_lock(struct wake_lock *lock)
+	if (t->first == &lock->timeout_node)
+		t->first = rb_next(&lock->timeout_node);
+	if (t->last == &lock->timeout_node)
+		t->last = rb_prev(&lock->timeout_node);
+	rb_erase(&lock->timeout_node, &t->root);
+}
+
+/*
+ * Caller must hold lock->lock, and timeout_lock if the lock auto expires.
+ * has_wake_lock_locked expires locks with only timeout_lock held.
+ */
+static void wake_lock_deactivate(struct wake_lock *lock, int type, int expired)
 {
+	if (!(lock->flags & WAKE_LOCK_ACTIVE))
+		return;
 #ifdef CONFIG_WAKELOCK_STAT
-	wake_unlock_stat_locked(lock, 1);
+	wake_unlock_stat_locked(lock, expired);
 #endif
+	if (lock->flags & WAKE_LOCK_AUTO_EXPIRE)
+		timeout_erase(lock, type);
+	else
+		atomic_dec(&active_count[type]);
 	lock->flags &= ~(WAKE_LOCK_ACTIVE | WAKE_LOCK_AUTO_EXPIRE);
-	list_del(&lock->link);
-	list_add(&lock->link, &inactive_locks);
+}
+
+static void expire_wake_lock(struct wake_lock *lock, int type)
+{
+	wake_lock_deactivate(lock, type, 1);
 	if (debug_mask & (DEBUG_WAKE_LOCK | DEBUG_EXPIRE))
 		pr_info("expired wake lock %s\n", lock->name);
 }
 
-/* Caller must acquire the list_lock spinlock */
-static void print_active_locks_locked(int type)
+void print_active_locks(int type)
 {
+	unsigned long irqflags;
 	struct wake_lock *lock;
 
 	BUG_ON(type >= WAKE_LOCK_TYPE_COUNT);
-	list_for_each_entry(lock, &active_wake_locks[type], link) {
+	spin_lock_irqsave(&list_lock, irqflags);
+	list_for_each_entry(lock, &wake_locks, link) {
+		if ((lock->flags & WAKE_LOCK_TYPE_MASK) != type ||
+		    !(lock->flags & WAKE_LOCK_ACTIVE))
+			continue;
 		if (lock->flags & WAKE_LOCK_AUTO_EXPIRE) {
 			long timeout = lock->expires - jiffies;
 			if (timeout <= 0)
@@ -224,42 +323,44 @@ static void print_active_locks_locked(int type)
 		} else
 			pr_info("active wake lock %s\n", lock->name);
 	}
-}
-
-void print_active_locks(int type)
-{
-	unsigned long irqflags;
-	spin_lock_irqsave(&list_lock, irqflags);
-	print_active_locks_locked(type);
 	spin_unlock_irqrestore(&list_lock, irqflags);
 }
 
+/*
+ * Caller must hold timeout_lock. Expired locks are only ever at the start of
+ * timed_locks, so each one is visited once and the answer itself comes from
+ * active_count and the last lock to expire.
+ */
 static long has_wake_lock_locked(int type)
 {
-	struct wake_lock *lock, *n;
-	long max_timeout = 0;
+	struct timed_wake_locks *t = &timed_locks[type];
+	struct wake_lock *lock;
 
 	BUG_ON(type >= WAKE_LOCK_TYPE_COUNT);
-	list_for_each_entry_safe(lock, n, &active_wake_locks[type], link) {
-		if (lock->flags & WAKE_LOCK_AUTO_EXPIRE) {
-			long timeout = lock->expires - jiffies;
-			if (timeout <= 0)
-				expire_wake_lock(lock);
-			else if (timeout > max_timeout)
-				max_timeout = timeout;
-		} else
-			return -1;
+	while (t->first) {
+		lock = rb_entry(t->first, struct wake_lock, timeout_node);
+		if (time_before(jiffies, lock->expires))
+			break;
+		expire_wake_lock(lock, type);
 	}
-	return max_timeout;
+	if (atomic_read(&active_count[type]))
+		return -1;
+	if (!t->last)
+		return 0;
+	lock = rb_entry(t->last, struct wake_lock, timeout_node);
+	return lock->expires - jiffies;
 }
 
 long has_wake_lock(int type)
 {
 	long ret;
 	unsigned long irqflags;
-	spin_lock_irqsave(&list_lock, irqflags);
+
+	if (atomic_read(&active_count[type]))
+		return -1;
+	spin_lock_irqsave(&timeout_lock, irqflags);
 	ret = has_wake_lock_locked(type);
-	spin_unlock_irqrestore(&list_lock, irqflags);
+	spin_unlock_irqrestore(&timeout_lock, irqflags);
 	return ret;
 }
 
@@ -302,23 +403,34 @@ static void suspend(struct work_struct *work)
 }
 static DECLARE_WORK(suspend_work, suspend);
 
+static void expire_wake_locks(unsigned long data);
+static DEFINE_TIMER(expire_timer, expire_wake_locks, 0, 0);
+
+/*
+ * The expire timer fires when the first timed suspend lock expires, so every
+ * lock is accounted as expired close to its actual expiry time.
+ */
 static void expire_wake_locks(unsigned long data)
 {
+	struct rb_node *first;
 	long has_lock;
 	unsigned long irqflags;
 	if (debug_mask & DEBUG_EXPIRE)
 		pr_info("expire_wake_locks: start\n");
-	spin_lock_irqsave(&list_lock, irqflags);
 	if (debug_mask & DEBUG_SUSPEND)
-		print_active_locks_locked(WAKE_LOCK_SUSPEND);
+		print_active_locks(WAKE_LOCK_SUSPEND);
+	spin_lock_irqsave(&timeout_lock, irqflags);
 	has_lock = has_wake_lock_locked(WAKE_LOCK_SUSPEND);
+	first = timed_locks[WAKE_LOCK_SUSPEND].first;
+	if (first)
+		mod_timer(&expire_timer, rb_entry(first, struct wake_lock,
+						  timeout_node)->expires);
+	spin_unlock_irqrestore(&timeout_lock, irqflags);
 	if (debug_mask & DEBUG_EXPIRE)
 		pr_info("expire_wake_locks: done, has_lock %ld\n", has_lock);
 	if (has_lock == 0)
 		queue_work(suspend_work_queue, &suspend_work);
-	spin_unlock_irqrestore(&list_lock, irqflags);
 }
-static DEFINE_TIMER(expire_timer, expire_wake_locks, 0, 0);
 
 static int power_suspend_late(struct platform_device *pdev, pm_message_t state)
 {
@@ -360,22 +472,33 @@ void wake_lock_init(struct wake_lock *lock, int type, const char *name)
 	lock->stat.prevent_suspend_time = ktime_set(0, 0);
 	lock->stat.max_time = ktime_set(0, 0);
 	lock->stat.last_time = ktime_set(0, 0);
+	lock->stat.wait_start = ktime_set(0, 0);
 #endif
 	lock->flags = (type & WAKE_LOCK_TYPE_MASK) | WAKE_LOCK_INITIALIZED;
 
+	spin_lock_init(&lock->lock);
 	INIT_LIST_HEAD(&lock->link);
 	spin_lock_irqsave(&list_lock, irqflags);
-	list_add(&lock->link, &inactive_locks);
+	list_add(&lock->link, &wake_locks);
 	spin_unlock_irqrestore(&list_lock, irqflags);
 }
 EXPORT_SYMBOL(wake_lock_init);
 
 void wake_lock_destroy(struct wake_lock *lock)
 {
+	int type;
 	unsigned long irqflags;
 	if (debug_mask & DEBUG_WAKE_LOCK)
 		pr_info("wake_lock_destroy name=%s\n", lock->name);
 	spin_lock_irqsave(&list_lock, irqflags);
+	spin_lock(&lock->lock);
+	type = lock->flags & WAKE_LOCK_TYPE_MASK;
+	if (lock->flags & WAKE_LOCK_AUTO_EXPIRE) {
+		spin_lock(&timeout_lock);
+		wake_lock_deactivate(lock, type, 0);
+		spin_unlock(&timeout_lock);
+	} else
+		wake_lock_deactivate(lock, type, 0);
 	lock->flags &= ~WAKE_LOCK_INITIALIZED;
 #ifdef CONFIG_WAKELOCK_STAT
 	if (lock->stat.count) {
@@ -392,6 +515,7 @@ void wake_lock_destroy(struct wake_lock *lock)
 				  lock->stat.max_time);
 	}
 #endif
+	spin_unlock(&lock->lock);
 	list_del(&lock->link);
 	spin_unlock_irqrestore(&list_lock, irqflags);
 }
@@ -401,33 +525,45 @@ static void wake_lock_internal(
 	struct wake_lock *lock, long timeout, int has_timeout)
 {
 	int type;
+	int timed;
+	int held = 0;
 	unsigned long irqflags;
-	long expire_in;
 
-	spin_lock_irqsave(&list_lock, irqflags);
+	spin_lock_irqsave(&lock->lock, irqflags);
 	type = lock->flags & WAKE_LOCK_TYPE_MASK;
 	BUG_ON(type >= WAKE_LOCK_TYPE_COUNT);
 	BUG_ON(!(lock->flags & WAKE_LOCK_INITIALIZED));
 #ifdef CONFIG_WAKELOCK_STAT
-	if (type == WAKE_LOCK_SUSPEND && wait_for_wakeup) {
+	if (type == WAKE_LOCK_SUSPEND && wait_for_wakeup &&
+	    xchg(&wait_for_wakeup, 0)) {
 		if (debug_mask & DEBUG_WAKEUP)
 			pr_info("wakeup wake lock: %s\n", lock->name);
-		wait_for_wakeup = 0;
 		lock->stat.wakeup_count++;
 	}
-	if ((lock->flags & WAKE_LOCK_AUTO_EXPIRE) &&
-	    (long)(lock->expires - jiffies) <= 0) {
-		wake_unlock_stat_locked(lock, 0);
-		lock->stat.last_time = ktime_get();
-	}
 #endif
+	/*
+	 * Taking or retaking a lock without a timeout never touches the
+	 * timed locks, which keeps the common case off timeout_lock.
+	 */
+	timed = has_timeout || (lock->flags & WAKE_LOCK_AUTO_EXPIRE);
+	if (timed) {
+		spin_lock(&timeout_lock);
+		if ((lock->flags & WAKE_LOCK_AUTO_EXPIRE) &&
+		    (long)(lock->expires - jiffies) <= 0)
+			wake_lock_deactivate(lock, type, 1);
+	}
 	if (!(lock->flags & WAKE_LOCK_ACTIVE)) {
 		lock->flags |= WAKE_LOCK_ACTIVE;
 #ifdef CONFIG_WAKELOCK_STAT
-		lock->stat.last_time = ktime_get();
+		wake_lock_stat_locked(lock);
 #endif
-	}
-	list_del(&lock->link);
+	} else if (lock->flags & WAKE_LOCK_AUTO_EXPIRE)
+		timeout_erase(lock, type);
+	else if (has_timeout)
+		atomic_dec(&active_count[type]);
+	else
+		held = 1;
+
 	if (has_timeout) {
 		if (debug_mask & DEBUG_WAKE_LOCK)
 			pr_info("wake_lock: %s, type %d, timeout %ld.%03lu\n",
@@ -435,41 +571,32 @@ static void wake_lock_internal(
 				(timeout % HZ) * MSEC_PER_SEC / HZ);
 		lock->expires = jiffies + timeout;
 		lock->flags |= WAKE_LOCK_AUTO_EXPIRE;
-		list_add_tail(&lock->link, &active_wake_locks[type]);
+		timeout_insert(lock, type);
+		if (type == WAKE_LOCK_SUSPEND &&
+		    timed_locks[type].first == &lock->timeout_node) {
+			if (debug_mask & DEBUG_EXPIRE)
+				pr_info("wake_lock: %s, start expire timer, "
+					"%ld\n", lock->name, timeout);
+			mod_timer(&expire_timer, lock->expires);
+		}
 	} else {
 		if (debug_mask & DEBUG_WAKE_LOCK)
 			pr_info("wake_lock: %s, type %d\n", lock->name, type);
 		lock->expires = LONG_MAX;
 		lock->flags &= ~WAKE_LOCK_AUTO_EXPIRE;
-		list_add(&lock->link, &active_wake_locks[type]);
+		if (!held)
+			atomic_inc(&active_count[type]);
 	}
+	if (timed)
+		spin_unlock(&timeout_lock);
 	if (type == WAKE_LOCK_SUSPEND) {
 		current_event_num++;
 #ifdef CONFIG_WAKELOCK_STAT
 		if (lock == &main_wake_lock)
-			update_sleep_wait_stats_locked(1);
-		else if (!wake_lock_active(&main_wake_lock))
-			update_sleep_wait_stats_locked(0);
+			sleep_wait_update(0, ktime_get());
 #endif
-		if (has_timeout)
-			expire_in = has_wake_lock_locked(type);
-		else
-			expire_in = -1;
-		if (expire_in > 0) {
-			if (debug_mask & DEBUG_EXPIRE)
-				pr_info("wake_lock: %s, start expire timer, "
-					"%ld\n", lock->name, expire_in);
-			mod_timer(&expire_timer, jiffies + expire_in);
-		} else {
-			if (del_timer(&expire_timer))
-				if (debug_mask & DEBUG_EXPIRE)
-					pr_info("wake_lock: %s, stop expire timer\n",
-						lock->name);
-			if (expire_in == 0)
-				queue_work(suspend_work_queue, &suspend_work);
-		}
 	}
-	spin_unlock_irqrestore(&list_lock, irqflags);
+	spin_unlock_irqrestore(&lock->lock, irqflags);
 }
 
 void wake_lock(struct wake_lock *lock)
@@ -488,40 +615,40 @@ void wake_unlock(struct wake_lock *lock)
 {
 	int type;
 	unsigned long irqflags;
-	spin_lock_irqsave(&list_lock, irqflags);
+	long has_lock = -1;
+
+	spin_lock_irqsave(&lock->lock, irqflags);
 	type = lock->flags & WAKE_LOCK_TYPE_MASK;
-#ifdef CONFIG_WAKELOCK_STAT
-	wake_unlock_stat_locked(lock, 0);
-#endif
 	if (debug_mask & DEBUG_WAKE_LOCK)
 		pr_info("wake_unlock: %s\n", lock->name);
-	lock->flags &= ~(WAKE_LOCK_ACTIVE | WAKE_LOCK_AUTO_EXPIRE);
-	list_del(&lock->link);
-	list_add(&lock->link, &inactive_locks);
-	if (type == WAKE_LOCK_SUSPEND) {
-		long has_lock = has_wake_lock_locked(type);
-		if (has_lock > 0) {
-			if (debug_mask & DEBUG_EXPIRE)
-				pr_info("wake_unlock: %s, start expire timer, "
-					"%ld\n", lock->name, has_lock);
-			mod_timer(&expire_timer, jiffies + has_lock);
-		} else {
-			if (del_timer(&expire_timer))
+	if (lock->flags & WAKE_LOCK_AUTO_EXPIRE) {
+		spin_lock(&timeout_lock);
+		wake_lock_deactivate(lock, type, 0);
+		if (type == WAKE_LOCK_SUSPEND) {
+			has_lock = has_wake_lock_locked(type);
+			if (!timed_locks[type].first && del_timer(&expire_timer))
 				if (debug_mask & DEBUG_EXPIRE)
 					pr_info("wake_unlock: %s, stop expire "
 						"timer\n", lock->name);
-			if (has_lock == 0)
-				queue_work(suspend_work_queue, &suspend_work);
 		}
-		if (lock == &main_wake_lock) {
-			if (debug_mask & DEBUG_SUSPEND)
-				print_active_locks_locked(WAKE_LOCK_SUSPEND);
+		spin_unlock(&timeout_lock);
+	} else if (lock->flags & WAKE_LOCK_ACTIVE) {
+		wake_lock_deactivate(lock, type, 0);
+		/* only the last untimed unlock has to look at the timed locks */
+		if (type == WAKE_LOCK_SUSPEND &&
+		    !atomic_read(&active_count[type]))
+			has_lock = has_wake_lock(type);
+	}
 #ifdef CONFIG_WAKELOCK_STAT
-			update_sleep_wait_stats_locked(0);
+	if (lock == &main_wake_lock)
+		sleep_wait_update(1, ktime_get());
 #endif
-		}
-	}
-	spin_unlock_irqrestore(&list_lock, irqflags);
+	spin_unlock_irqrestore(&lock->lock, irqflags);
+
+	if (has_lock == 0)
+		queue_work(suspend_work_queue, &suspend_work);
+	if (lock == &main_wake_lock && (debug_mask & DEBUG_SUSPEND))
+		print_active_locks(WAKE_LOCK_SUSPEND);
 }
 EXPORT_SYMBOL(wake_unlock);
 
@@ -549,8 +676,8 @@ static int __init wakelocks_init(void)
 	int ret;
 	int i;
 
-	for (i = 0; i < ARRAY_SIZE(active_wake_locks); i++)
-		INIT_LIST_HEAD(&active_wake_locks[i]);
+	for (i = 0; i < ARRAY_SIZE(timed_locks); i++)
+		timed_locks[i].root = RB_ROOT;
 
 #ifdef CONFIG_WAKELOCK_STAT
 	wake_lock_init(&deleted_wake_locks, WAKE_LOCK_SUSPEND,
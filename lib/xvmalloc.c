@@ -14,10 +14,11 @@
 #include <linux/errno.h>
 #include <linux/highmem.h>
 #include <linux/init.h>
+#include <linux/module.h>
 #include <linux/string.h>
 #include <linux/slab.h>
 
-#include "xvmalloc.h"
+#include <linux/xvmalloc.h>
 #include "xvmalloc_int.h"
 
 static void stat_inc(u64 *value)
@@ -79,6 +80,31 @@ static struct block_header *BLOCK_NEXT(struct block_header *block)
 		((char *)block + block->size + XV_ALIGN);
 }
 
+/*
+ * Offset of block following the one at 'offset'. Unlike BLOCK_NEXT,
+ * this also works for allocated blocks, whose size is not aligned.
+ */
+static u32 next_block_offset(struct block_header *block, u32 offset)
+{
+	return offset + ALIGN(block->size, XV_ALIGN) + XV_ALIGN;
+}
+
+static int page_isolated(struct page *page)
+{
+	return page_private(page) & XV_PAGE_ISOLATED;
+}
+
+static u32 page_used(struct page *page)
+{
+	return page_private(page) & ~XV_PAGE_ISOLATED;
+}
+
+static void page_used_add(struct xv_pool *pool, struct page *page, int delta)
+{
+	set_page_private(page, page_private(page) + delta);
+	pool->used_bytes += delta;
+}
+
 /*
  * Get index of free list containing blocks of maximum size
  * which is less than or equal to given size.
@@ -287,6 +313,9 @@ static int grow_pool(struct xv_pool *pool, gfp_t flags)
 	stat_inc(&pool->total_pages);
 
 	spin_lock(&pool->lock);
+	set_page_private(page, 0);
+	list_add(&page->lru, &pool->pages);
+
 	block = get_ptr_atomic(page, 0, KM_USER0);
 
 	block->size = PAGE_SIZE - XV_ALIGN;
@@ -317,14 +346,62 @@ struct xv_pool *xv_create_pool(void)
 		return NULL;
 
 	spin_lock_init(&pool->lock);
+	INIT_LIST_HEAD(&pool->pages);
 
 	return pool;
 }
+EXPORT_SYMBOL_GPL(xv_create_pool);
 
 void xv_destroy_pool(struct xv_pool *pool)
 {
 	kfree(pool);
 }
+EXPORT_SYMBOL_GPL(xv_destroy_pool);
+
+/*
+ * Allocate 'size' (aligned) bytes from the free block at <page, offset>
+ * found by find_block() in freelist 'index'. Called with pool->lock held.
+ */
+static void alloc_block(struct xv_pool *pool, struct page *page, u32 offset,
+			u32 index, u32 size, u32 origsize)
+{
+	u32 tmpsize, tmpoffset;
+	struct block_header *block, *tmpblock;
+
+	block = get_ptr_atomic(page, offset, KM_USER0);
+
+	remove_block_head(pool, block, index);
+
+	/* Split the block if required */
+	tmpoffset = offset + size + XV_ALIGN;
+	tmpsize = block->size - size;
+	tmpblock = (struct block_header *)((char *)block + size + XV_ALIGN);
+	if (tmpsize) {
+		tmpblock->size = tmpsize - XV_ALIGN;
+		set_flag(tmpblock, BLOCK_FREE);
+		clear_flag(tmpblock, PREV_FREE);
+
+		set_blockprev(tmpblock, offset);
+		if (tmpblock->size >= XV_MIN_ALLOC_SIZE)
+			insert_block(pool, page, tmpoffset, tmpblock);
+
+		if (tmpoffset + XV_ALIGN + tmpblock->size != PAGE_SIZE) {
+			tmpblock = BLOCK_NEXT(tmpblock);
+			set_blockprev(tmpblock, tmpoffset);
+		}
+	} else {
+		/* This block is exact fit */
+		if (tmpoffset != PAGE_SIZE)
+			clear_flag(tmpblock, PREV_FREE);
+	}
+
+	block->size = origsize;
+	clear_flag(block, BLOCK_FREE);
+
+	put_ptr_atomic(block, KM_USER0);
+
+	page_used_add(pool, page, size + XV_ALIGN);
+}
 
 /**
  * xv_malloc - Allocate block of given size from pool.
@@ -343,8 +420,7 @@ int xv_malloc(struct xv_pool *pool, u32 size, struct page **page,
 		u32 *offset, gfp_t flags)
 {
 	int error;
-	u32 index, tmpsize, origsize, tmpoffset;
-	struct block_header *block, *tmpblock;
+	u32 index, origsize;
 
 	*page = NULL;
 	*offset = 0;
@@ -376,56 +452,27 @@ int xv_malloc(struct xv_pool *pool, u32 size, struct page **page,
 		return -ENOMEM;
 	}
 
-	block = get_ptr_atomic(*page, *offset, KM_USER0);
-
-	remove_block_head(pool, block, index);
-
-	/* Split the block if required */
-	tmpoffset = *offset + size + XV_ALIGN;
-	tmpsize = block->size - size;
-	tmpblock = (struct block_header *)((char *)block + size + XV_ALIGN);
-	if (tmpsize) {
-		tmpblock->size = tmpsize - XV_ALIGN;
-		set_flag(tmpblock, BLOCK_FREE);
-		clear_flag(tmpblock, PREV_FREE);
-
-		set_blockprev(tmpblock, *offset);
-		if (tmpblock->size >= XV_MIN_ALLOC_SIZE)
-			insert_block(pool, *page, tmpoffset, tmpblock);
-
-		if (tmpoffset + XV_ALIGN + tmpblock->size != PAGE_SIZE) {
-			tmpblock = BLOCK_NEXT(tmpblock);
-			set_blockprev(tmpblock, tmpoffset);
-		}
-	} else {
-		/* This block is exact fit */
-		if (tmpoffset != PAGE_SIZE)
-			clear_flag(tmpblock, PREV_FREE);
-	}
-
-	block->size = origsize;
-	clear_flag(block, BLOCK_FREE);
-
-	put_ptr_atomic(block, KM_USER0);
+	alloc_block(pool, *page, *offset, index, size, origsize);
 	spin_unlock(&pool->lock);
 
 	*offset += XV_ALIGN;
 
 	return 0;
 }
+EXPORT_SYMBOL_GPL(xv_malloc);
 
 /*
- * Free block identified with <page, offset>
+ * Free block at <page, offset>, merging it with free neighbours.
+ * Called with pool->lock held. Returns 1 if the page no longer holds
+ * any object: it is then off the pool and must be released by caller.
  */
-void xv_free(struct xv_pool *pool, struct page *page, u32 offset)
+static int free_block(struct xv_pool *pool, struct page *page, u32 offset)
 {
+	int isolated;
 	void *page_start;
 	struct block_header *block, *tmpblock;
 
-	offset -= XV_ALIGN;
-
-	spin_lock(&pool->lock);
-
+	isolated = page_isolated(page);
 	page_start = get_ptr_atomic(page, 0, KM_USER0);
 	block = (struct block_header *)((char *)page_start + offset);
 
@@ -433,6 +480,7 @@ void xv_free(struct xv_pool *pool, struct page *page, u32 offset)
 	BUG_ON(test_flag(block, BLOCK_FREE));
 
 	block->size = ALIGN(block->size, XV_ALIGN);
+	page_used_add(pool, page, -(block->size + XV_ALIGN));
 
 	tmpblock = BLOCK_NEXT(block);
 	if (offset + block->size + XV_ALIGN == PAGE_SIZE)
@@ -444,7 +492,7 @@ void xv_free(struct xv_pool *pool, struct page *page, u32 offset)
 		 * Blocks smaller than XV_MIN_ALLOC_SIZE
 		 * are not inserted in any free list.
 		 */
-		if (tmpblock->size >= XV_MIN_ALLOC_SIZE) {
+		if (tmpblock->size >= XV_MIN_ALLOC_SIZE && !isolated) {
 			remove_block(pool, page,
 				    offset + block->size + XV_ALIGN, tmpblock,
 				    get_index_for_insert(tmpblock->size));
@@ -458,7 +506,7 @@ void xv_free(struct xv_pool *pool, struct page *page, u32 offset)
 						get_blockprev(block));
 		offset = offset - tmpblock->size - XV_ALIGN;
 
-		if (tmpblock->size >= XV_MIN_ALLOC_SIZE)
+		if (tmpblock->size >= XV_MIN_ALLOC_SIZE && !isolated)
 			remove_block(pool, page, offset, tmpblock,
 				    get_index_for_insert(tmpblock->size));
 
@@ -469,15 +517,12 @@ void xv_free(struct xv_pool *pool, struct page *page, u32 offset)
 	/* No used objects in this page. Free it. */
 	if (block->size == PAGE_SIZE - XV_ALIGN) {
 		put_ptr_atomic(page_start, KM_USER0);
-		spin_unlock(&pool->lock);
-
-		__free_page(page);
-		stat_dec(&pool->total_pages);
-		return;
+		list_del(&page->lru);
+		return 1;
 	}
 
 	set_flag(block, BLOCK_FREE);
-	if (block->size >= XV_MIN_ALLOC_SIZE)
+	if (block->size >= XV_MIN_ALLOC_SIZE && !isolated)
 		insert_block(pool, page, offset, block);
 
 	if (offset + block->size + XV_ALIGN != PAGE_SIZE) {
@@ -487,8 +532,203 @@ void xv_free(struct xv_pool *pool, struct page *page, u32 offset)
 	}
 
 	put_ptr_atomic(page_start, KM_USER0);
+	return 0;
+}
+
+/*
+ * Free block identified with <page, offset>
+ */
+void xv_free(struct xv_pool *pool, struct page *page, u32 offset)
+{
+	int empty;
+
+	spin_lock(&pool->lock);
+	empty = free_block(pool, page, offset - XV_ALIGN);
+	spin_unlock(&pool->lock);
+
+	if (empty) {
+		__free_page(page);
+		stat_dec(&pool->total_pages);
+	}
+}
+EXPORT_SYMBOL_GPL(xv_free);
+
+/*
+ * Add (or, when 'insert' is zero, remove) all free blocks of
+ * 'page' to the pool freelists.
+ */
+static void page_freelist_update(struct xv_pool *pool, struct page *page,
+				int insert)
+{
+	u32 offset;
+	void *page_start;
+	struct block_header *block;
+
+	page_start = get_ptr_atomic(page, 0, KM_USER0);
+	for (offset = 0; offset < PAGE_SIZE;
+			offset = next_block_offset(block, offset)) {
+		block = (struct block_header *)((char *)page_start + offset);
+		if (!test_flag(block, BLOCK_FREE) ||
+				block->size < XV_MIN_ALLOC_SIZE)
+			continue;
+
+		if (insert)
+			insert_block(pool, page, offset, block);
+		else
+			remove_block(pool, page, offset, block,
+				get_index_for_insert(block->size));
+	}
+	put_ptr_atomic(page_start, KM_USER0);
+}
+
+/**
+ * xv_isolate_page - Pick a sparsely used page for compaction.
+ * @pool: pool to pick from
+ * @max_used: only pick pages with at most these many bytes in use
+ *
+ * Pages are scanned round-robin starting from the least recently
+ * picked one. The page returned has its free space withdrawn from
+ * the pool (so objects moved out with xv_migrate never land back in
+ * it) and holds a reference: hand it back with xv_putback_page.
+ * Returns NULL if no page qualifies.
+ */
+struct page *xv_isolate_page(struct xv_pool *pool, u32 max_used)
+{
+	u64 scanned;
+	struct page *page;
+
+	spin_lock(&pool->lock);
+	for (scanned = 0; scanned < pool->total_pages &&
+			!list_empty(&pool->pages); scanned++) {
+		page = list_first_entry(&pool->pages, struct page, lru);
+		list_move_tail(&page->lru, &pool->pages);
+
+		if (page_isolated(page) || page_used(page) > max_used)
+			continue;
+
+		page_freelist_update(pool, page, 0);
+		set_page_private(page, page_private(page) | XV_PAGE_ISOLATED);
+		get_page(page);
+		spin_unlock(&pool->lock);
+
+		return page;
+	}
+	spin_unlock(&pool->lock);
+
+	return NULL;
+}
+EXPORT_SYMBOL_GPL(xv_isolate_page);
+
+/*
+ * Get first object still in isolated 'page' whose offset is at least
+ * *offset, so callers can step past objects they could not move.
+ * Returns -ENOENT once there is none left.
+ */
+int xv_first_object(struct xv_pool *pool, struct page *page, u32 *offset)
+{
+	int ret = -ENOENT;
+	u32 from = *offset, block_offset;
+	void *page_start;
+	struct block_header *block;
+
+	spin_lock(&pool->lock);
+	if (!page_used(page))
+		goto out;
+
+	page_start = get_ptr_atomic(page, 0, KM_USER0);
+	for (block_offset = 0; block_offset < PAGE_SIZE;
+			block_offset = next_block_offset(block, block_offset)) {
+		block = (struct block_header *)((char *)page_start +
+						block_offset);
+		if (!test_flag(block, BLOCK_FREE) &&
+				block_offset + XV_ALIGN >= from) {
+			*offset = block_offset + XV_ALIGN;
+			ret = 0;
+			break;
+		}
+	}
+	put_ptr_atomic(page_start, KM_USER0);
+
+out:
+	spin_unlock(&pool->lock);
+	return ret;
+}
+EXPORT_SYMBOL_GPL(xv_first_object);
+
+/**
+ * xv_migrate - Move object out of an isolated page.
+ * @pool: pool the object belongs to
+ * @page: page holding the object; set to its new page on return
+ * @offset: location of object within page; updated likewise
+ *
+ * The object is copied to free space elsewhere in the pool and its
+ * old block is freed. The pool is never grown for this: returns
+ * -ENOMEM if no free block is large enough. Caller must make sure
+ * nobody else accesses the object meanwhile.
+ */
+int xv_migrate(struct xv_pool *pool, struct page **page, u32 *offset)
+{
+	int empty;
+	u32 index, size, origsize, new_offset;
+	struct page *new_page = NULL;
+	void *src, *dst;
+
+	spin_lock(&pool->lock);
+
+	src = get_ptr_atomic(*page, *offset, KM_USER0);
+	origsize = xv_get_object_size(src);
+	put_ptr_atomic(src, KM_USER0);
+	size = ALIGN(origsize, XV_ALIGN);
+
+	index = find_block(pool, size, &new_page, &new_offset);
+	if (!new_page) {
+		spin_unlock(&pool->lock);
+		return -ENOMEM;
+	}
+	alloc_block(pool, new_page, new_offset, index, size, origsize);
+	new_offset += XV_ALIGN;
+
+	src = get_ptr_atomic(*page, *offset, KM_USER0);
+	dst = get_ptr_atomic(new_page, new_offset, KM_USER1);
+	memcpy(dst, src, origsize);
+	put_ptr_atomic(dst, KM_USER1);
+	put_ptr_atomic(src, KM_USER0);
+
+	empty = free_block(pool, *page, *offset - XV_ALIGN);
 	spin_unlock(&pool->lock);
+
+	if (empty) {
+		__free_page(*page);
+		stat_dec(&pool->total_pages);
+	}
+
+	*page = new_page;
+	*offset = new_offset;
+
+	return 0;
 }
+EXPORT_SYMBOL_GPL(xv_migrate);
+
+/*
+ * Return page isolated with xv_isolate_page to the pool. Returns 1 if
+ * all its objects were moved out (or freed) and the page is gone.
+ */
+int xv_putback_page(struct xv_pool *pool, struct page *page)
+{
+	int empty;
+
+	spin_lock(&pool->lock);
+	empty = !page_used(page);
+	if (!empty)
+		page_freelist_update(pool, page, 1);
+	set_page_private(page, page_private(page) & ~XV_PAGE_ISOLATED);
+	spin_unlock(&pool->lock);
+
+	put_page(page);
+
+	return empty;
+}
+EXPORT_SYMBOL_GPL(xv_putback_page);
 
 u32 xv_get_object_size(void *obj)
 {
@@ -497,6 +737,7 @@ u32 xv_get_object_size(void *obj)
 	blk = (struct block_header *)((char *)(obj) - XV_ALIGN);
 	return blk->size;
 }
+EXPORT_SYMBOL_GPL(xv_get_object_size);
 
 /*
  * Returns total memory used by allocator (userdata + metadata)
@@ -505,3 +746,16 @@ u64 xv_get_total_size_bytes(struct xv_pool *pool)
 {
 	return pool->total_pages << PAGE_SHIFT;
 }
+EXPORT_SYMBOL_GPL(xv_get_total_size_bytes);
+
+/*
+ * Returns memory used by allocated objects, including their headers
+ */
+u64 xv_get_used_size_bytes(struct xv_pool *pool)
+{
+	return pool->used_bytes;
+}
+EXPORT_SYMBOL_GPL(xv_get_used_size_bytes);
+
+MODULE_LICENSE("Dual BSD/GPL");
+MODULE_DESCRIPTION("xvmalloc memory allocator");
@@ -14,6 +14,7 @@
 #define _XV_MALLOC_INT_H_
 
 #include <linux/kernel.h>
+#include <linux/list.h>
 #include <linux/types.h>
 
 /* User configurable params */
@@ -47,6 +48,13 @@ enum blockflags {
 #define FLAGS_MASK	XV_ALIGN_MASK
 #define PREV_MASK	(~FLAGS_MASK)
 
+/*
+ * page->private of pool pages holds the bytes in use by objects
+ * (including their headers) and whether the page is isolated for
+ * compaction. Free blocks of isolated pages are kept off the freelists.
+ */
+#define XV_PAGE_ISOLATED	(1UL << (BITS_PER_LONG - 1))
+
 struct freelist_entry {
 	struct page *page;
 	u16 offset;
@@ -79,8 +87,12 @@ struct xv_pool {
 
 	struct freelist_entry freelist[NUM_FREE_LISTS];
 
+	/* all pages of this pool, least recently compacted first */
+	struct list_head pages;
+
 	/* stats */
 	u64 total_pages;
+	u64 used_bytes;
 };
 
 #endif
@@ -27,7 +27,15 @@
 #include <linux/personality.h>
 #include <linux/bitops.h>
 #include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/pagemap.h>
+#include <linux/rmap.h>
 #include <linux/shmem_fs.h>
+#include <linux/radix-tree.h>
+#include <linux/highmem.h>
+#include <linux/vmalloc.h>
+#include <linux/lzo.h>
+#include <linux/xvmalloc.h>
 #include <linux/ashmem.h>
 
 #define ASHMEM_NAME_PREFIX "dev/ashmem/"
@@ -37,7 +45,7 @@
 /*
  * ashmem_area - anonymous shared memory area
  * Lifecycle: From our parent file's open() until its release()
- * Locking: Protected by `ashmem_mutex'
+ * Locking: Protected by `asma->lock'
  * Big Note: Mappings do NOT pin this structure; it dies on close()
  */
 struct ashmem_area {
@@ -46,12 +54,17 @@ struct ashmem_area {
 	struct file *file;		/* the shmem-based backing file */
 	size_t size;			/* size of the mapping, in bytes */
 	unsigned long prot_mask;	/* allowed prot bits, as vm_flags */
+	struct mutex lock;		/* protects the area and its ranges */
+#ifdef CONFIG_ASHMEM_COMPRESS
+	struct radix_tree_root zpages;	/* compressed pages, by index */
+#endif
 };
 
 /*
  * ashmem_range - represents an interval of unpinned (evictable) pages
  * Lifecycle: From unpin to pin
- * Locking: Protected by `ashmem_mutex'
+ * Locking: Protected by its area's `lock'; the lru entry is additionally
+ * protected by `ashmem_lru_lock'
  */
 struct ashmem_range {
 	struct list_head lru;		/* entry in LRU list */
@@ -62,22 +75,74 @@ struct ashmem_range {
 	unsigned int purged;		/* ASHMEM_NOT or ASHMEM_WAS_PURGED */
 };
 
-/* LRU list of unpinned pages, protected by ashmem_mutex */
+#ifdef CONFIG_ASHMEM_COMPRESS
+/*
+ * ashmem_zpage - compressed copy of a page of an unpinned range
+ * Lifecycle: From the shrinker compressing the page until it is pinned,
+ * purged, or its area released
+ * Locking: Protected by `asma->lock'
+ */
+struct ashmem_zpage {
+	pgoff_t index;			/* page index within the area */
+	struct page *page;		/* xvmalloc page holding the data */
+	u32 offset;			/* offset of the data in that page */
+	u32 len;			/* compressed length, in bytes */
+	unsigned int aged;		/* stayed cold for a shrinker pass */
+};
+#endif
+
+/* LRU list of unpinned pages, protected by ashmem_lru_lock */
 static LIST_HEAD(ashmem_lru_list);
 
-/* Count of pages on our LRU list, protected by ashmem_mutex */
+/*
+ * Count of pages on our LRU list, protected by ashmem_lru_lock. Pages held
+ * compressed are included; see ashmem_lru_pages().
+ */
 static unsigned long lru_count;
 
 /*
- * ashmem_mutex - protects the list of and each individual ashmem_area
+ * ashmem_lru_lock - protects the LRU list and lru_count
  *
- * Lock Ordering: ashmex_mutex -> i_mutex -> i_alloc_sem
+ * Lock Ordering: asma->lock -> ashmem_lru_lock, and asma->lock -> i_mutex ->
+ * i_alloc_sem. The shrinker walks the LRU under ashmem_lru_lock and so may
+ * only trylock an area from there.
  */
-static DEFINE_MUTEX(ashmem_mutex);
+static DEFINE_SPINLOCK(ashmem_lru_lock);
 
 static struct kmem_cache *ashmem_area_cachep __read_mostly;
 static struct kmem_cache *ashmem_range_cachep __read_mostly;
 
+#ifdef CONFIG_ASHMEM_COMPRESS
+static struct kmem_cache *ashmem_zpage_cachep __read_mostly;
+
+/* Pool holding compressed pages of all areas */
+static struct xv_pool *ashmem_zpool;
+
+/* Number of pages held compressed, all of them in ranges on the LRU */
+static atomic_t ashmem_zcount = ATOMIC_INIT(0);
+
+/*
+ * ashmem_zmutex - protects the compression buffers
+ *
+ * Lock Ordering: asma->lock -> ashmem_zmutex
+ */
+static DEFINE_MUTEX(ashmem_zmutex);
+static void *ashmem_zbuf;
+static void *ashmem_zwrkmem;
+
+/*
+ * Cap on the compressed store, in percent of RAM. Once the pool is that big
+ * cold pages are purged instead, along with what they had compressed.
+ */
+static unsigned int compress_max_pct = 10;
+module_param(compress_max_pct, uint, 0644);
+MODULE_PARM_DESC(compress_max_pct,
+		 "Max size of the compressed store, in percent of RAM");
+
+/* Pages that do not compress below this are purged, not stored */
+#define ASHMEM_MAX_ZPAGE_SIZE	(PAGE_SIZE / 4 * 3)
+#endif
+
 #define range_size(range) \
   ((range)->pgend - (range)->pgstart + 1)
 
@@ -104,14 +169,54 @@ static struct kmem_cache *ashmem_range_cachep __read_mostly;
 
 static inline void lru_add(struct ashmem_range *range)
 {
+	spin_lock(&ashmem_lru_lock);
 	list_add_tail(&range->lru, &ashmem_lru_list);
 	lru_count += range_size(range);
+	spin_unlock(&ashmem_lru_lock);
 }
 
 static inline void lru_del(struct ashmem_range *range)
 {
+	spin_lock(&ashmem_lru_lock);
 	list_del(&range->lru);
 	lru_count -= range_size(range);
+	spin_unlock(&ashmem_lru_lock);
+}
+
+/*
+ * ashmem_lru_pages - pages on the LRU that still take a page of memory each,
+ * i.e. not counting those already held compressed
+ */
+static unsigned long ashmem_lru_pages(void)
+{
+	unsigned long count = lru_count;
+#ifdef CONFIG_ASHMEM_COMPRESS
+	unsigned long zcount = atomic_read(&ashmem_zcount);
+
+	count = count > zcount ? count - zcount : 0;
+#endif
+	return count;
+}
+
+/*
+ * range_insert - initialize an already allocated ashmem_range and link it
+ * in front of 'prev_range' in the sorted asma->unpinned list
+ *
+ * Caller must hold asma->lock.
+ */
+static void range_insert(struct ashmem_range *range, struct ashmem_area *asma,
+			 struct ashmem_range *prev_range, unsigned int purged,
+			 size_t start, size_t end)
+{
+	range->asma = asma;
+	range->pgstart = start;
+	range->pgend = end;
+	range->purged = purged;
+
+	list_add_tail(&range->unpinned, &prev_range->unpinned);
+
+	if (range_on_lru(range))
+		lru_add(range);
 }
 
 /*
@@ -123,7 +228,7 @@ static inline void lru_del(struct ashmem_range *range)
  * 'start' - starting page, inclusive
  * 'end' - ending page, inclusive
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->lock.
  */
 static int range_alloc(struct ashmem_area *asma,
 		       struct ashmem_range *prev_range, unsigned int purged,
@@ -135,15 +240,7 @@ static int range_alloc(struct ashmem_area *asma,
 	if (unlikely(!range))
 		return -ENOMEM;
 
-	range->asma = asma;
-	range->pgstart = start;
-	range->pgend = end;
-	range->purged = purged;
-
-	list_add_tail(&range->unpinned, &prev_range->unpinned);
-
-	if (range_on_lru(range))
-		lru_add(range);
+	range_insert(range, asma, prev_range, purged, start, end);
 
 	return 0;
 }
@@ -159,7 +256,7 @@ static void range_del(struct ashmem_range *range)
 /*
  * range_shrink - shrinks a range
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->lock.
  */
 static inline void range_shrink(struct ashmem_range *range,
 				size_t start, size_t end)
@@ -169,10 +266,350 @@ static inline void range_shrink(struct ashmem_range *range,
 	range->pgstart = start;
 	range->pgend = end;
 
-	if (range_on_lru(range))
+	if (range_on_lru(range)) {
+		spin_lock(&ashmem_lru_lock);
 		lru_count -= pre - range_size(range);
+		spin_unlock(&ashmem_lru_lock);
+	}
+}
+
+/*
+ * purge_map_set - mark pages [start, end] as lost in a ASHMEM_PIN_PURGE_MAP
+ * bitmap whose first bit stands for page 'pgstart'
+ */
+static void purge_map_set(u8 *map, size_t pgstart, size_t start, size_t end)
+{
+	size_t bit;
+
+	if (!map)
+		return;
+
+	for (bit = start - pgstart; bit <= end - pgstart; bit++)
+		map[bit / 8] |= 1 << (bit % 8);
+}
+
+#ifdef CONFIG_ASHMEM_COMPRESS
+/*
+ * Caller must hold asma->lock.
+ */
+static void ashmem_zpage_free(struct ashmem_area *asma,
+			      struct ashmem_zpage *zpage)
+{
+	radix_tree_delete(&asma->zpages, zpage->index);
+	xv_free(ashmem_zpool, zpage->page, zpage->offset);
+	kmem_cache_free(ashmem_zpage_cachep, zpage);
+	atomic_dec(&ashmem_zcount);
+}
+
+/*
+ * ashmem_zpages_drop - forget the compressed copies of pages [start, end]
+ *
+ * Caller must hold asma->lock.
+ */
+static void ashmem_zpages_drop(struct ashmem_area *asma, size_t start,
+			       size_t end)
+{
+	struct ashmem_zpage *zpages[16];
+	unsigned int i, nr;
+
+	do {
+		nr = radix_tree_gang_lookup(&asma->zpages, (void **) zpages,
+					    start, ARRAY_SIZE(zpages));
+		for (i = 0; i < nr; i++) {
+			if (zpages[i]->index > end)
+				return;
+			start = zpages[i]->index + 1;
+			ashmem_zpage_free(asma, zpages[i]);
+		}
+	} while (nr == ARRAY_SIZE(zpages));
+}
+
+static int ashmem_zstore_full(void)
+{
+	u64 max = (u64) totalram_pages * compress_max_pct / 100;
+
+	return xv_get_total_size_bytes(ashmem_zpool) >> PAGE_SHIFT >= max;
+}
+
+/*
+ * ashmem_compress_page - store a compressed copy of page 'pgoff'
+ *
+ * Returns 0 if the page is now held compressed (so it may be truncated), 1 if
+ * it is not in the page cache and there is nothing to do, or a negative errno
+ * if it could not be compressed and has to be purged.
+ *
+ * Caller must hold asma->lock.
+ */
+static int ashmem_compress_page(struct ashmem_area *asma, pgoff_t pgoff)
+{
+	struct ashmem_zpage *zpage;
+	struct page *page;
+	size_t clen;
+	void *src, *dst;
+	int ret;
+
+	page = find_lock_page(asma->file->f_mapping, pgoff);
+	if (!page)
+		return 1;
+
+	/* touched while unpinned and compressed: the old copy is stale */
+	zpage = radix_tree_lookup(&asma->zpages, pgoff);
+	if (zpage)
+		ashmem_zpage_free(asma, zpage);
+
+	ret = -ENOMEM;
+	zpage = kmem_cache_alloc(ashmem_zpage_cachep,
+				 GFP_NOIO | __GFP_NOWARN);
+	if (unlikely(!zpage))
+		goto out;
+
+	mutex_lock(&ashmem_zmutex);
+	src = kmap_atomic(page, KM_USER0);
+	ret = lzo1x_1_compress(src, PAGE_SIZE, ashmem_zbuf, &clen,
+			       ashmem_zwrkmem);
+	kunmap_atomic(src, KM_USER0);
+
+	if (unlikely(ret != LZO_E_OK) || clen > ASHMEM_MAX_ZPAGE_SIZE) {
+		ret = -E2BIG;
+		goto out_unlock;
+	}
+
+	ret = xv_malloc(ashmem_zpool, clen, &zpage->page, &zpage->offset,
+			GFP_NOIO | __GFP_NOWARN | __GFP_NOMEMALLOC);
+	if (unlikely(ret))
+		goto out_unlock;
+
+	dst = kmap_atomic(zpage->page, KM_USER0);
+	memcpy(dst + zpage->offset, ashmem_zbuf, clen);
+	kunmap_atomic(dst, KM_USER0);
+	mutex_unlock(&ashmem_zmutex);
+
+	zpage->index = pgoff;
+	zpage->len = clen;
+	zpage->aged = 0;
+
+	ret = radix_tree_insert(&asma->zpages, pgoff, zpage);
+	if (unlikely(ret)) {
+		xv_free(ashmem_zpool, zpage->page, zpage->offset);
+		kmem_cache_free(ashmem_zpage_cachep, zpage);
+		goto out;
+	}
+	atomic_inc(&ashmem_zcount);
+	goto out;
+
+out_unlock:
+	mutex_unlock(&ashmem_zmutex);
+	kmem_cache_free(ashmem_zpage_cachep, zpage);
+out:
+	unlock_page(page);
+	page_cache_release(page);
+	return ret;
+}
+
+/*
+ * ashmem_zpages_age - age the compressed pages of the cold interval
+ * [start, end]. Returns nonzero if one of them was already cold on the
+ * previous pass, so that the store gives memory back under pressure too.
+ *
+ * Caller must hold asma->lock.
+ */
+static int ashmem_zpages_age(struct ashmem_area *asma, size_t start,
+			     size_t end)
+{
+	struct ashmem_zpage *zpages[16];
+	int i, nr, aged = 0;
+
+	do {
+		nr = radix_tree_gang_lookup(&asma->zpages, (void **) zpages,
+					    start, ARRAY_SIZE(zpages));
+		for (i = 0; i < nr; i++) {
+			if (zpages[i]->index > end)
+				return aged;
+			start = zpages[i]->index + 1;
+			aged |= zpages[i]->aged;
+			zpages[i]->aged = 1;
+		}
+	} while (nr == ARRAY_SIZE(zpages));
+
+	return aged;
+}
+
+/*
+ * ashmem_compress_range - move the resident pages of [start, end] into the
+ * compressed store and drop them from the page cache
+ *
+ * Pages that are not resident, e.g. swapped out, are left alone. Returns
+ * nonzero if the store is full, a page could not be compressed or compressed
+ * pages of the interval stayed cold for two passes, in which case the caller
+ * is expected to purge the whole interval.
+ *
+ * Caller must hold asma->lock.
+ */
+static int ashmem_compress_range(struct ashmem_area *asma, size_t start,
+				 size_t end)
+{
+	struct inode *inode = asma->file->f_dentry->d_inode;
+	size_t pgoff, run = 0;
+	int compressed = 0, ret;
+
+	if (!ashmem_zpool || !compress_max_pct || ashmem_zstore_full())
+		return -ENOSPC;
+	if (ashmem_zpages_age(asma, start, end))
+		return -EAGAIN;
+
+	for (pgoff = start; pgoff <= end; pgoff++) {
+		ret = ashmem_compress_page(asma, pgoff);
+		if (ret < 0)
+			return ret;
+
+		if (!ret && !compressed) {
+			run = pgoff;
+			compressed = 1;
+		} else if (ret && compressed) {
+			vmtruncate_range(inode, run * PAGE_SIZE,
+					 pgoff * PAGE_SIZE - 1);
+			compressed = 0;
+		}
+	}
+
+	if (compressed)
+		vmtruncate_range(inode, run * PAGE_SIZE,
+				 (end + 1) * PAGE_SIZE - 1);
+
+	return 0;
+}
+
+/*
+ * ashmem_decompress_range - bring the compressed pages of [start, end] back
+ * into the page cache as the interval is pinned
+ *
+ * A page that cannot be restored is lost: it is marked in 'map', if given,
+ * and ASHMEM_WAS_PURGED is returned. So is a page that was faulted in again
+ * while the interval was unpinned, which we must not overwrite.
+ *
+ * Caller must hold asma->lock.
+ */
+static int ashmem_decompress_range(struct ashmem_area *asma, size_t start,
+				   size_t end, u8 *map, size_t pgstart)
+{
+	struct address_space *mapping = asma->file->f_mapping;
+	struct inode *inode = mapping->host;
+	struct ashmem_zpage *zpage;
+	struct page *page;
+	void *fsdata, *src, *dst;
+	size_t pgoff, len;
+	loff_t pos;
+	int ret = ASHMEM_NOT_PURGED, err;
+
+	mutex_lock(&inode->i_mutex);
+	while (radix_tree_gang_lookup(&asma->zpages, (void **) &zpage,
+				      start, 1)) {
+		if (zpage->index > end)
+			break;
+		pgoff = zpage->index;
+		start = pgoff + 1;
+
+		/* do not let the write push i_size past the area's size */
+		pos = (loff_t) pgoff << PAGE_SHIFT;
+		len = min_t(loff_t, PAGE_SIZE, i_size_read(inode) - pos);
+
+		err = pagecache_write_begin(asma->file, mapping, pos, len, 0,
+					    &page, &fsdata);
+		if (likely(!err) && PageUptodate(page)) {
+			pagecache_write_end(asma->file, mapping, pos, len, 0,
+					    page, fsdata);
+			err = -EEXIST;
+		} else if (likely(!err)) {
+			size_t dlen = PAGE_SIZE;
+
+			src = kmap_atomic(zpage->page, KM_USER0);
+			dst = kmap_atomic(page, KM_USER1);
+			err = lzo1x_decompress_safe(src + zpage->offset,
+						    zpage->len, dst, &dlen);
+			if (unlikely(err != LZO_E_OK || dlen != PAGE_SIZE)) {
+				memset(dst, 0, PAGE_SIZE);
+				err = -EIO;
+			}
+			kunmap_atomic(dst, KM_USER1);
+			kunmap_atomic(src, KM_USER0);
+			flush_dcache_page(page);
+
+			pagecache_write_end(asma->file, mapping, pos, len, len,
+					    page, fsdata);
+		}
+
+		if (unlikely(err)) {
+			purge_map_set(map, pgstart, pgoff, pgoff);
+			ret = ASHMEM_WAS_PURGED;
+		}
+		ashmem_zpage_free(asma, zpage);
+	}
+	mutex_unlock(&inode->i_mutex);
+
+	return ret;
+}
+
+/*
+ * ashmem_compress_init - set up the compressed store. Failing that, ashmem
+ * carries on and cold pages are simply purged.
+ */
+static void __init ashmem_compress_init(void)
+{
+	ashmem_zpage_cachep = kmem_cache_create("ashmem_zpage_cache",
+					  sizeof(struct ashmem_zpage),
+					  0, 0, NULL);
+	ashmem_zbuf = (void *) __get_free_pages(GFP_KERNEL, 1);
+	ashmem_zwrkmem = vmalloc(LZO1X_1_MEM_COMPRESS);
+	if (ashmem_zpage_cachep && ashmem_zbuf && ashmem_zwrkmem)
+		ashmem_zpool = xv_create_pool();
+
+	if (unlikely(!ashmem_zpool)) {
+		printk(KERN_WARNING "ashmem: compressed store disabled\n");
+		if (ashmem_zpage_cachep)
+			kmem_cache_destroy(ashmem_zpage_cachep);
+		free_pages((unsigned long) ashmem_zbuf, 1);
+		vfree(ashmem_zwrkmem);
+	}
+}
+
+static void __exit ashmem_compress_exit(void)
+{
+	if (!ashmem_zpool)
+		return;
+
+	xv_destroy_pool(ashmem_zpool);
+	kmem_cache_destroy(ashmem_zpage_cachep);
+	free_pages((unsigned long) ashmem_zbuf, 1);
+	vfree(ashmem_zwrkmem);
+}
+#else
+static inline void ashmem_zpages_drop(struct ashmem_area *asma, size_t start,
+				      size_t end)
+{
+}
+
+static inline int ashmem_compress_range(struct ashmem_area *asma,
+					size_t start, size_t end)
+{
+	return -ENOSYS;
+}
+
+static inline int ashmem_decompress_range(struct ashmem_area *asma,
+					  size_t start, size_t end, u8 *map,
+					  size_t pgstart)
+{
+	return ASHMEM_NOT_PURGED;
 }
 
+static inline void ashmem_compress_init(void)
+{
+}
+
+static inline void ashmem_compress_exit(void)
+{
+}
+#endif
+
 static int ashmem_open(struct inode *inode, struct file *file)
 {
 	struct ashmem_area *asma;
@@ -187,6 +624,10 @@ static int ashmem_open(struct inode *inode, struct file *file)
 		return -ENOMEM;
 
 	INIT_LIST_HEAD(&asma->unpinned_list);
+	mutex_init(&asma->lock);
+#ifdef CONFIG_ASHMEM_COMPRESS
+	INIT_RADIX_TREE(&asma->zpages, GFP_NOIO | __GFP_NOWARN);
+#endif
 	memcpy(asma->name, ASHMEM_NAME_PREFIX, ASHMEM_NAME_PREFIX_LEN);
 	asma->prot_mask = PROT_MASK;
 	file->private_data = asma;
@@ -199,10 +640,11 @@ static int ashmem_release(struct inode *ignored, struct file *file)
 	struct ashmem_area *asma = file->private_data;
 	struct ashmem_range *range, *next;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->lock);
 	list_for_each_entry_safe(range, next, &asma->unpinned_list, unpinned)
 		range_del(range);
-	mutex_unlock(&ashmem_mutex);
+	ashmem_zpages_drop(asma, 0, ULONG_MAX);
+	mutex_unlock(&asma->lock);
 
 	if (asma->file)
 		fput(asma->file);
@@ -216,7 +658,7 @@ static int ashmem_mmap(struct file *file, struct vm_area_struct *vma)
 	struct ashmem_area *asma = file->private_data;
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->lock);
 
 	/* user needs to SET_SIZE before mapping */
 	if (unlikely(!asma->size)) {
@@ -257,10 +699,184 @@ static int ashmem_mmap(struct file *file, struct vm_area_struct *vma)
 	vma->vm_flags |= VM_CAN_NONLINEAR;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->lock);
 	return ret;
 }
 
+/*
+ * ashmem_page_referenced - was this unpinned page used since we last looked?
+ *
+ * Tests and clears both the page's referenced flag and the young bits of any
+ * ptes mapping it, so a page has to be touched again between two passes of
+ * the shrinker to survive the second. Pages not in the page cache (never
+ * faulted in, or already swapped out) count as cold.
+ */
+static int ashmem_page_referenced(struct address_space *mapping, pgoff_t index)
+{
+	struct page *page;
+	unsigned long vm_flags;
+	int referenced;
+
+	page = find_get_page(mapping, index);
+	if (!page)
+		return 0;
+
+	referenced = page_referenced(page, 0, NULL, &vm_flags);
+	page_cache_release(page);
+
+	return referenced;
+}
+
+/*
+ * range_purge - discard pages [start, end] of an unpinned range
+ *
+ * Only those pages are marked purged: the pages above 'end' get a range of
+ * their own, as do the purged ones, and 'range' keeps what is left below
+ * 'start' (or becomes the purged range if there is nothing left). We are
+ * usually called from the shrinker, so the split is allocated with GFP_NOFS
+ * and, if that fails, we fall back to purging the whole range.
+ *
+ * Caller must hold asma->lock.
+ */
+static void range_purge(struct ashmem_range *range, size_t start, size_t end)
+{
+	struct ashmem_area *asma = range->asma;
+	struct inode *inode = asma->file->f_dentry->d_inode;
+	struct ashmem_range *upper = NULL, *purged = NULL;
+
+	if (end < range->pgend)
+		upper = kmem_cache_zalloc(ashmem_range_cachep,
+					  GFP_NOFS | __GFP_NOWARN);
+	if (start > range->pgstart)
+		purged = kmem_cache_zalloc(ashmem_range_cachep,
+					   GFP_NOFS | __GFP_NOWARN);
+
+	if (unlikely((end < range->pgend && !upper) ||
+		     (start > range->pgstart && !purged))) {
+		if (upper)
+			kmem_cache_free(ashmem_range_cachep, upper);
+		if (purged)
+			kmem_cache_free(ashmem_range_cachep, purged);
+		upper = purged = NULL;
+		start = range->pgstart;
+		end = range->pgend;
+	}
+
+	vmtruncate_range(inode, start * PAGE_SIZE, (end + 1) * PAGE_SIZE - 1);
+	ashmem_zpages_drop(asma, start, end);
+
+	if (upper)
+		range_insert(upper, asma, range, ASHMEM_NOT_PURGED,
+			     end + 1, range->pgend);
+
+	if (purged) {
+		range_insert(purged, asma, range, ASHMEM_WAS_PURGED,
+			     start, end);
+		range_shrink(range, range->pgstart, start - 1);
+	} else {
+		range_shrink(range, start, end);
+		lru_del(range);
+		range->purged = ASHMEM_WAS_PURGED;
+	}
+}
+
+/*
+ * range_evict - get the cold pages [start, end] of an unpinned range out of
+ * memory, compressing them while the store has room and purging them
+ * otherwise
+ *
+ * Caller must hold asma->lock.
+ */
+static void range_evict(struct ashmem_range *range, size_t start, size_t end)
+{
+	if (ashmem_compress_range(range->asma, start, end))
+		range_purge(range, start, end);
+}
+
+/*
+ * range_age - evict the pages of an unpinned range that have not been
+ * referenced since the last pass, leaving the recently used ones in place
+ *
+ * The range is walked from the top down, so that each purge only ever splits
+ * off ranges above the part still to be scanned. Returns the number of pages
+ * scanned.
+ *
+ * Caller must hold asma->lock.
+ */
+static size_t range_age(struct ashmem_range *range)
+{
+	struct address_space *mapping = range->asma->file->f_mapping;
+	size_t scanned = range_size(range);
+	size_t pgoff = range->pgend, cold_end = 0;
+	int cold = 0;
+
+	for (;;) {
+		if (!ashmem_page_referenced(mapping, pgoff)) {
+			if (!cold)
+				cold_end = pgoff;
+			cold = 1;
+		} else if (cold) {
+			range_evict(range, pgoff + 1, cold_end);
+			cold = 0;
+			/* we could not split, so the whole range went */
+			if (range->purged)
+				break;
+		}
+
+		if (pgoff == range->pgstart)
+			break;
+		pgoff--;
+	}
+
+	if (cold)
+		range_evict(range, range->pgstart, cold_end);
+
+	return scanned;
+}
+
+/*
+ * __ashmem_shrink - walk the LRU, aging ranges if 'age' or purging them
+ * outright otherwise, until 'nr_to_scan' pages have been looked at
+ *
+ * The LRU is only held while picking the next range; the range is rotated to
+ * the tail and its area trylocked before the LRU lock is dropped, which keeps
+ * the area alive (ashmem_release takes asma->lock to unlink its ranges). If
+ * the area is busy being pinned or unpinned we count the range as looked at
+ * and move on to the next one rather than wait for it.
+ */
+static int __ashmem_shrink(int nr_to_scan, int age)
+{
+	struct ashmem_range *range;
+	struct ashmem_area *asma;
+
+	spin_lock(&ashmem_lru_lock);
+	while (nr_to_scan > 0 && !list_empty(&ashmem_lru_list)) {
+		range = list_first_entry(&ashmem_lru_list,
+					 struct ashmem_range, lru);
+		list_move_tail(&range->lru, &ashmem_lru_list);
+
+		asma = range->asma;
+		if (!mutex_trylock(&asma->lock)) {
+			nr_to_scan -= range_size(range);
+			continue;
+		}
+		spin_unlock(&ashmem_lru_lock);
+
+		if (age)
+			nr_to_scan -= range_age(range);
+		else {
+			nr_to_scan -= range_size(range);
+			range_purge(range, range->pgstart, range->pgend);
+		}
+
+		mutex_unlock(&asma->lock);
+		spin_lock(&ashmem_lru_lock);
+	}
+	spin_unlock(&ashmem_lru_lock);
+
+	return ashmem_lru_pages();
+}
+
 /*
  * ashmem_shrink - our cache shrinker, called from mm/vmscan.c :: shrink_slab
  *
@@ -270,39 +886,25 @@ out:
  * 'gfp_mask' is the mask of the allocation that got us into this mess.
  *
  * Return value is the number of objects (pages) remaining, or -1 if we cannot
- * proceed without risk of deadlock (due to gfp_mask).
+ * proceed without risk of deadlock (due to gfp_mask). Pages already held
+ * compressed are not counted: purging them frees much less than a page.
  *
- * We approximate LRU via least-recently-unpinned, jettisoning unpinned partial
- * chunks of ashmem regions LRU-wise one-at-a-time until we hit 'nr_to_scan'
- * pages freed.
+ * We walk unpinned ranges least-recently-unpinned first and age their pages by
+ * the hardware reference bits: a page used since the previous pass is kept
+ * and only the cold pages in between are evicted, so a large cache loses just
+ * the part of it nobody has been touching. With CONFIG_ASHMEM_COMPRESS cold
+ * pages are compressed first and only purged once the compressed store is
+ * full, or once they have stayed cold for another pass.
  */
 static int ashmem_shrink(int nr_to_scan, gfp_t gfp_mask)
 {
-	struct ashmem_range *range, *next;
-
 	/* We might recurse into filesystem code, so bail out if necessary */
 	if (nr_to_scan && !(gfp_mask & __GFP_FS))
 		return -1;
 	if (!nr_to_scan)
-		return lru_count;
-
-	mutex_lock(&ashmem_mutex);
-	list_for_each_entry_safe(range, next, &ashmem_lru_list, lru) {
-		struct inode *inode = range->asma->file->f_dentry->d_inode;
-		loff_t start = range->pgstart * PAGE_SIZE;
-		loff_t end = (range->pgend + 1) * PAGE_SIZE - 1;
-
-		vmtruncate_range(inode, start, end);
-		range->purged = ASHMEM_WAS_PURGED;
-		lru_del(range);
+		return ashmem_lru_pages();
 
-		nr_to_scan -= range_size(range);
-		if (nr_to_scan <= 0)
-			break;
-	}
-	mutex_unlock(&ashmem_mutex);
-
-	return lru_count;
+	return __ashmem_shrink(nr_to_scan, 1);
 }
 
 static struct shrinker ashmem_shrinker = {
@@ -314,7 +916,7 @@ static int set_prot_mask(struct ashmem_area *asma, unsigned long prot)
 {
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->lock);
 
 	/* the user can only remove, not add, protection bits */
 	if (unlikely((asma->prot_mask & prot) != prot)) {
@@ -329,7 +931,7 @@ static int set_prot_mask(struct ashmem_area *asma, unsigned long prot)
 	asma->prot_mask = prot;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->lock);
 	return ret;
 }
 
@@ -337,7 +939,7 @@ static int set_name(struct ashmem_area *asma, void __user *name)
 {
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->lock);
 
 	/* cannot change an existing mapping's name */
 	if (unlikely(asma->file)) {
@@ -351,7 +953,7 @@ static int set_name(struct ashmem_area *asma, void __user *name)
 	asma->name[ASHMEM_FULL_NAME_LEN-1] = '\0';
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->lock);
 
 	return ret;
 }
@@ -360,7 +962,7 @@ static int get_name(struct ashmem_area *asma, void __user *name)
 {
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->lock);
 	if (asma->name[ASHMEM_NAME_PREFIX_LEN] != '\0') {
 		size_t len;
 
@@ -377,7 +979,7 @@ static int get_name(struct ashmem_area *asma, void __user *name)
 					  sizeof(ASHMEM_NAME_DEF))))
 			ret = -EFAULT;
 	}
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->lock);
 
 	return ret;
 }
@@ -385,10 +987,13 @@ static int get_name(struct ashmem_area *asma, void __user *name)
 /*
  * ashmem_pin - pin the given ashmem region, returning whether it was
  * previously purged (ASHMEM_WAS_PURGED) or not (ASHMEM_NOT_PURGED).
+ * Compressed pages are brought back in. If 'map' is given, the pages that
+ * were lost are marked in it.
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->lock.
  */
-static int ashmem_pin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
+static int ashmem_pin(struct ashmem_area *asma, size_t pgstart, size_t pgend,
+		      u8 *map)
 {
 	struct ashmem_range *range, *next;
 	int ret = ASHMEM_NOT_PURGED;
@@ -414,7 +1019,16 @@ static int ashmem_pin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 		 *    create a new range for the other side.
 		 */
 		if (page_range_in_range(range, pgstart, pgend)) {
-			ret |= range->purged;
+			size_t start = max(range->pgstart, pgstart);
+			size_t end = min(range->pgend, pgend);
+
+			if (range->purged) {
+				purge_map_set(map, pgstart, start, end);
+				ret |= range->purged;
+				ashmem_zpages_drop(asma, start, end);
+			} else
+				ret |= ashmem_decompress_range(asma, start, end,
+							       map, pgstart);
 
 			/* Case #1: Easy. Just nuke the whole thing. */
 			if (page_range_subsumes_range(range, pgstart, pgend)) {
@@ -452,7 +1066,7 @@ static int ashmem_pin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 /*
  * ashmem_unpin - unpin the given range of pages. Returns zero on success.
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->lock.
  */
 static int ashmem_unpin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 {
@@ -480,6 +1094,10 @@ restart:
 		}
 	}
 
+	/* a purged range must not keep compressed copies around */
+	if (purged)
+		ashmem_zpages_drop(asma, pgstart, pgend);
+
 	return range_alloc(asma, range, purged, pgstart, pgend);
 }
 
@@ -487,7 +1105,7 @@ restart:
  * ashmem_get_pin_status - Returns ASHMEM_IS_UNPINNED if _any_ pages in the
  * given interval are unpinned and ASHMEM_IS_PINNED otherwise.
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->lock.
  */
 static int ashmem_get_pin_status(struct ashmem_area *asma, size_t pgstart,
 				 size_t pgend)
@@ -511,7 +1129,9 @@ static int ashmem_pin_unpin(struct ashmem_area *asma, unsigned long cmd,
 			    void __user *p)
 {
 	struct ashmem_pin pin;
-	size_t pgstart, pgend;
+	struct ashmem_pin_purge_map pin_map;
+	size_t pgstart, pgend, map_len = 0;
+	u8 *map = NULL;
 	int ret = -EINVAL;
 
 	if (unlikely(!asma->file))
@@ -536,11 +1156,21 @@ static int ashmem_pin_unpin(struct ashmem_area *asma, unsigned long cmd,
 	pgstart = pin.offset / PAGE_SIZE;
 	pgend = pgstart + (pin.len / PAGE_SIZE) - 1;
 
-	mutex_lock(&ashmem_mutex);
+	if (cmd == ASHMEM_PIN_PURGE_MAP) {
+		if (unlikely(copy_from_user(&pin_map, p, sizeof(pin_map))))
+			return -EFAULT;
+		map_len = DIV_ROUND_UP(pgend - pgstart + 1, 8);
+		map = kzalloc(map_len, GFP_KERNEL);
+		if (unlikely(!map))
+			return -ENOMEM;
+	}
+
+	mutex_lock(&asma->lock);
 
 	switch (cmd) {
 	case ASHMEM_PIN:
-		ret = ashmem_pin(asma, pgstart, pgend);
+	case ASHMEM_PIN_PURGE_MAP:
+		ret = ashmem_pin(asma, pgstart, pgend, map);
 		break;
 	case ASHMEM_UNPIN:
 		ret = ashmem_unpin(asma, pgstart, pgend);
@@ -550,7 +1180,14 @@ static int ashmem_pin_unpin(struct ashmem_area *asma, unsigned long cmd,
 		break;
 	}
 
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->lock);
+
+	if (map) {
+		if (unlikely(copy_to_user((void __user *) (unsigned long)
+					  pin_map.purge_map, map, map_len)))
+			ret = -EFAULT;
+		kfree(map);
+	}
 
 	return ret;
 }
@@ -586,13 +1223,15 @@ static long ashmem_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	case ASHMEM_PIN:
 	case ASHMEM_UNPIN:
 	case ASHMEM_GET_PIN_STATUS:
+	case ASHMEM_PIN_PURGE_MAP:
 		ret = ashmem_pin_unpin(asma, cmd, (void __user *) arg);
 		break;
 	case ASHMEM_PURGE_ALL_CACHES:
 		ret = -EPERM;
 		if (capable(CAP_SYS_ADMIN)) {
 			ret = ashmem_shrink(0, GFP_KERNEL);
-			ashmem_shrink(ret, GFP_KERNEL);
+			/* compressed pages go too */
+			__ashmem_shrink(lru_count, 0);
 		}
 		break;
 	}
@@ -609,6 +1248,11 @@ static struct file_operations ashmem_fops = {
 	.compat_ioctl = ashmem_ioctl,
 };
 
+int is_ashmem_file(struct file *file)
+{
+	return file && file->f_op == &ashmem_fops;
+}
+
 static struct miscdevice ashmem_misc = {
 	.minor = MISC_DYNAMIC_MINOR,
 	.name = "ashmem",
@@ -635,6 +1279,8 @@ static int __init ashmem_init(void)
 		return -ENOMEM;
 	}
 
+	ashmem_compress_init();
+
 	ret = misc_register(&ashmem_misc);
 	if (unlikely(ret)) {
 		printk(KERN_ERR "ashmem: failed to register misc device!\n");
@@ -658,6 +1304,7 @@ static void __exit ashmem_exit(void)
 	if (unlikely(ret))
 		printk(KERN_ERR "ashmem: failed to unregister misc device!\n");
 
+	ashmem_compress_exit();
 	kmem_cache_destroy(ashmem_range_cachep);
 	kmem_cache_destroy(ashmem_area_cachep);
 
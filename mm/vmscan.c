@@ -40,6 +40,7 @@
 #include <linux/memcontrol.h>
 #include <linux/delayacct.h>
 #include <linux/sysctl.h>
+#include <linux/ktime.h>
 
 #include <asm/tlbflush.h>
 #include <asm/div64.h>
@@ -133,6 +134,20 @@ long vm_total_pages;	/* The total number of pages which the VM controls */
 static LIST_HEAD(shrinker_list);
 static DECLARE_RWSEM(shrinker_rwsem);
 
+static atomic_long_t vm_pressure_scanned = ATOMIC_LONG_INIT(0);
+static atomic_long_t vm_pressure_reclaimed = ATOMIC_LONG_INIT(0);
+static atomic_long_t vm_pressure_stalls = ATOMIC_LONG_INIT(0);
+static atomic_long_t vm_pressure_stall_us = ATOMIC_LONG_INIT(0);
+
+void vm_pressure_sample(struct vm_pressure *p)
+{
+	p->scanned = atomic_long_read(&vm_pressure_scanned);
+	p->reclaimed = atomic_long_read(&vm_pressure_reclaimed);
+	p->stalls = atomic_long_read(&vm_pressure_stalls);
+	p->stall_us = atomic_long_read(&vm_pressure_stall_us);
+}
+EXPORT_SYMBOL_GPL(vm_pressure_sample);
+
 #ifdef CONFIG_CGROUP_MEM_RES_CTLR
 #define scanning_global_lru(sc)	(!(sc)->mem_cgroup)
 #else
@@ -1598,6 +1613,7 @@ static void shrink_zone(int priority, struct zone *zone,
 	unsigned long percent[2];	/* anon @ 0; file @ 1 */
 	enum lru_list l;
 	unsigned long nr_reclaimed = sc->nr_reclaimed;
+	unsigned long nr_scanned = sc->nr_scanned;
 	unsigned long swap_cluster_max = sc->swap_cluster_max;
 
 	get_scan_ratio(zone, sc, percent);
@@ -1643,6 +1659,12 @@ static void shrink_zone(int priority, struct zone *zone,
 			break;
 	}
 
+	if (scanning_global_lru(sc)) {
+		atomic_long_add(sc->nr_scanned - nr_scanned,
+				&vm_pressure_scanned);
+		atomic_long_add(nr_reclaimed - sc->nr_reclaimed,
+				&vm_pressure_reclaimed);
+	}
 	sc->nr_reclaimed = nr_reclaimed;
 
 	/*
@@ -1837,8 +1859,15 @@ unsigned long try_to_free_pages(struct zonelist *zonelist, int order,
 		.isolate_pages = isolate_pages_global,
 		.nodemask = nodemask,
 	};
+	ktime_t start = ktime_get();
+	unsigned long ret;
 
-	return do_try_to_free_pages(zonelist, &sc);
+	ret = do_try_to_free_pages(zonelist, &sc);
+
+	atomic_long_inc(&vm_pressure_stalls);
+	atomic_long_add(ktime_us_delta(ktime_get(), start),
+			&vm_pressure_stall_us);
+	return ret;
 }
 
 #ifdef CONFIG_CGROUP_MEM_RES_CTLR